@@ -1088,6 +1088,10 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
 void cpu_tlb_update_dirty(CPUState *env);
 
+/* Incremented whenever guest virtual to physical mappings may have changed.
+   Translation caches kept outside of the TLB must check it. */
+extern unsigned int tlb_generation;
+
 int cpu_physical_memory_set_dirty_tracking(int enable);
 
 int cpu_physical_memory_get_dirty_tracking(void);
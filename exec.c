@@ -50,6 +50,7 @@
 #ifdef CONFIG_S2E
 #include <cpu-all.h>
 #include <s2e/s2e_qemu.h>
+#include "tcg-llvm.h"
 #endif
 
 //#define DEBUG_TB_INVALIDATE
@@ -203,6 +204,8 @@ FILE *logfile;
 int loglevel;
 static int log_append = 0;
 
+unsigned int tlb_generation;
+
 /* statistics */
 static int tlb_flush_count;
 static int tb_flush_count;
@@ -796,6 +799,8 @@ static inline void tb_reset_jump(TranslationBlock *tb, int n)
     tb_set_jmp_target(tb, n, (unsigned long)(tb->tc_ptr + tb->tb_next_offset[n]));
 #ifdef CONFIG_S2E
     tb->s2e_tb_next[n] = NULL;
+    /* stops the running trace at its next tb */
+    tcg_llvm_runtime.tb_unlink_count++;
 #endif
 
 }
@@ -1890,6 +1895,7 @@ void tlb_flush(CPUState *env, int flush_global)
     }
 #endif
     tlb_flush_count++;
+    tlb_generation++;
 }
 
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
@@ -1933,6 +1939,7 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
         }
 
     tlb_flush_jmp_cache(env, addr);
+    tlb_generation++;
 }
 
 /* update the TLBs so that writes to code in the virtual page 'addr'
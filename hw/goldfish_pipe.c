@@ -801,6 +801,20 @@ static const GoldfishPipeFuncs  throttlePipe_funcs = {
  *****
  *****/
 
+/* Maximum number of host buffers passed to the pipe services for a
+ * single transfer. Contiguous pages are merged into one buffer, larger
+ * transfers are truncated and the guest will issue the remainder. */
+#define PIPE_MAX_BUFFERS  64
+
+/* Number of entries of the virtual page to host page cache. */
+#define PIPE_TRANSLATION_CACHE_SIZE  16
+
+typedef struct {
+    uint32_t      page;
+    unsigned int  generation;
+    uint8_t*      host;
+} PipeTranslation;
+
 struct PipeDevice {
     struct goldfish_device dev;
 
@@ -816,8 +830,81 @@ struct PipeDevice {
     uint32_t  status;
     uint32_t  channel;
     uint32_t  wakes;
+
+    /* recent guest page translations, valid until the next TLB flush */
+    PipeTranslation  translations[PIPE_TRANSLATION_CACHE_SIZE];
 };
 
+/* Return the host address of the guest virtual page 'page', or NULL
+ * if it is not mapped. */
+static uint8_t*
+pipeDevice_translatePage( PipeDevice* dev, CPUState* env, uint32_t page )
+{
+    PipeTranslation*    t = &dev->translations[(page >> TARGET_PAGE_BITS) &
+                                               (PIPE_TRANSLATION_CACHE_SIZE - 1)];
+    target_phys_addr_t  phys;
+
+    if (t->host != NULL && t->page == page && t->generation == tlb_generation) {
+        return t->host;
+    }
+
+    phys = cpu_get_phys_page_debug(env, page);
+    if (phys == -1) {
+        return NULL;
+    }
+
+    t->page       = page;
+    t->generation = tlb_generation;
+    t->host       = qemu_get_ram_ptr(phys);
+    return t->host;
+}
+
+/* Build the list of host buffers that map the guest buffer described by
+ * dev->address and dev->size. Returns the number of buffers, or -1 if
+ * the first page of the guest buffer is not mapped. */
+static int
+pipeDevice_getBuffers( PipeDevice* dev, CPUState* env,
+                       GoldfishPipeBuffer* buffers, int maxBuffers )
+{
+    uint32_t  address   = dev->address;
+    uint32_t  remaining = dev->size;
+    int       count     = 0;
+
+    while (remaining > 0) {
+        uint32_t  page  = address & TARGET_PAGE_MASK;
+        uint32_t  avail = page + TARGET_PAGE_SIZE - address;
+        uint8_t*  host;
+
+        if (avail > remaining) {
+            avail = remaining;
+        }
+
+        host = pipeDevice_translatePage(dev, env, page);
+        if (host == NULL) {
+            if (count == 0) {
+                return -1;
+            }
+            break;
+        }
+        host += address - page;
+
+        if (count > 0 && buffers[count-1].data + buffers[count-1].size == host) {
+            buffers[count-1].size += avail;
+        } else {
+            if (count == maxBuffers) {
+                break;
+            }
+            buffers[count].data = host;
+            buffers[count].size = avail;
+            count++;
+        }
+
+        address   += avail;
+        remaining -= avail;
+    }
+    return count;
+}
+
 
 static void
 pipeDevice_doCommand( PipeDevice* dev, uint32_t command )
@@ -872,13 +959,15 @@ pipeDevice_doCommand( PipeDevice* dev, uint32_t command )
 
     case PIPE_CMD_READ_BUFFER: {
         /* Translate virtual address into physical one, into emulator memory. */
-        GoldfishPipeBuffer  buffer;
-        uint32_t            address = dev->address;
-        uint32_t            page    = address & TARGET_PAGE_MASK;
-        target_phys_addr_t  phys = cpu_get_phys_page_debug(env, page);
-        buffer.data = qemu_get_ram_ptr(phys) + (address - page);
-        buffer.size = dev->size;
-        dev->status = pipe->funcs->recvBuffers(pipe->opaque, &buffer, 1);
+        GoldfishPipeBuffer  buffers[PIPE_MAX_BUFFERS];
+        int                 count;
+
+        count = pipeDevice_getBuffers(dev, env, buffers, PIPE_MAX_BUFFERS);
+        if (count < 0) {
+            dev->status = PIPE_ERROR_INVAL;
+            break;
+        }
+        dev->status = pipe->funcs->recvBuffers(pipe->opaque, buffers, count);
         DD("%s: CMD_READ_BUFFER channel=0x%x address=0x%08x size=%d > status=%d",
            __FUNCTION__, dev->channel, dev->address, dev->size, dev->status);
         break;
@@ -886,13 +975,15 @@ pipeDevice_doCommand( PipeDevice* dev, uint32_t command )
 
     case PIPE_CMD_WRITE_BUFFER: {
         /* Translate virtual address into physical one, into emulator memory. */
-        GoldfishPipeBuffer  buffer;
-        uint32_t            address = dev->address;
-        uint32_t            page    = address & TARGET_PAGE_MASK;
-        target_phys_addr_t  phys = cpu_get_phys_page_debug(env, page);
-        buffer.data = qemu_get_ram_ptr(phys) + (address - page);
-        buffer.size = dev->size;
-        dev->status = pipe->funcs->sendBuffers(pipe->opaque, &buffer, 1);
+        GoldfishPipeBuffer  buffers[PIPE_MAX_BUFFERS];
+        int                 count;
+
+        count = pipeDevice_getBuffers(dev, env, buffers, PIPE_MAX_BUFFERS);
+        if (count < 0) {
+            dev->status = PIPE_ERROR_INVAL;
+            break;
+        }
+        dev->status = pipe->funcs->sendBuffers(pipe->opaque, buffers, count);
         DD("%s: CMD_WRITE_BUFFER channel=0x%x address=0x%08x size=%d > status=%d",
            __FUNCTION__, dev->channel, dev->address, dev->size, dev->status);
         break;
@@ -2,39 +2,155 @@
 
 #define _S2E_MEMORY_CACHE_
 
+#include <new>
 #include <vector>
 #include <inttypes.h>
 #include <llvm/ADT/SmallVector.h>
 #include <iostream>
 
+#include "Slab.h"
+
 namespace s2e {
 
+/**
+ *  Third-level arrays all have the same size and are allocated and
+ *  freed all the time (flushes, forks), so they come from a dedicated
+ *  slab instead of the general purpose heap.
+ */
+template <unsigned SIZE>
+class MemoryCacheAllocator
+{
+private:
+    static SlabAllocator *s_slab;
+    static bool s_slabBroken;
+
+    static unsigned getSizePo2() {
+        unsigned po2 = 3;
+        while ((1u << po2) < SIZE) {
+            ++po2;
+        }
+        return po2;
+    }
+
+public:
+    static void *alloc() {
+        unsigned po2 = getSizePo2();
+        if (po2 > SlabAllocator::MAX_BLOCK_PO2) {
+            return ::operator new(SIZE);
+        }
+
+        if (s_slabBroken) {
+            return ::operator new(SIZE);
+        }
+
+        if (!s_slab) {
+            s_slab = new SlabAllocator(po2, po2);
+            if (!s_slab->selfTest()) {
+                std::cerr << "MemoryCacheAllocator: the slab allocator failed"
+                        " its self test, using the heap" << std::endl;
+                delete s_slab;
+                s_slab = NULL;
+                s_slabBroken = true;
+                return ::operator new(SIZE);
+            }
+        }
+
+        void *ret = (void*) s_slab->alloc(SIZE);
+        return ret ? ret : ::operator new(SIZE);
+    }
+
+    static void free(void *p) {
+        if (!s_slab || !s_slab->free((uintptr_t) p)) {
+            ::operator delete(p);
+        }
+    }
+};
+
+template <unsigned SIZE>
+SlabAllocator *MemoryCacheAllocator<SIZE>::s_slab = NULL;
+
+template <unsigned SIZE>
+bool MemoryCacheAllocator<SIZE>::s_slabBroken = false;
+
+/**
+ *  Three-level table of objects. Second and third levels are reference
+ *  counted so that a copy of the cache (e.g., on state fork) shares all
+ *  of them with the original and only copies a level on the first write.
+ */
 template <class T, unsigned OBJSIZE_BITS, unsigned PAGESIZE_BITS, unsigned SUPERPAGESIZE_BITS>
 class MemoryCache
 {
 private:
+    //The array is allocated separately from the reference count, so
+    //that its size remains a power of two and fits its slab class exactly
     struct ThirdLevel {
-        T level3[1<<(PAGESIZE_BITS-OBJSIZE_BITS)];
+        enum { COUNT = 1<<(PAGESIZE_BITS-OBJSIZE_BITS) };
+        typedef MemoryCacheAllocator<sizeof(T) * COUNT> ArrayAllocator;
+
+        unsigned refCount;
+        T *level3;
+
         ThirdLevel() {
-            for (unsigned i=0; i<(1<<(PAGESIZE_BITS-OBJSIZE_BITS)); ++i) {
-                level3[i] = T();
+            refCount = 1;
+            level3 = static_cast<T*>(ArrayAllocator::alloc());
+            for (unsigned i=0; i<COUNT; ++i) {
+                new (&level3[i]) T();
             }
         }
+
+        ThirdLevel(const ThirdLevel &one) {
+            refCount = 1;
+            level3 = static_cast<T*>(ArrayAllocator::alloc());
+            for (unsigned i=0; i<COUNT; ++i) {
+                new (&level3[i]) T(one.level3[i]);
+            }
+        }
+
+        ~ThirdLevel() {
+            for (unsigned i=0; i<COUNT; ++i) {
+                level3[i].~T();
+            }
+            ArrayAllocator::free(level3);
+        }
+
+        static void *operator new(size_t size) {
+            return MemoryCacheAllocator<sizeof(ThirdLevel)>::alloc();
+        }
+
+        static void operator delete(void *p) {
+            MemoryCacheAllocator<sizeof(ThirdLevel)>::free(p);
+        }
+
+    private:
+        ThirdLevel &operator=(const ThirdLevel &);
     };
 
     struct SecondLevel {
+        unsigned refCount;
         ThirdLevel* level2[1<<(SUPERPAGESIZE_BITS-PAGESIZE_BITS)];
 
         SecondLevel() {
+            refCount = 1;
             for (unsigned i=0; i<(1<<(SUPERPAGESIZE_BITS-PAGESIZE_BITS)); ++i) {
                 level2[i] = NULL;
             }
         }
 
+        //Shares all the third levels of one
+        SecondLevel(const SecondLevel &one) {
+            refCount = 1;
+            for (unsigned i=0; i<(1<<(SUPERPAGESIZE_BITS-PAGESIZE_BITS)); ++i) {
+                level2[i] = one.level2[i];
+                if (level2[i]) {
+                    ++level2[i]->refCount;
+                }
+            }
+        }
+
         ~SecondLevel() {
             for (unsigned i=0; i<(1<<(SUPERPAGESIZE_BITS-PAGESIZE_BITS)); ++i) {
                 if (level2[i]) {
-                    delete level2[i];
+                    release(level2[i]);
                     level2[i] = NULL;
                 }
             }
@@ -46,6 +162,25 @@ private:
     uint64_t m_size;
     unsigned m_pagecount;
 
+    template <class L>
+    static inline void release(L *level) {
+        assert(level->refCount > 0);
+        if (--level->refCount == 0) {
+            delete level;
+        }
+    }
+
+    //Makes sure that level is owned by this cache only
+    template <class L>
+    static inline L *unshare(L *&level) {
+        if (level->refCount > 1) {
+            L *copy = new L(*level);
+            release(level);
+            level = copy;
+        }
+        return level;
+    }
+
     inline void resize()
     {
         uint64_t mask = (1<<SUPERPAGESIZE_BITS)-1;
@@ -69,15 +204,22 @@ public:
         resize();
     }
 
-    //XXX: Clone an empty cache for now
     MemoryCache(const MemoryCache &one) {
         m_hostAddrStart = one.m_hostAddrStart;
         m_size = one.m_size;
         resize();
+
+        for (unsigned i=0; i<m_pagecount; ++i) {
+            m_level1[i] = one.m_level1[i];
+            if (m_level1[i]) {
+                ++m_level1[i]->refCount;
+            }
+        }
     }
 
     ~MemoryCache() {
         flushCache();
+        delete [] m_level1;
     }
 
     inline uint64_t getSize() const {
@@ -91,7 +233,7 @@ public:
     inline void flushCache() {
         for (unsigned i=0; i<m_pagecount; ++i) {
             if (m_level1[i]) {
-                delete m_level1[i];
+                release(m_level1[i]);
                 m_level1[i] = NULL;
             }
         }
@@ -101,51 +243,50 @@ public:
         return (hostAddress >= m_hostAddrStart) && (hostAddress < m_hostAddrStart + m_size);
     }
 
-    inline void put(uint64_t hostAddress, const T &obj)
+    //Returns the array of objects of the page that can be written to.
+    //The page is allocated if create is set, otherwise NULL is returned
+    //for pages that were never written.
+    inline T* getWritableArray(uint64_t hostAddress, bool create)
     {
         uint64_t offset = hostAddress - m_hostAddrStart;
         uint64_t level1 = offset >> SUPERPAGESIZE_BITS;
         uint64_t level2 = (offset & ((1<<SUPERPAGESIZE_BITS)-1)) >> PAGESIZE_BITS;
-        uint64_t level3 = (offset >> OBJSIZE_BITS) & ((1<<(PAGESIZE_BITS-OBJSIZE_BITS))-1);
 
-        SecondLevel *ptrLevel2;
-        if (!(ptrLevel2 = m_level1[level1])) {
+        SecondLevel *&ptrLevel2 = m_level1[level1];
+        if (!ptrLevel2) {
+            if (!create) {
+                return NULL;
+            }
             ptrLevel2 = new SecondLevel();
-            m_level1[level1] = ptrLevel2;
+        } else if (!create && !ptrLevel2->level2[level2]) {
+            return NULL;
         }
 
-        ThirdLevel *ptrLevel3;
-        if (!(ptrLevel3 = ptrLevel2->level2[level2])) {
+        unshare(ptrLevel2);
+
+        ThirdLevel *&ptrLevel3 = ptrLevel2->level2[level2];
+        if (!ptrLevel3) {
             ptrLevel3 = new ThirdLevel();
-            ptrLevel2->level2[level2] = ptrLevel3;
         }
 
-        assert(level3 < (1<<(PAGESIZE_BITS-OBJSIZE_BITS)));
-
-        ptrLevel3->level3[level3] = obj;
+        return unshare(ptrLevel3)->level3;
     }
 
-    inline T get(uint64_t hostAddress)
+    inline void put(uint64_t hostAddress, const T &obj)
     {
-        uint64_t offset = hostAddress - m_hostAddrStart;
-        uint64_t level1 = offset >> SUPERPAGESIZE_BITS;
-        uint64_t level2 = (offset & ((1<<SUPERPAGESIZE_BITS)-1)) >> PAGESIZE_BITS;
-        uint64_t level3 = (offset >> OBJSIZE_BITS) & ((1<<(PAGESIZE_BITS-OBJSIZE_BITS))-1);
-
-        SecondLevel *ptrLevel2;
-        if (!(ptrLevel2 = m_level1[level1])) {
-            return T();
-        }
-
-        ThirdLevel *ptrLevel3;
-        if (!(ptrLevel3 = ptrLevel2->level2[level2])) {
-            return T();
-        }
+        uint64_t level3 = (hostAddress >> OBJSIZE_BITS) & ((1<<(PAGESIZE_BITS-OBJSIZE_BITS))-1);
+        getWritableArray(hostAddress, true)[level3] = obj;
+    }
 
-        return ptrLevel3->level3[level3];
+    inline T get(uint64_t hostAddress) const
+    {
+        uint64_t level3 = (hostAddress >> OBJSIZE_BITS) & ((1<<(PAGESIZE_BITS-OBJSIZE_BITS))-1);
+        const T *array = getArray(hostAddress);
+        return array ? array[level3] : T();
     }
 
-    inline T* getArray(uint64_t hostAddress)
+    //The returned array may be shared with other caches, do not modify it
+    inline const T* getArray(uint64_t hostAddress) const
     {
         uint64_t offset = hostAddress - m_hostAddrStart;
         uint64_t level1 = offset >> SUPERPAGESIZE_BITS;
@@ -165,24 +306,94 @@ public:
     }
 };
 
+/**
+ *  Set of memory caches, one for each registered host memory region.
+ *  The region of an address is found with a binary search in a table
+ *  sorted by start address. A small direct-mapped cache in front of it
+ *  remembers the object arrays of the most recently accessed pages.
+ *  Arrays shared with a cloned pool are only remembered as read-only.
+ */
 template <class T, unsigned OBJSIZE_BITS, unsigned PAGESIZE_BITS, unsigned SUPERPAGESIZE_BITS>
 class MemoryCachePool
 {
 private:
     typedef MemoryCache<T,OBJSIZE_BITS,PAGESIZE_BITS,SUPERPAGESIZE_BITS> MemoryCacheT;
+
+    //Sorted by start address, regions do not overlap
     typedef llvm::SmallVector<MemoryCacheT*, 10> Caches;
     Caches m_caches;
 
+    enum { FRONT_CACHE_SIZE = 64 };
+
+    struct FrontCacheEntry {
+        uint64_t page;
+        T *array;
+        bool writable;
+    };
+
+    mutable FrontCacheEntry m_front[FRONT_CACHE_SIZE];
+
+    static inline uint64_t objectIndex(uint64_t hostAddress) {
+        return (hostAddress >> OBJSIZE_BITS) & ((1<<(PAGESIZE_BITS-OBJSIZE_BITS))-1);
+    }
+
+    inline FrontCacheEntry &getFrontEntry(uint64_t hostAddress) const {
+        return m_front[(hostAddress >> PAGESIZE_BITS) & (FRONT_CACHE_SIZE - 1)];
+    }
+
+    inline void flushFrontCache() const {
+        for (unsigned i=0; i<FRONT_CACHE_SIZE; ++i) {
+            m_front[i].page = (uint64_t) -1;
+            m_front[i].array = NULL;
+            m_front[i].writable = false;
+        }
+    }
+
+    MemoryCacheT *findCache(uint64_t hostAddress) const {
+        unsigned low = 0, high = m_caches.size();
+        while (low < high) {
+            unsigned mid = (low + high) / 2;
+            MemoryCacheT *mc = m_caches[mid];
+            if (hostAddress < mc->getStart()) {
+                high = mid;
+            } else if (hostAddress >= mc->getStart() + mc->getSize()) {
+                low = mid + 1;
+            } else {
+                return mc;
+            }
+        }
+        return NULL;
+    }
+
+    //Returns the array of the page from the front cache, or NULL on miss
+    inline T* lookupFront(uint64_t hostAddress, bool writable) {
+        FrontCacheEntry &e = getFrontEntry(hostAddress);
+        if (e.page == (hostAddress >> PAGESIZE_BITS) && (e.writable || !writable)) {
+            return e.array;
+        }
+        return NULL;
+    }
+
+    inline void updateFront(uint64_t hostAddress, T *array, bool writable) {
+        FrontCacheEntry &e = getFrontEntry(hostAddress);
+        e.page = hostAddress >> PAGESIZE_BITS;
+        e.array = array;
+        e.writable = writable;
+    }
+
 public:
     MemoryCachePool() {
-
+        flushFrontCache();
     }
 
+    //Both pools share all the pages after the copy,
+    //none of them may write to the arrays it remembers anymore.
     MemoryCachePool(const MemoryCachePool &one) {
         for (unsigned i=0; i<one.m_caches.size(); ++i) {
             m_caches.push_back(new MemoryCacheT(*one.m_caches[i]));
         }
-
+        one.flushFrontCache();
+        flushFrontCache();
     }
 
     ~MemoryCachePool() {
@@ -201,59 +412,73 @@ public:
         }
     }
 
-    //We sort the cache be decreasing size.
-    //The idea is that most accesses fall in the RAM, so it will
-    //be found first in the list.
     void registerPool(uint64_t hostAddrStart, uint64_t size)
     {
         assert((hostAddrStart & ((1<<PAGESIZE_BITS)-1)) == 0);
         MemoryCacheT *mc = new MemoryCacheT(hostAddrStart, size);
-        if (m_caches.size() == 0) {
-            m_caches.push_back(mc);
-            return;
-        }
 
         //Locate the place to insert
         typeof(m_caches.begin()) it;
         for (it = m_caches.begin(); it != m_caches.end(); ++it) {
-            if (size > (*it)->getSize()) {
+            if (hostAddrStart < (*it)->getStart()) {
                 break;
             }
         }
 
+        assert(it == m_caches.end() || hostAddrStart + size <= (*it)->getStart());
         m_caches.insert(it, mc);
     }
 
     void put(uint64_t hostAddress, const T &obj)
     {
-        typeof(m_caches.begin()) it;
-        for (it = m_caches.begin(); it != m_caches.end(); ++it) {
-            if ((*it)->contains(hostAddress)) {
-                (*it)->put(hostAddress, obj);
+        T *array = lookupFront(hostAddress, true);
+        if (!array) {
+            MemoryCacheT *mc = findCache(hostAddress);
+            if (!mc) {
                 return;
             }
+            array = mc->getWritableArray(hostAddress, true);
+            updateFront(hostAddress, array, true);
         }
+        array[objectIndex(hostAddress)] = obj;
     }
 
+    //Returns a writable array, copying it if it is shared
     T* getArray(uint64_t hostAddress) {
-        typeof(m_caches.begin()) it;
-        for (it = m_caches.begin(); it != m_caches.end(); ++it) {
-            if ((*it)->contains(hostAddress)) {
-                return (*it)->getArray(hostAddress);
-            }
+        T *array = lookupFront(hostAddress, true);
+        if (array) {
+            return array;
         }
-        return NULL;
+
+        MemoryCacheT *mc = findCache(hostAddress);
+        if (!mc) {
+            return NULL;
+        }
+
+        //Only remember pages that exist, put() may create them later
+        array = mc->getWritableArray(hostAddress, false);
+        if (array) {
+            updateFront(hostAddress, array, true);
+        }
+        return array;
     }
 
     T get(uint64_t hostAddress)
     {
-        typeof(m_caches.begin()) it;
-        for (it = m_caches.begin(); it != m_caches.end(); ++it) {
-            if ((*it)->contains(hostAddress)) {
-                return (*it)->get(hostAddress);
+        T *array = lookupFront(hostAddress, false);
+        if (!array) {
+            MemoryCacheT *mc = findCache(hostAddress);
+            if (!mc) {
+                return T();
+            }
+
+            array = const_cast<T*>(mc->getArray(hostAddress));
+            if (!array) {
+                return T();
             }
+            updateFront(hostAddress, array, false);
         }
-        return T();
+        return array[objectIndex(hostAddress)];
     }
 
 };
@@ -58,12 +58,17 @@ void Plugin::initialize()
 
 PluginState *Plugin::getPluginState(S2EExecutionState *s, PluginStateFactory f) const
 {
-    if (m_CachedPluginS2EState == s) {
-        return m_CachedPluginState;
-    }
-    m_CachedPluginState = s->getPluginState(const_cast<Plugin*>(this), f);
-    m_CachedPluginS2EState = s;
-    return m_CachedPluginState;
+    return s->getPluginState(const_cast<Plugin*>(this), f);
+}
+
+const PluginState *Plugin::getPluginStateConst(S2EExecutionState *s, PluginStateFactory f) const
+{
+    return s->getPluginStateConst(const_cast<Plugin*>(this), f);
+}
+
+void Plugin::setPluginState(S2EExecutionState *s, PluginState *state)
+{
+    s->setPluginState(this, state);
 }
 
 PluginsFactory::PluginsFactory()
@@ -81,6 +86,7 @@ void PluginsFactory::registerPlugin(const PluginInfo* pluginInfo)
     //assert(find(pluginInfo, m_pluginsList.begin(), m_pluginsList.end()) ==
       //                                              m_pluginsList.end());
 
+    m_pluginSlots.insert(make_pair(pluginInfo, m_pluginsList.size()));
     m_pluginsList.push_back(pluginInfo);
     m_pluginsMap.insert(make_pair(pluginInfo->name, pluginInfo));
 }
@@ -104,10 +110,14 @@ Plugin* PluginsFactory::createPlugin(S2E* s2e, const string& name) const
 {
     const PluginInfo* pluginInfo = getPluginInfo(name);
     s2e->getMessagesStream() << "Creating plugin " << name << std::endl;
-    if(pluginInfo)
-        return pluginInfo->instanceCreator(s2e);
-    else
+    if(!pluginInfo)
         return NULL;
+
+    Plugin *plugin = pluginInfo->instanceCreator(s2e);
+    PluginSlots::const_iterator it = m_pluginSlots.find(pluginInfo);
+    assert(it != m_pluginSlots.end());
+    plugin->m_pluginSlot = (*it).second;
+    return plugin;
 }
 
 } // namespace s2e
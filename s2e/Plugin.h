@@ -53,14 +53,16 @@ class S2EExecutionState;
 
 class Plugin : public sigc::trackable{
 private:
+    friend class PluginsFactory;
+
     S2E* m_s2e;
-protected:
-    mutable PluginState *m_CachedPluginState;
-    mutable S2EExecutionState *m_CachedPluginS2EState;
+
+    /** Dense index of the plugin in the per-state plugin state arrays,
+        assigned by PluginsFactory when the plugin is created */
+    unsigned m_pluginSlot;
 
 public:
-    Plugin(S2E* s2e) : m_s2e(s2e),m_CachedPluginState(NULL),
-        m_CachedPluginS2EState(NULL) {}
+    Plugin(S2E* s2e) : m_s2e(s2e), m_pluginSlot((unsigned) -1) {}
 
     virtual ~Plugin() {}
 
@@ -78,12 +80,18 @@ public:
     /** Return configuration key for this plugin */
     const std::string& getConfigKey() const;
 
+    /** Return the index of the plugin state in S2EExecutionState */
+    unsigned getPluginSlot() const { return m_pluginSlot; }
+
+    /** Returns the state of the plugin for s, for reading and writing.
+        The state is copied if it is still shared with other states. */
     PluginState *getPluginState(S2EExecutionState *s, PluginState* (*f)(Plugin *, S2EExecutionState *)) const;
 
-    void refresh() {
-        m_CachedPluginS2EState = NULL;
-        m_CachedPluginState = NULL;
-    }
+    /** Returns the state of the plugin for s without copying it */
+    const PluginState *getPluginStateConst(S2EExecutionState *s, PluginState* (*f)(Plugin *, S2EExecutionState *)) const;
+
+    /** Replaces the state of the plugin for s (see PluginState::isImmutable) */
+    void setPluginState(S2EExecutionState *s, PluginState *state);
 };
 
 #define DECLARE_PLUGINSTATE_P(plg, c, execstate) \
@@ -96,16 +104,50 @@ public:
     c *name = static_cast<c*>(getPluginState(execstate, &c::factory))
 
 #define DECLARE_PLUGINSTATE_CONST(c, execstate) \
-    const c *plgState = static_cast<c*>(getPluginState(execstate, &c::factory))
+    const c *plgState = static_cast<const c*>(getPluginStateConst(execstate, &c::factory))
 
 #define DECLARE_PLUGINSTATE_NCONST(c, name, execstate) \
-    const c *name = static_cast<c*>(getPluginState(execstate, &c::factory))
+    const c *name = static_cast<const c*>(getPluginStateConst(execstate, &c::factory))
 
+/**
+ *  Per-state data of a plugin. Forked states share the plugin states of
+ *  their parent, clone() is only called when one of them asks for write
+ *  access with getPluginState. Use the CONST variants of the macros
+ *  above for read-only accesses.
+ *
+ *  A pointer returned by getPluginState (or DECLARE_PLUGINSTATE) stays
+ *  private to its execution state, even if that state forks while the
+ *  pointer is in use (e.g., a plugin state method emits a signal whose
+ *  handler forks, then keeps modifying the object). Such objects are
+ *  copied for the new state when it is forked instead of being shared.
+ *  Pointers returned by getPluginStateConst may become shared, and
+ *  must not be cast back to writable ones.
+ */
 class PluginState
 {
+private:
+    friend class S2EExecutionState;
+
+    //Number of execution states that refer to this object
+    unsigned m_shareCount;
+
+    //Handed out by getPluginState, a plugin may still hold a writable
+    //pointer to it. Only set on objects that are not shared.
+    bool m_writable;
+
 public:
+    PluginState() : m_shareCount(1), m_writable(false) {}
+    PluginState(const PluginState &) : m_shareCount(1), m_writable(false) {}
+    PluginState &operator=(const PluginState &) { return *this; }
+
     virtual ~PluginState() {};
     virtual PluginState *clone() const = 0;
+
+    /** Immutable states are never copied, even on write access.
+        The plugin must not modify them and install an updated version
+        with Plugin::setPluginState instead. This suits plugins that keep
+        their data in persistent (structurally shared) containers. */
+    virtual bool isImmutable() const { return false; }
 };
 
 
@@ -138,6 +180,10 @@ private:
 
     std::vector<const PluginInfo*> m_pluginsList;
 
+    //Plugin state slot of each registered plugin
+    typedef std::map<const PluginInfo*, unsigned> PluginSlots;
+    PluginSlots m_pluginSlots;
+
 public:
     PluginsFactory();
 
@@ -146,6 +192,9 @@ public:
     const std::vector<const PluginInfo*> &getPluginInfoList() const;
     const PluginInfo* getPluginInfo(const std::string& name) const;
 
+    /** Number of plugin state slots, i.e., of registered plugins */
+    unsigned getPluginSlotCount() const { return m_pluginsList.size(); }
+
     Plugin* createPlugin(S2E* s2e, const std::string& name) const;
 };
 
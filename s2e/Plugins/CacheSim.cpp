@@ -49,11 +49,17 @@ extern "C" {
 
 #include <llvm/System/TimeValue.h>
 
+#include <algorithm>
 #include <iostream>
 #include <stdlib.h>
 #include <stdio.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define CACHESIM_LOG_SIZE 4096
+#define CACHESIM_BATCH_SIZE 256
 
 namespace s2e {
 namespace plugins {
@@ -73,9 +79,43 @@ uint64_t floorLog2(uint64_t n) {
     return ((n == 0) ? ((uint64_t)-1) : pos);
 }
 
-/* Model of n-way accosiative write-through LRU cache */
+/* Model of n-way accosiative write-through LRU cache.
+   Each set holds the tags of its lines followed by their LRU ages
+   (0 for the most recently used line), one byte per line. Lines of a set
+   are looked up and aged with SSE2 when available. Sets are grouped in
+   chunks that copies of the cache (i.e., forked states) share until
+   one of them modifies the chunk. */
 class Cache {
 protected:
+    /* The sets are allocated right after the chunk header */
+    struct Chunk {
+        unsigned refCount;
+        unsigned size;
+
+        uint8_t *getData() {
+            return reinterpret_cast<uint8_t*>(this + 1);
+        }
+
+        static Chunk *allocate(unsigned size, const Chunk *from = NULL) {
+            Chunk *chunk = static_cast<Chunk*>(
+                    ::operator new(sizeof(Chunk) + size));
+            chunk->refCount = 1;
+            chunk->size = size;
+            if (from) {
+                memcpy(chunk->getData(), const_cast<Chunk*>(from)->getData(), size);
+            } else {
+                memset(chunk->getData(), 0, size);
+            }
+            return chunk;
+        }
+
+        static void release(Chunk *chunk) {
+            if (--chunk->refCount == 0) {
+                ::operator delete(chunk);
+            }
+        }
+    };
+
     uint64_t m_size;
     uint64_t m_associativity;
     uint64_t m_lineSize;
@@ -85,13 +125,113 @@ protected:
 
     uint64_t m_tagShift;   // m_indexShift + log2(setsCount)
 
-    std::vector<uint64_t> m_lines;
+    /* Set layout: tags padded to an even count, then ages padded to 16 */
+    unsigned m_agesOffset;
+    unsigned m_setSize;
+
+    unsigned m_chunkShift; // log2(sets per chunk)
+    std::vector<Chunk*> m_chunks;
+
+    /* Last accessed line, which is the most recently used one of its set.
+       Accessing it again changes nothing. */
+    uint64_t m_lastLine;
 
     std::string m_name;
     uint8_t m_cacheId;
 
     Cache* m_upperCache;
 
+    void operator=(const Cache &);
+
+    inline const uint8_t *peekSet(uint64_t set) const {
+        Chunk *chunk = m_chunks[set >> m_chunkShift];
+        return chunk->getData() + (set & ((1 << m_chunkShift) - 1)) * m_setSize;
+    }
+
+    /* Returns the set, copying its chunk first if it is shared */
+    inline uint8_t *getSet(uint64_t set) {
+        Chunk *&chunk = m_chunks[set >> m_chunkShift];
+        if (chunk->refCount > 1) {
+            --chunk->refCount;
+            chunk = Chunk::allocate(chunk->size, chunk);
+        }
+        return chunk->getData() + (set & ((1 << m_chunkShift) - 1)) * m_setSize;
+    }
+
+    /* Returns the way that holds tag, -1 if none */
+    inline int findLine(const uint64_t *tags, uint64_t tag) const {
+#ifdef __SSE2__
+        __m128i t = _mm_set_epi32(tag >> 32, tag, tag >> 32, tag);
+        for (unsigned i = 0; i < m_associativity; i += 2) {
+            __m128i l = _mm_loadu_si128((const __m128i*) (tags + i));
+            int m = _mm_movemask_epi8(_mm_cmpeq_epi32(l, t));
+            if ((m & 0xff) == 0xff) {
+                return i;
+            }
+            if ((m & 0xff00) == 0xff00 && i + 1 < m_associativity) {
+                return i + 1;
+            }
+        }
+#else
+        for (unsigned i = 0; i < m_associativity; ++i) {
+            if (tags[i] == tag) {
+                return i;
+            }
+        }
+#endif
+        return -1;
+    }
+
+    /* Makes way the most recently used line */
+    inline void touchLine(uint8_t *ages, unsigned way) const {
+        uint8_t age = ages[way];
+#ifdef __SSE2__
+        __m128i a = _mm_set1_epi8(age);
+        for (unsigned i = 0; i < m_associativity; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*) (ages + i));
+            //Lines younger than way get one step older
+            v = _mm_sub_epi8(v, _mm_cmplt_epi8(v, a));
+            _mm_storeu_si128((__m128i*) (ages + i), v);
+        }
+#else
+        for (unsigned i = 0; i < m_associativity; ++i) {
+            if (ages[i] < age) {
+                ++ages[i];
+            }
+        }
+#endif
+        ages[way] = 0;
+    }
+
+    /* Returns the least recently used line, and ages all the others */
+    inline unsigned evictLine(uint8_t *ages) const {
+        unsigned victim = 0;
+#ifdef __SSE2__
+        __m128i oldest = _mm_set1_epi8(m_associativity - 1);
+        __m128i one = _mm_set1_epi8(1);
+        for (unsigned i = 0; i < m_associativity; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*) (ages + i));
+            int m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, oldest));
+            if (i + 16 > m_associativity) {
+                m &= (1 << (m_associativity - i)) - 1;
+            }
+            if (m) {
+                victim = i + __builtin_ctz(m);
+            }
+            _mm_storeu_si128((__m128i*) (ages + i), _mm_add_epi8(v, one));
+        }
+#else
+        for (unsigned i = 0; i < m_associativity; ++i) {
+            if (ages[i] == m_associativity - 1) {
+                victim = i;
+            }
+            ++ages[i];
+        }
+#endif
+        ages[victim] = 0;
+        return victim;
+    }
+
 public:
     uint64_t getSize() const {
         return m_size;
@@ -113,7 +253,7 @@ public:
         m_cacheId = id;
     }
 
-
+    /* Shares all the sets of c */
     Cache(const Cache &c) {
         m_size = c.m_size;
         m_associativity = c.m_associativity;
@@ -121,7 +261,14 @@ public:
         m_indexShift = c.m_indexShift;
         m_indexMask = c.m_indexMask;
         m_tagShift = c.m_tagShift;
-        m_lines = c.m_lines;
+        m_agesOffset = c.m_agesOffset;
+        m_setSize = c.m_setSize;
+        m_chunkShift = c.m_chunkShift;
+        m_chunks = c.m_chunks;
+        m_lastLine = c.m_lastLine;
+        foreach(Chunk *chunk, m_chunks) {
+            ++chunk->refCount;
+        }
         m_name = c.m_name;
         m_cacheId = c.m_cacheId;
         m_upperCache = NULL;
@@ -138,6 +285,9 @@ public:
         assert(uint64_t(1LL<<floorLog2(associativity)) == associativity);
         assert(uint64_t(1LL<<floorLog2(lineSize)) == lineSize);
 
+        //Ages are compared as signed bytes
+        assert(associativity <= 128);
+
         uint64_t setsCount = (size / lineSize) / associativity;
         assert(setsCount && uint64_t(1LL << floorLog2(setsCount)) == setsCount);
 
@@ -146,7 +296,40 @@ public:
 
         m_tagShift = floorLog2(setsCount) + m_indexShift;
 
-        m_lines.resize(setsCount * associativity, (uint64_t) -1);
+        m_agesOffset = ((associativity + 1) & ~1ULL) * sizeof(uint64_t);
+        m_setSize = m_agesOffset + ((associativity + 15) & ~15ULL);
+
+        //Chunks of about one page
+        uint64_t setsPerChunk = 4096 / m_setSize;
+        if (!setsPerChunk) {
+            setsPerChunk = 1;
+        }
+        m_chunkShift = floorLog2(setsPerChunk);
+        if ((1ULL << m_chunkShift) > setsCount) {
+            m_chunkShift = floorLog2(setsCount);
+        }
+
+        //All sets start empty, so they can share one chunk
+        Chunk *empty = Chunk::allocate(m_setSize << m_chunkShift);
+        for (uint64_t set = 0; set < (1ULL << m_chunkShift); ++set) {
+            uint8_t *data = empty->getData() + set * m_setSize;
+            uint64_t *tags = (uint64_t*) data;
+            for (unsigned i = 0; i < associativity; ++i) {
+                tags[i] = (uint64_t) -1;
+                data[m_agesOffset + i] = i;
+            }
+        }
+
+        m_chunks.resize(setsCount >> m_chunkShift, empty);
+        empty->refCount = m_chunks.size();
+
+        m_lastLine = (uint64_t) -1;
+    }
+
+    ~Cache() {
+        foreach(Chunk *chunk, m_chunks) {
+            Chunk::release(chunk);
+        }
     }
 
     const std::string& getName() const { return m_name; }
@@ -173,26 +356,30 @@ public:
             return;
         }
 
-        uint64_t set = s1 & m_indexMask;
-        uint64_t l = set * m_associativity;
+        if (s1 == m_lastLine) {
+            return;
+        }
+        m_lastLine = s1;
+
+        uint64_t setIndex = s1 & m_indexMask;
         uint64_t tag = address >> m_tagShift;
 
-        for(unsigned i = 0; i < m_associativity; ++i) {
-            if(m_lines[l + i] == tag) {
-                /* Cache hit. Move line to MRU. */
-                for(unsigned j = i; j > 0; --j)
-                    m_lines[l + j] = m_lines[l + j - 1];
-                m_lines[l] = tag;
-                return;
+        /* Sets are only copied if the access modifies them */
+        const uint8_t *set = peekSet(setIndex);
+        int way = findLine((const uint64_t*) set, tag);
+        if (way >= 0) {
+            /* Cache hit. Move line to MRU. */
+            if (set[m_agesOffset + way]) {
+                touchLine(getSet(setIndex) + m_agesOffset, way);
             }
+            return;
         }
 
         //g_s2e->getDebugStream() << "Miss at 0x" << std::hex << address << std::endl;
         /* Cache miss. Install new tag as MRU */
         misCount[0] += 1;
-        for(unsigned j = m_associativity-1; j > 0; --j)
-            m_lines[l + j] = m_lines[l + j - 1];
-        m_lines[l] = tag;
+        uint8_t *newSet = getSet(setIndex);
+        ((uint64_t*) newSet)[evictLine(newSet + m_agesOffset)] = tag;
 
         if(m_upperCache) {
             assert(misCountSize > 1);
@@ -286,7 +473,8 @@ CacheSimState::CacheSimState(S2EExecutionState *s, Plugin *p)
                 sigc::mem_fun(*csp, &CacheSim::onDataMemoryAccess));
         }
 
-        if(m_i1) {
+        //Block boundaries are also needed to flush the pending data accesses
+        if(m_i1 || m_d1) {
             s2e->getDebugStream()  << "CacheSim: connecting to onTranslateBlockStart" << std::endl;
             s2e->getCorePlugin()->onTranslateBlockStart.connect(
              sigc::mem_fun(*csp, &CacheSim::onTranslateBlockStart));
@@ -333,16 +521,21 @@ PluginState *CacheSimState::clone() const
             continue;
         }
 
-        CachesMap::iterator newCache = ret->m_caches.find(u->getName());
-        assert(newCache != ret->m_caches.end());
-        (*newCache).second->setUpperCache((*newCache).second);
+        CachesMap::iterator newCache = ret->m_caches.find((*oldCaches).first);
+        CachesMap::iterator newUpper = ret->m_caches.find(u->getName());
+        assert(newCache != ret->m_caches.end() && newUpper != ret->m_caches.end());
+        (*newCache).second->setUpperCache((*newUpper).second);
     }
 
-    ret->m_d1 = ret->m_caches[m_d1->getName()];
-    assert(ret->m_d1);
+    if (m_d1) {
+        ret->m_d1 = ret->m_caches[m_d1->getName()];
+        assert(ret->m_d1);
+    }
 
-    ret->m_i1 = ret->m_caches[m_i1->getName()];
-    assert(ret->m_i1);
+    if (m_i1) {
+        ret->m_i1 = ret->m_caches[m_i1->getName()];
+        assert(ret->m_i1);
+    }
 
     return ret;
 }
@@ -366,6 +559,8 @@ S2E_DEFINE_PLUGIN(CacheSim, "Cache simulator", "",);
 
 CacheSim::~CacheSim()
 {
+    //The states may already be gone, drop the pending accesses
+    m_batch.clear();
     flushLogEntries();
 
 }
@@ -430,7 +625,13 @@ void CacheSim::initialize()
     assert(ok && "create table failed");
 
     m_cacheLog.reserve(CACHESIM_LOG_SIZE);
+    m_batch.reserve(CACHESIM_BATCH_SIZE);
 
+    s2e()->getCorePlugin()->onStateFork.connect(
+        sigc::mem_fun(*this, &CacheSim::onStateFork));
+
+    s2e()->getCorePlugin()->onStateSwitch.connect(
+        sigc::mem_fun(*this, &CacheSim::onStateSwitch));
 
 }
 
@@ -495,7 +696,7 @@ void CacheSim::onModuleTranslateBlockStart(
         s2e()->getCorePlugin()->onDataMemoryAccess.connect(
             sigc::mem_fun(*this, &CacheSim::onDataMemoryAccess));
 
-    if(plgState->m_i1)
+    if(plgState->m_i1 || plgState->m_d1)
         s2e()->getCorePlugin()->onTranslateBlockStart.connect(
             sigc::mem_fun(*this, &CacheSim::onTranslateBlockStart));
 
@@ -507,9 +708,36 @@ void CacheSim::onModuleTranslateBlockStart(
 //Periodically flush the cache
 void CacheSim::onTimer()
 {
+    flushBatch();
     flushLogEntries();
 }
 
+void CacheSim::onStateFork(S2EExecutionState *originalState,
+                           const std::vector<S2EExecutionState*>& newStates,
+                           const std::vector<klee::ref<klee::Expr> >& newConditions)
+{
+    if (m_batch.empty() || m_batchState != originalState) {
+        flushBatch();
+        return;
+    }
+
+    //The accesses happened before the fork, all the new states must see them.
+    //Only the original state reports them to avoid duplicate log entries.
+    simulate(originalState, true);
+    foreach(S2EExecutionState *newState, newStates) {
+        if (newState != originalState) {
+            simulate(newState, false);
+        }
+    }
+    m_batch.clear();
+}
+
+void CacheSim::onStateSwitch(S2EExecutionState *currentState,
+                             S2EExecutionState *nextState)
+{
+    flushBatch();
+}
+
 void CacheSim::flushLogEntries()
 {
     if (m_useBinaryLogFile) {
@@ -562,72 +790,112 @@ bool CacheSim::reportAccess(S2EExecutionState *state) const
     return doLog;
 }
 
-void CacheSim::onMemoryAccess(S2EExecutionState *state,
-                              uint64_t address, unsigned size,
-                              bool isWrite, bool isIO, bool isCode)
+void CacheSim::flushBatch()
 {
-    if(isIO) /* this is only an estimation - should look at registers! */
-        return;
+    if (!m_batch.empty()) {
+        simulate(m_batchState, true);
+        m_batch.clear();
+    }
+    m_tbFlagsValid = false;
+}
 
+void CacheSim::simulate(S2EExecutionState *state, bool log)
+{
     DECLARE_PLUGINSTATE(CacheSimState, state);
 
-    if (!profileAccess(state)) {
-        return;
+    //Done only on the first invocation
+    if (log) {
+        writeCacheDescriptionToLog(state);
     }
 
+    unsigned maxLength = std::max(plgState->m_i1_length, plgState->m_d1_length);
+    unsigned missCount[maxLength + 1];
+
+    foreach(const PendingAccess &a, m_batch) {
+        Cache* cache = a.isCode ? plgState->m_i1 : plgState->m_d1;
+        if(!cache)
+            continue;
+
+        unsigned missCountLength = a.isCode ? plgState->m_i1_length : plgState->m_d1_length;
+        memset(missCount, 0, sizeof(missCount[0]) * missCountLength);
+        cache->access(a.address, a.size, a.isWrite, missCount, missCountLength);
+
+        //Decide whether to log the access in the database
+        if (!log || !a.report) {
+            continue;
+        }
+
+        unsigned i = 0;
+        for(Cache* c = cache; c != NULL; c = c->getUpperCache(), ++i) {
+            if(m_cacheLog.size() == CACHESIM_LOG_SIZE)
+                flushLogEntries();
+
+            if (m_reportZeroMisses || missCount[i]) {
+                if (m_useBinaryLogFile) {
+                    ExecutionTraceCacheSimEntry e;
+                    e.type = CACHE_ENTRY;
+                    e.cacheId = c->getId();
+                    e.pc = a.pc;
+                    e.address = a.address;
+                    e.size = a.size;
+                    e.isWrite = a.isWrite;
+                    e.isCode = a.isCode;
+                    e.missCount = missCount[i];
+                    m_Tracer->writeData(state, &e, sizeof(e), TRACE_CACHESIM);
+                }else {
+                    m_cacheLog.resize(m_cacheLog.size()+1);
+                    CacheLogEntry& ce = m_cacheLog.back();
+                    ce.timestamp = llvm::sys::TimeValue::now().usec();
+                    ce.pc = a.pc;
+                    ce.address = a.address;
+                    ce.size = a.size;
+                    ce.isWrite = a.isWrite;
+                    ce.isCode = false;
+                    ce.cacheName = c->getName().c_str();
+                    ce.missCount = missCount[i];
+                }
+            }
 
-    Cache* cache = isCode ? plgState->m_i1 : plgState->m_d1;
-    if(!cache)
+            if(missCount[i] == 0)
+                break;
+        }
+    }
+}
+
+void CacheSim::onMemoryAccess(S2EExecutionState *state,
+                              uint64_t address, unsigned size,
+                              bool isWrite, bool isIO, bool isCode)
+{
+    if(isIO) /* this is only an estimation - should look at registers! */
         return;
 
-    //Done only on the first invocation
-    writeCacheDescriptionToLog(state);
+    if (state != m_batchState) {
+        flushBatch();
+        m_batchState = state;
+    }
 
-    unsigned missCountLength = isCode ? plgState->m_i1_length : plgState->m_d1_length;
-    unsigned missCount[missCountLength];
-    memset(missCount, 0, sizeof(missCount));
-    cache->access(address, size, isWrite, missCount, missCountLength);
+    //The module filters only depend on the current block
+    if (!m_tbFlagsValid) {
+        m_tbProfile = profileAccess(state);
+        m_tbReport = m_tbProfile && reportAccess(state);
+        m_tbFlagsValid = true;
+    }
 
-    //Decide whether to log the access in the database
-    if (!reportAccess(state)) {
+    if (!m_tbProfile) {
         return;
     }
 
-    unsigned i = 0;
-    for(Cache* c = cache; c != NULL; c = c->getUpperCache(), ++i) {
-        if(m_cacheLog.size() == CACHESIM_LOG_SIZE)
-            flushLogEntries();
-
-       // std::cout << state->getPc() << " "  << c->getName() << ": " << missCount[i] << std::endl;
-
-        if (m_reportZeroMisses || missCount[i]) {
-            if (m_useBinaryLogFile) {
-                ExecutionTraceCacheSimEntry e;
-                e.type = CACHE_ENTRY;
-                e.cacheId = c->getId();
-                e.pc = state->getPc();
-                e.address = address;
-                e.size = size;
-                e.isWrite = isWrite;
-                e.isCode = isCode;
-                e.missCount = missCount[i];
-                m_Tracer->writeData(state, &e, sizeof(e), TRACE_CACHESIM);
-            }else {
-                m_cacheLog.resize(m_cacheLog.size()+1);
-                CacheLogEntry& ce = m_cacheLog.back();
-                ce.timestamp = llvm::sys::TimeValue::now().usec();
-                ce.pc = state->getPc();
-                ce.address = address;
-                ce.size = size;
-                ce.isWrite = isWrite;
-                ce.isCode = false;
-                ce.cacheName = c->getName().c_str();
-                ce.missCount = missCount[i];
-            }
-        }
+    m_batch.resize(m_batch.size() + 1);
+    PendingAccess &a = m_batch.back();
+    a.pc = state->getPc();
+    a.address = address;
+    a.size = size;
+    a.isWrite = isWrite;
+    a.isCode = isCode;
+    a.report = m_tbReport;
 
-        if(missCount[i] == 0)
-            break;
+    if (m_batch.size() == CACHESIM_BATCH_SIZE) {
+        flushBatch();
     }
 }
 
@@ -661,6 +929,7 @@ void CacheSim::onExecuteBlockStart(S2EExecutionState *state, uint64_t pc,
                                    TranslationBlock *tb, uint64_t hostAddress)
 {
 //    s2e()->getDebugStream() << "exec pc=" << std::hex << pc << " ha=" << hostAddress << std::endl;
+    flushBatch();
     onMemoryAccess(state, m_physAddress ? hostAddress : pc, tb->size, false, false, true);
 }
 
@@ -79,6 +79,29 @@ protected:
 
     std::vector<CacheLogEntry> m_cacheLog;
 
+    /**
+     * Accesses are not simulated one by one. They are queued here and
+     * replayed against the state's caches at translation block
+     * boundaries, on state switches and forks.
+     */
+    struct PendingAccess
+    {
+        uint64_t pc;
+        uint64_t address;
+        unsigned size;
+        bool     isWrite;
+        bool     isCode;
+        bool     report;
+    };
+
+    std::vector<PendingAccess> m_batch;
+    S2EExecutionState *m_batchState;
+
+    /* Cached results of profileAccess/reportAccess for the current block */
+    bool m_tbFlagsValid;
+    bool m_tbProfile;
+    bool m_tbReport;
+
 
     ModuleExecutionDetector *m_execDetector;
     ExecutionTracer *m_Tracer;
@@ -97,6 +120,9 @@ protected:
 
     void flushLogEntries();
 
+    void flushBatch();
+    void simulate(S2EExecutionState *state, bool log);
+
     void onModuleTranslateBlockStart(
         ExecutionSignal* signal,
         S2EExecutionState *state,
@@ -124,12 +150,19 @@ protected:
 
     void onTimer();
 
+    void onStateFork(S2EExecutionState *originalState,
+                     const std::vector<S2EExecutionState*>& newStates,
+                     const std::vector<klee::ref<klee::Expr> >& newConditions);
+
+    void onStateSwitch(S2EExecutionState *currentState,
+                       S2EExecutionState *nextState);
+
     void writeCacheDescriptionToLog(S2EExecutionState *state);
 
     bool profileAccess(S2EExecutionState *state) const;
     bool reportAccess(S2EExecutionState *state) const;
 public:
-    CacheSim(S2E* s2e): Plugin(s2e) {}
+    CacheSim(S2E* s2e): Plugin(s2e), m_batchState(NULL), m_tbFlagsValid(false) {}
     ~CacheSim();
 
     void initialize();
@@ -0,0 +1,603 @@
+/*
+ * S2E Selective Symbolic Execution Framework
+ *
+ * Copyright (c) 2010, Dependable Systems Laboratory, EPFL
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Dependable Systems Laboratory, EPFL nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE DEPENDABLE SYSTEMS LABORATORY, EPFL BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Currently maintained by:
+ *    Vitaly Chipounov <vitaly.chipounov@epfl.ch>
+ *    Volodymyr Kuznetsov <vova.kuznetsov@epfl.ch>
+ *
+ * All contributors are listed in S2E-AUTHORS file.
+ *
+ */
+
+#include "ExecutionTraceReader.h"
+
+#include <zlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cassert>
+#include <map>
+
+namespace s2e {
+namespace plugins {
+
+namespace {
+
+/* Maps a whole file read-only. Returns false if the file cannot be
+   mapped, data is NULL for empty files. */
+bool mapFile(const std::string &fileName, int *fd, const uint8_t **data,
+             uint64_t *size, uint64_t *modificationTime, std::string *error)
+{
+    *fd = ::open(fileName.c_str(), O_RDONLY);
+    if (*fd < 0) {
+        *error = fileName + ": " + strerror(errno);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(*fd, &st) < 0) {
+        *error = fileName + ": " + strerror(errno);
+        ::close(*fd);
+        return false;
+    }
+
+    *size = st.st_size;
+    *modificationTime = st.st_mtime;
+    *data = NULL;
+
+    if (*size) {
+        void *p = mmap(NULL, *size, PROT_READ, MAP_SHARED, *fd, 0);
+        if (p == MAP_FAILED) {
+            *error = fileName + ": " + strerror(errno);
+            ::close(*fd);
+            return false;
+        }
+        *data = static_cast<const uint8_t*>(p);
+    }
+
+    return true;
+}
+
+void unmapFile(int *fd, const uint8_t **data, uint64_t size)
+{
+    if (*data) {
+        munmap(const_cast<uint8_t*>(*data), size);
+        *data = NULL;
+    }
+    if (*fd >= 0) {
+        ::close(*fd);
+        *fd = -1;
+    }
+}
+
+} // namespace
+
+///////////////////////////////////////////////////////////////////////////
+
+ExecutionTraceReader::ExecutionTraceReader():
+    m_fd(-1), m_data(NULL), m_size(0), m_modificationTime(0),
+    m_compressed(false), m_inflatedBlock(-1)
+{
+
+}
+
+ExecutionTraceReader::~ExecutionTraceReader()
+{
+    close();
+}
+
+bool ExecutionTraceReader::open(const std::string &fileName,
+                                std::string *error)
+{
+    assert(m_fd < 0);
+
+    if (!mapFile(fileName, &m_fd, &m_data, &m_size,
+                 &m_modificationTime, error)) {
+        return false;
+    }
+
+    const ExecutionTraceFileHeader *hdr =
+            reinterpret_cast<const ExecutionTraceFileHeader*>(m_data);
+    m_compressed = m_size >= sizeof(*hdr) &&
+                   hdr->magic == EXECTRACE_FILE_MAGIC;
+
+    if (m_compressed) {
+        if (hdr->version != EXECTRACE_VERSION) {
+            *error = fileName + ": unsupported trace version";
+            close();
+            return false;
+        }
+        if (!loadBlocks(error)) {
+            close();
+            return false;
+        }
+        if (!error->empty()) {
+            *error = fileName + ": " + *error;
+        }
+    }
+
+    return true;
+}
+
+void ExecutionTraceReader::close()
+{
+    unmapFile(&m_fd, &m_data, m_size);
+    m_size = 0;
+    m_compressed = false;
+    m_blocks.clear();
+    m_inflated.clear();
+    m_inflatedBlock = -1;
+}
+
+/**
+ *  Uses the index of the last footer. If the trace has no footer
+ *  (e.g., S2E crashed), the blocks are found by walking the file.
+ *  A partially written last block is skipped and reported in error,
+ *  the complete blocks remain readable.
+ */
+bool ExecutionTraceReader::loadBlocks(std::string *error)
+{
+    const ExecutionTraceFooter *footer = NULL;
+    if (m_size >= sizeof(ExecutionTraceFileHeader) + sizeof(*footer)) {
+        footer = reinterpret_cast<const ExecutionTraceFooter*>(
+                m_data + m_size - sizeof(*footer));
+        if (footer->magic != EXECTRACE_FOOTER_MAGIC ||
+            footer->indexOffset + (uint64_t) footer->blockCount *
+                sizeof(ExecutionTraceIndexEntry) + sizeof(*footer) != m_size) {
+            footer = NULL;
+        }
+    }
+
+    if (footer) {
+        const ExecutionTraceIndexEntry *entries =
+                reinterpret_cast<const ExecutionTraceIndexEntry*>(
+                        m_data + footer->indexOffset);
+        m_blocks.assign(entries, entries + footer->blockCount);
+        return true;
+    }
+
+    uint64_t offset = sizeof(ExecutionTraceFileHeader);
+    uint64_t firstItem = 0;
+    while (offset + sizeof(ExecutionTraceBlockHeader) <= m_size) {
+        const ExecutionTraceBlockHeader *bh =
+                reinterpret_cast<const ExecutionTraceBlockHeader*>(m_data + offset);
+        if (bh->magic != EXECTRACE_BLOCK_MAGIC ||
+            offset + sizeof(*bh) + bh->compressedSize > m_size) {
+            break;
+        }
+
+        ExecutionTraceIndexEntry entry;
+        entry.offset = offset;
+        entry.firstItem = firstItem;
+        entry.itemCount = bh->itemCount;
+        m_blocks.push_back(entry);
+
+        firstItem += bh->itemCount;
+        offset += sizeof(*bh) + bh->compressedSize;
+    }
+
+    if (offset != m_size) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "the trace is truncated at offset %llu,"
+                 " read %u complete blocks", (unsigned long long) offset,
+                 (unsigned) m_blocks.size());
+        *error = buf;
+    }
+
+    return true;
+}
+
+bool ExecutionTraceReader::inflateBlock(unsigned block)
+{
+    if (m_inflatedBlock == block) {
+        return true;
+    }
+
+    m_inflatedBlock = -1;
+    if (block >= m_blocks.size()) {
+        return false;
+    }
+
+    uint64_t offset = m_blocks[block].offset;
+    if (offset + sizeof(ExecutionTraceBlockHeader) > m_size) {
+        return false;
+    }
+
+    const ExecutionTraceBlockHeader *bh =
+            reinterpret_cast<const ExecutionTraceBlockHeader*>(m_data + offset);
+    if (bh->magic != EXECTRACE_BLOCK_MAGIC ||
+        offset + sizeof(*bh) + bh->compressedSize > m_size) {
+        return false;
+    }
+
+    m_inflated.resize(bh->size);
+    uLongf size = bh->size;
+    if (uncompress(&m_inflated[0], &size, m_data + offset + sizeof(*bh),
+                   bh->compressedSize) != Z_OK || size != bh->size) {
+        return false;
+    }
+
+    m_inflatedBlock = block;
+    return true;
+}
+
+const ExecutionTraceItemHeader *ExecutionTraceReader::getItem(
+        const uint8_t *data, uint64_t size, uint64_t offset,
+        const uint8_t **payload) const
+{
+    if (offset + sizeof(ExecutionTraceItemHeader) > size) {
+        return NULL;
+    }
+
+    const ExecutionTraceItemHeader *hdr =
+            reinterpret_cast<const ExecutionTraceItemHeader*>(data + offset);
+    if (offset + sizeof(*hdr) + hdr->size > size) {
+        return NULL;
+    }
+
+    *payload = data + offset + sizeof(*hdr);
+    return hdr;
+}
+
+const ExecutionTraceItemHeader *ExecutionTraceReader::getItem(
+        uint64_t location, const uint8_t **payload)
+{
+    if (!m_compressed) {
+        return getItem(m_data, m_size, location, payload);
+    }
+
+    if (!inflateBlock(location >> 32)) {
+        return NULL;
+    }
+
+    return getItem(&m_inflated[0], m_inflated.size(),
+                   location & 0xffffffff, payload);
+}
+
+bool ExecutionTraceReader::scan(Visitor *visitor)
+{
+    const ExecutionTraceItemHeader *hdr;
+    const uint8_t *payload;
+
+    if (!m_compressed) {
+        uint64_t offset = 0;
+        while ((hdr = getItem(m_data, m_size, offset, &payload))) {
+            if (!visitor->visit(offset, hdr, payload)) {
+                return true;
+            }
+            offset += sizeof(*hdr) + hdr->size;
+        }
+        return offset == m_size;
+    }
+
+    for (unsigned block = 0; block < m_blocks.size(); ++block) {
+        if (!inflateBlock(block)) {
+            return false;
+        }
+
+        uint64_t offset = 0;
+        while ((hdr = getItem(&m_inflated[0], m_inflated.size(),
+                              offset, &payload))) {
+            if (!visitor->visit(((uint64_t) block << 32) | offset,
+                                hdr, payload)) {
+                return true;
+            }
+            offset += sizeof(*hdr) + hdr->size;
+        }
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+/* Collects the locations of the items of each state and type */
+class IndexBuilder: public ExecutionTraceReader::Visitor
+{
+public:
+    struct StateInfo {
+        uint32_t parentId;
+        uint64_t forkItem;
+        std::vector<uint64_t> locations;
+
+        StateInfo(): parentId(0), forkItem(EXECTRACE_INDEX_NONE) {}
+    };
+
+    typedef std::map<uint32_t, StateInfo> States;
+
+    States m_states;
+    std::vector<uint64_t> m_types[EXECTRACE_INDEX_TYPES];
+    uint64_t m_itemCount;
+
+    IndexBuilder(): m_itemCount(0) {}
+
+    bool visit(uint64_t location, const ExecutionTraceItemHeader *hdr,
+               const uint8_t *payload) {
+        StateInfo &state = m_states[hdr->stateId];
+        state.locations.push_back(location);
+        m_types[hdr->type].push_back(location);
+        ++m_itemCount;
+
+        if (hdr->type != TRACE_FORK ||
+            hdr->size < sizeof(ExecutionTraceFork) - sizeof(uint32_t)) {
+            return true;
+        }
+
+        const ExecutionTraceFork *fork =
+                reinterpret_cast<const ExecutionTraceFork*>(payload);
+        unsigned maxChildren = (hdr->size - (sizeof(ExecutionTraceFork) -
+                                sizeof(uint32_t))) / sizeof(uint32_t);
+        unsigned count = std::min<unsigned>(fork->stateCount, maxChildren);
+
+        //The forking state is usually one of the children
+        for (unsigned i = 0; i < count; ++i) {
+            uint32_t child = fork->children[i];
+            if (child == hdr->stateId) {
+                continue;
+            }
+
+            StateInfo &childState = m_states[child];
+            if (childState.forkItem == EXECTRACE_INDEX_NONE &&
+                childState.locations.empty()) {
+                childState.parentId = hdr->stateId;
+                childState.forkItem = m_states[hdr->stateId].locations.size() - 1;
+            }
+        }
+
+        return true;
+    }
+};
+
+bool writeAll(FILE *fp, const void *data, size_t size)
+{
+    return !size || fwrite(data, size, 1, fp) == 1;
+}
+
+} // namespace
+
+ExecutionTracePathIndex::ExecutionTracePathIndex():
+    m_fd(-1), m_data(NULL), m_size(0), m_header(NULL), m_states(NULL),
+    m_types(NULL), m_locations(NULL)
+{
+
+}
+
+ExecutionTracePathIndex::~ExecutionTracePathIndex()
+{
+    close();
+}
+
+bool ExecutionTracePathIndex::build(ExecutionTraceReader *trace,
+                                    const std::string &fileName,
+                                    std::string *error)
+{
+    IndexBuilder builder;
+    if (!trace->scan(&builder)) {
+        *error = "the trace is corrupted";
+        return false;
+    }
+
+    ExecutionTraceIndexFileHeader hdr;
+    hdr.magic = EXECTRACE_INDEX_MAGIC;
+    hdr.version = EXECTRACE_INDEX_VERSION;
+    hdr.traceSize = trace->getSize();
+    hdr.traceModificationTime = trace->getModificationTime();
+    hdr.itemCount = builder.m_itemCount;
+    hdr.stateCount = builder.m_states.size();
+    hdr.typeCount = EXECTRACE_INDEX_TYPES;
+    hdr.statesOffset = sizeof(hdr);
+    hdr.typesOffset = hdr.statesOffset +
+            hdr.stateCount * sizeof(ExecutionTraceIndexState);
+    hdr.locationsOffset = hdr.typesOffset +
+            hdr.typeCount * sizeof(ExecutionTraceIndexType);
+
+    std::vector<ExecutionTraceIndexState> states;
+    uint64_t firstLocation = 0;
+    for (IndexBuilder::States::const_iterator it = builder.m_states.begin();
+         it != builder.m_states.end(); ++it) {
+        ExecutionTraceIndexState s;
+        s.stateId = (*it).first;
+        s.parentId = (*it).second.parentId;
+        s.forkItem = (*it).second.forkItem;
+        s.firstLocation = firstLocation;
+        s.locationCount = (*it).second.locations.size();
+        states.push_back(s);
+        firstLocation += s.locationCount;
+    }
+
+    std::vector<ExecutionTraceIndexType> types(EXECTRACE_INDEX_TYPES);
+    for (unsigned i = 0; i < EXECTRACE_INDEX_TYPES; ++i) {
+        types[i].firstLocation = firstLocation;
+        types[i].locationCount = builder.m_types[i].size();
+        firstLocation += types[i].locationCount;
+    }
+
+    //Write to a temporary file, so that readers never see a partial index
+    std::string tmpName = fileName + ".tmp";
+    FILE *fp = fopen(tmpName.c_str(), "wb");
+    if (!fp) {
+        *error = tmpName + ": " + strerror(errno);
+        return false;
+    }
+
+    bool ok = writeAll(fp, &hdr, sizeof(hdr));
+    ok = ok && (states.empty() ||
+                writeAll(fp, &states[0], states.size() * sizeof(states[0])));
+    ok = ok && writeAll(fp, &types[0], types.size() * sizeof(types[0]));
+
+    for (IndexBuilder::States::const_iterator it = builder.m_states.begin();
+         ok && it != builder.m_states.end(); ++it) {
+        const std::vector<uint64_t> &l = (*it).second.locations;
+        ok = l.empty() || writeAll(fp, &l[0], l.size() * sizeof(l[0]));
+    }
+
+    for (unsigned i = 0; ok && i < EXECTRACE_INDEX_TYPES; ++i) {
+        const std::vector<uint64_t> &l = builder.m_types[i];
+        ok = l.empty() || writeAll(fp, &l[0], l.size() * sizeof(l[0]));
+    }
+
+    if (fclose(fp) != 0 || !ok || rename(tmpName.c_str(), fileName.c_str())) {
+        *error = fileName + ": " + strerror(errno);
+        unlink(tmpName.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool ExecutionTracePathIndex::map(const std::string &fileName,
+                                  const ExecutionTraceReader *trace,
+                                  std::string *error)
+{
+    uint64_t modificationTime;
+    if (!mapFile(fileName, &m_fd, &m_data, &m_size,
+                 &modificationTime, error)) {
+        return false;
+    }
+
+    m_header = reinterpret_cast<const ExecutionTraceIndexFileHeader*>(m_data);
+    if (m_size < sizeof(*m_header) ||
+        m_header->magic != EXECTRACE_INDEX_MAGIC ||
+        m_header->version != EXECTRACE_INDEX_VERSION ||
+        m_header->typeCount != EXECTRACE_INDEX_TYPES ||
+        m_header->traceSize != trace->getSize() ||
+        m_header->traceModificationTime != trace->getModificationTime() ||
+        m_header->locationsOffset +
+            2 * m_header->itemCount * sizeof(uint64_t) > m_size) {
+        *error = fileName + ": the index does not match the trace";
+        close();
+        return false;
+    }
+
+    m_states = reinterpret_cast<const ExecutionTraceIndexState*>(
+            m_data + m_header->statesOffset);
+    m_types = reinterpret_cast<const ExecutionTraceIndexType*>(
+            m_data + m_header->typesOffset);
+    m_locations = reinterpret_cast<const uint64_t*>(
+            m_data + m_header->locationsOffset);
+
+    return true;
+}
+
+bool ExecutionTracePathIndex::open(ExecutionTraceReader *trace,
+                                   const std::string &fileName,
+                                   std::string *error)
+{
+    assert(m_fd < 0);
+
+    if (map(fileName, trace, error)) {
+        return true;
+    }
+
+    return build(trace, fileName, error) && map(fileName, trace, error);
+}
+
+void ExecutionTracePathIndex::close()
+{
+    unmapFile(&m_fd, &m_data, m_size);
+    m_size = 0;
+    m_header = NULL;
+    m_states = NULL;
+    m_types = NULL;
+    m_locations = NULL;
+}
+
+const ExecutionTraceIndexState *ExecutionTracePathIndex::findState(
+        uint32_t stateId) const
+{
+    unsigned low = 0, high = m_header->stateCount;
+    while (low < high) {
+        unsigned mid = low + (high - low) / 2;
+        if (m_states[mid].stateId < stateId) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (low < m_header->stateCount && m_states[low].stateId == stateId) {
+        return &m_states[low];
+    }
+    return NULL;
+}
+
+bool ExecutionTracePathIndex::getPath(uint32_t stateId,
+                                      std::vector<uint64_t> *locations) const
+{
+    //Walk up to the initial state, remembering how many items of each
+    //ancestor belong to the path
+    std::vector<std::pair<const ExecutionTraceIndexState*, uint64_t> > chain;
+
+    const ExecutionTraceIndexState *state = findState(stateId);
+    if (!state) {
+        return false;
+    }
+
+    uint64_t end = state->locationCount;
+    while (state) {
+        if (chain.size() > m_header->stateCount) {
+            return false; //Cycle in a corrupted index
+        }
+        chain.push_back(std::make_pair(state, end));
+
+        if (state->forkItem == EXECTRACE_INDEX_NONE) {
+            break;
+        }
+        end = state->forkItem + 1;
+        state = findState(state->parentId);
+    }
+
+    locations->clear();
+    for (unsigned i = chain.size(); i > 0; --i) {
+        const ExecutionTraceIndexState *s = chain[i - 1].first;
+        uint64_t count = std::min(chain[i - 1].second, s->locationCount);
+        const uint64_t *l = m_locations + s->firstLocation;
+        locations->insert(locations->end(), l, l + count);
+    }
+
+    return true;
+}
+
+void ExecutionTracePathIndex::getItemsOfType(uint8_t type,
+                                             const uint64_t **locations,
+                                             uint64_t *count) const
+{
+    *locations = m_locations + m_types[type].firstLocation;
+    *count = m_types[type].locationCount;
+}
+
+} // namespace plugins
+} // namespace s2e
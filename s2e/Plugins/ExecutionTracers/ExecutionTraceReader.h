@@ -0,0 +1,199 @@
+/*
+ * S2E Selective Symbolic Execution Framework
+ *
+ * Copyright (c) 2010, Dependable Systems Laboratory, EPFL
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Dependable Systems Laboratory, EPFL nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE DEPENDABLE SYSTEMS LABORATORY, EPFL BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Currently maintained by:
+ *    Vitaly Chipounov <vitaly.chipounov@epfl.ch>
+ *    Volodymyr Kuznetsov <vova.kuznetsov@epfl.ch>
+ *
+ * All contributors are listed in S2E-AUTHORS file.
+ *
+ */
+
+#ifndef S2E_PLUGINS_EXECTRACE_READER_H
+#define S2E_PLUGINS_EXECTRACE_READER_H
+
+#include <inttypes.h>
+
+#include <string>
+#include <vector>
+
+#include "TraceEntries.h"
+
+namespace s2e {
+namespace plugins {
+
+/**
+ *  Random access to the items of a trace written by ExecutionTracer.
+ *  The trace is mapped in memory. Items are designated by a location:
+ *  the file offset of the item in uncompressed traces, and
+ *  (block number << 32) | (offset in the inflated block) in compressed ones.
+ *  This class has no dependencies on S2E, so that offline tools can use it.
+ */
+class ExecutionTraceReader
+{
+public:
+    class Visitor {
+    public:
+        virtual ~Visitor() {}
+
+        /** Returns false to stop the scan */
+        virtual bool visit(uint64_t location,
+                           const ExecutionTraceItemHeader *hdr,
+                           const uint8_t *payload) = 0;
+    };
+
+private:
+    int m_fd;
+    const uint8_t *m_data;
+    uint64_t m_size;
+    uint64_t m_modificationTime;
+    bool m_compressed;
+
+    /* Only for compressed traces. Blocks are inflated on demand,
+       the last one is kept around. */
+    std::vector<ExecutionTraceIndexEntry> m_blocks;
+    std::vector<uint8_t> m_inflated;
+    int64_t m_inflatedBlock;
+
+    bool loadBlocks(std::string *error);
+    bool inflateBlock(unsigned block);
+
+    const ExecutionTraceItemHeader *getItem(const uint8_t *data, uint64_t size,
+                                            uint64_t offset,
+                                            const uint8_t **payload) const;
+
+public:
+    ExecutionTraceReader();
+    ~ExecutionTraceReader();
+
+    /** Returns false on failure. A truncated trace is still opened,
+        with a warning in error. */
+    bool open(const std::string &fileName, std::string *error);
+    void close();
+
+    uint64_t getSize() const { return m_size; }
+    uint64_t getModificationTime() const { return m_modificationTime; }
+    bool isCompressed() const { return m_compressed; }
+
+    /** Returns NULL if there is no complete item at location.
+        The returned pointers stay valid until the next call. */
+    const ExecutionTraceItemHeader *getItem(uint64_t location,
+                                            const uint8_t **payload);
+
+    /** Visits all the items in file order */
+    bool scan(Visitor *visitor);
+};
+
+/**
+ *  On-disk index of a trace, which gives the items of each state and of
+ *  each item type without scanning the trace. The items of a state only
+ *  cover its own execution: the path that led to the state starts in
+ *  its ancestors, up to the fork items that created their children.
+ */
+#define EXECTRACE_INDEX_MAGIC   0x49543253 /* "S2TI" */
+#define EXECTRACE_INDEX_VERSION 1
+#define EXECTRACE_INDEX_TYPES   256
+#define EXECTRACE_INDEX_NONE    ((uint64_t) -1)
+
+struct ExecutionTraceIndexFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t traceSize;
+    uint64_t traceModificationTime;
+    uint64_t itemCount;
+    uint32_t stateCount;
+    uint32_t typeCount;
+    uint64_t statesOffset;
+    uint64_t typesOffset;
+    uint64_t locationsOffset;
+}__attribute__((packed));
+
+struct ExecutionTraceIndexState {
+    uint32_t stateId;
+    uint32_t parentId;
+    //Index of the fork item among the items of the parent,
+    //EXECTRACE_INDEX_NONE for the initial states
+    uint64_t forkItem;
+    //Locations of the items of the state
+    uint64_t firstLocation;
+    uint64_t locationCount;
+}__attribute__((packed));
+
+struct ExecutionTraceIndexType {
+    uint64_t firstLocation;
+    uint64_t locationCount;
+}__attribute__((packed));
+
+class ExecutionTracePathIndex
+{
+    int m_fd;
+    const uint8_t *m_data;
+    uint64_t m_size;
+
+    const ExecutionTraceIndexFileHeader *m_header;
+    const ExecutionTraceIndexState *m_states; //Sorted by state id
+    const ExecutionTraceIndexType *m_types;
+    const uint64_t *m_locations;
+
+    bool map(const std::string &fileName, const ExecutionTraceReader *trace,
+             std::string *error);
+
+public:
+    ExecutionTracePathIndex();
+    ~ExecutionTracePathIndex();
+
+    /** Scans the trace and writes its index to fileName */
+    static bool build(ExecutionTraceReader *trace, const std::string &fileName,
+                      std::string *error);
+
+    /** Opens the index of the trace, building it first if fileName does
+        not exist or was built for another version of the trace */
+    bool open(ExecutionTraceReader *trace, const std::string &fileName,
+              std::string *error);
+    void close();
+
+    uint64_t getItemCount() const { return m_header->itemCount; }
+    unsigned getStateCount() const { return m_header->stateCount; }
+    const ExecutionTraceIndexState *getState(unsigned i) const {
+        return &m_states[i];
+    }
+    const ExecutionTraceIndexState *findState(uint32_t stateId) const;
+
+    /** Locations of the items of the path that led to the given state,
+        in execution order */
+    bool getPath(uint32_t stateId, std::vector<uint64_t> *locations) const;
+
+    /** Locations of all the items of the given type, in file order */
+    void getItemsOfType(uint8_t type, const uint64_t **locations,
+                        uint64_t *count) const;
+};
+
+} // namespace plugins
+} // namespace s2e
+
+#endif
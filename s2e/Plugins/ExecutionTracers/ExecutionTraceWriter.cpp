@@ -0,0 +1,324 @@
+/*
+ * S2E Selective Symbolic Execution Framework
+ *
+ * Copyright (c) 2010, Dependable Systems Laboratory, EPFL
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Dependable Systems Laboratory, EPFL nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE DEPENDABLE SYSTEMS LABORATORY, EPFL BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Currently maintained by:
+ *    Vitaly Chipounov <vitaly.chipounov@epfl.ch>
+ *    Volodymyr Kuznetsov <vova.kuznetsov@epfl.ch>
+ *
+ * All contributors are listed in S2E-AUTHORS file.
+ *
+ */
+
+#include "ExecutionTraceWriter.h"
+
+#include <zlib.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include <cassert>
+
+namespace s2e {
+namespace plugins {
+
+ExecutionTraceClock::ExecutionTraceClock():
+    m_tscStart(0), m_usecStart(0), m_tscBase(0), m_usecBase(0),
+    m_usecPerTick(0)
+{
+
+}
+
+uint64_t ExecutionTraceClock::getWallTime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**
+ *  The rate is measured over the whole run, which makes it more accurate
+ *  at each call. The extrapolation restarts from the current time stamp
+ *  with the old rate, so that timestamps never go backwards.
+ */
+void ExecutionTraceClock::calibrate()
+{
+    uint64_t tsc = readTsc();
+    uint64_t usec = getWallTime();
+
+    if (!tsc) {
+        return;
+    }
+
+    if (!m_tscStart) {
+        m_tscStart = tsc;
+        m_usecStart = usec;
+        return;
+    }
+
+    if (tsc <= m_tscStart || usec <= m_usecStart) {
+        return;
+    }
+
+    uint64_t base = m_usecPerTick ? now() : usec;
+    m_usecPerTick = (double) (usec - m_usecStart) / (tsc - m_tscStart);
+    m_tscBase = tsc;
+    m_usecBase = base;
+}
+
+ExecutionTraceWriter::ExecutionTraceWriter(unsigned blockSize,
+                                           unsigned blockCount,
+                                           bool compress):
+    m_file(NULL), m_compress(compress), m_blockSize(blockSize),
+    m_head(0), m_tail(0), m_stop(false), m_failed(false),
+    m_offset(0), m_itemPosition(0)
+{
+    assert(blockSize > 0 && blockCount > 1);
+
+    m_blocks.resize(blockCount);
+    for (unsigned i = 0; i < blockCount; ++i) {
+        m_blocks[i].data.resize(blockSize);
+        m_blocks[i].size = 0;
+        m_blocks[i].itemCount = 0;
+    }
+
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_dataCond, NULL);
+    pthread_cond_init(&m_spaceCond, NULL);
+}
+
+ExecutionTraceWriter::~ExecutionTraceWriter()
+{
+    close();
+
+    pthread_cond_destroy(&m_spaceCond);
+    pthread_cond_destroy(&m_dataCond);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+bool ExecutionTraceWriter::open(const std::string &fileName, bool append)
+{
+    assert(!m_file);
+
+    m_file = fopen(fileName.c_str(), append ? "ab" : "wb");
+    if (!m_file) {
+        return false;
+    }
+
+    m_fileName = fileName;
+    m_failed = false;
+    m_stop = false;
+
+    if (append) {
+        fseek(m_file, 0, SEEK_END);
+        m_offset = ftell(m_file);
+    } else {
+        m_index.clear();
+        m_offset = 0;
+        m_itemPosition = 0;
+
+        if (m_compress) {
+            ExecutionTraceFileHeader hdr;
+            hdr.magic = EXECTRACE_FILE_MAGIC;
+            hdr.version = EXECTRACE_VERSION;
+            writeBytes(&hdr, sizeof(hdr));
+        }
+    }
+
+    /* The signals used by QEMU must be handled by the main thread */
+    sigset_t set, oldset;
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    int err = pthread_create(&m_thread, NULL, writerThread, this);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (err) {
+        fclose(m_file);
+        m_file = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+void ExecutionTraceWriter::close()
+{
+    if (!m_file) {
+        return;
+    }
+
+    submit();
+
+    pthread_mutex_lock(&m_mutex);
+    m_stop = true;
+    pthread_cond_signal(&m_dataCond);
+    pthread_mutex_unlock(&m_mutex);
+
+    pthread_join(m_thread, NULL);
+
+    if (m_compress) {
+        writeFooter();
+    }
+
+    fclose(m_file);
+    m_file = NULL;
+}
+
+void ExecutionTraceWriter::submit()
+{
+    if (!m_blocks[m_head].size) {
+        return;
+    }
+
+    unsigned next = (m_head + 1) % m_blocks.size();
+
+    pthread_mutex_lock(&m_mutex);
+    while (next == m_tail) {
+        pthread_cond_wait(&m_spaceCond, &m_mutex);
+    }
+    m_head = next;
+    pthread_cond_signal(&m_dataCond);
+    pthread_mutex_unlock(&m_mutex);
+
+    /* The writer thread is done with this block */
+    m_blocks[m_head].size = 0;
+    m_blocks[m_head].itemCount = 0;
+}
+
+void ExecutionTraceWriter::flush()
+{
+    submit();
+
+    pthread_mutex_lock(&m_mutex);
+    while (m_tail != m_head) {
+        pthread_cond_wait(&m_spaceCond, &m_mutex);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void *ExecutionTraceWriter::writerThread(void *opaque)
+{
+    ExecutionTraceWriter *w = static_cast<ExecutionTraceWriter*>(opaque);
+
+    pthread_mutex_lock(&w->m_mutex);
+    for (;;) {
+        while (w->m_tail == w->m_head && !w->m_stop) {
+            pthread_cond_wait(&w->m_dataCond, &w->m_mutex);
+        }
+
+        if (w->m_tail == w->m_head) {
+            break;
+        }
+
+        /* The main thread does not touch blocks in [m_tail, m_head) */
+        const Block &block = w->m_blocks[w->m_tail];
+        pthread_mutex_unlock(&w->m_mutex);
+
+        w->writeBlock(block);
+
+        pthread_mutex_lock(&w->m_mutex);
+        w->m_tail = (w->m_tail + 1) % w->m_blocks.size();
+        pthread_cond_broadcast(&w->m_spaceCond);
+    }
+    pthread_mutex_unlock(&w->m_mutex);
+
+    return NULL;
+}
+
+bool ExecutionTraceWriter::writeBytes(const void *data, unsigned size)
+{
+    if (fwrite(data, size, 1, m_file) != 1) {
+        //At this point the trace is corrupted
+        m_failed = true;
+        return false;
+    }
+    m_offset += size;
+    return true;
+}
+
+void ExecutionTraceWriter::writeBlock(const Block &block)
+{
+    if (m_failed) {
+        return;
+    }
+
+    if (!m_compress) {
+        writeBytes(&block.data[0], block.size);
+        fflush(m_file);
+        return;
+    }
+
+    uLongf compressedSize = compressBound(block.size);
+    if (m_compressed.size() < compressedSize) {
+        m_compressed.resize(compressedSize);
+    }
+
+    if (compress2(&m_compressed[0], &compressedSize,
+                  &block.data[0], block.size, Z_BEST_SPEED) != Z_OK) {
+        m_failed = true;
+        return;
+    }
+
+    ExecutionTraceIndexEntry entry;
+    entry.offset = m_offset;
+    entry.firstItem = m_itemPosition;
+    entry.itemCount = block.itemCount;
+
+    ExecutionTraceBlockHeader hdr;
+    hdr.magic = EXECTRACE_BLOCK_MAGIC;
+    hdr.compressedSize = compressedSize;
+    hdr.size = block.size;
+    hdr.itemCount = block.itemCount;
+    hdr.firstItem = m_itemPosition;
+
+    if (writeBytes(&hdr, sizeof(hdr)) &&
+        writeBytes(&m_compressed[0], compressedSize)) {
+        m_index.push_back(entry);
+        m_itemPosition += block.itemCount;
+    }
+
+    fflush(m_file);
+}
+
+void ExecutionTraceWriter::writeFooter()
+{
+    if (m_failed) {
+        return;
+    }
+
+    ExecutionTraceFooter footer;
+    footer.indexOffset = m_offset;
+    footer.blockCount = m_index.size();
+    footer.magic = EXECTRACE_FOOTER_MAGIC;
+
+    if (!m_index.empty()) {
+        writeBytes(&m_index[0], m_index.size() * sizeof(m_index[0]));
+    }
+    writeBytes(&footer, sizeof(footer));
+}
+
+} // namespace plugins
+} // namespace s2e
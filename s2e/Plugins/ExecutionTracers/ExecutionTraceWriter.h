@@ -0,0 +1,186 @@
+/*
+ * S2E Selective Symbolic Execution Framework
+ *
+ * Copyright (c) 2010, Dependable Systems Laboratory, EPFL
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Dependable Systems Laboratory, EPFL nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE DEPENDABLE SYSTEMS LABORATORY, EPFL BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Currently maintained by:
+ *    Vitaly Chipounov <vitaly.chipounov@epfl.ch>
+ *    Volodymyr Kuznetsov <vova.kuznetsov@epfl.ch>
+ *
+ * All contributors are listed in S2E-AUTHORS file.
+ *
+ */
+
+#ifndef S2E_PLUGINS_EXECTRACE_WRITER_H
+#define S2E_PLUGINS_EXECTRACE_WRITER_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+
+#include "TraceEntries.h"
+
+namespace s2e {
+namespace plugins {
+
+/**
+ *  Timestamps for trace items. Reading the wall clock for every item is
+ *  too slow, so the clock extrapolates it from the time stamp counter on
+ *  x86 hosts. calibrate() must be called periodically to keep both in
+ *  sync. Returns microseconds since the epoch.
+ */
+class ExecutionTraceClock
+{
+    uint64_t m_tscStart, m_usecStart;
+    uint64_t m_tscBase, m_usecBase;
+    double m_usecPerTick;
+
+    static uint64_t readTsc() {
+#if defined(__i386__) || defined(__x86_64__)
+        uint32_t low, high;
+        __asm__ __volatile__("rdtsc" : "=a" (low), "=d" (high));
+        return ((uint64_t) high << 32) | low;
+#else
+        return 0;
+#endif
+    }
+
+public:
+    ExecutionTraceClock();
+
+    static uint64_t getWallTime();
+
+    void calibrate();
+
+    uint64_t now() const {
+        if (!m_usecPerTick) {
+            return getWallTime();
+        }
+        uint64_t tsc = readTsc();
+        if (tsc < m_tscBase) {
+            return m_usecBase;
+        }
+        return m_usecBase + (uint64_t) ((tsc - m_tscBase) * m_usecPerTick);
+    }
+};
+
+/**
+ *  Buffers trace items in a ring of blocks. Appending an item only copies
+ *  it to the current block. Full blocks are handed over to a background
+ *  thread, which compresses them (if enabled) and writes them to the file.
+ *  See TraceEntries.h for the file format.
+ */
+class ExecutionTraceWriter
+{
+    struct Block {
+        std::vector<uint8_t> data;
+        unsigned size;
+        unsigned itemCount;
+    };
+
+    std::string m_fileName;
+    FILE *m_file;
+    bool m_compress;
+    unsigned m_blockSize;
+
+    /* Blocks [m_tail, m_head) are waiting for the writer thread,
+       m_head is being filled. Both indexes are protected by m_mutex. */
+    std::vector<Block> m_blocks;
+    unsigned m_head, m_tail;
+
+    pthread_t m_thread;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_dataCond;
+    pthread_cond_t m_spaceCond;
+    bool m_stop;
+    volatile bool m_failed;
+
+    /* Only accessed by the writer thread while it runs */
+    std::vector<uint8_t> m_compressed;
+    std::vector<ExecutionTraceIndexEntry> m_index;
+    uint64_t m_offset;
+    uint64_t m_itemPosition;
+
+    static void *writerThread(void *opaque);
+    void writeBlock(const Block &block);
+    bool writeBytes(const void *data, unsigned size);
+    void writeFooter();
+
+public:
+    ExecutionTraceWriter(unsigned blockSize, unsigned blockCount,
+                         bool compress);
+    ~ExecutionTraceWriter();
+
+    /** Starts the writer thread. When append is set, the items are added
+        to an existing trace written by this object before close(). */
+    bool open(const std::string &fileName, bool append);
+
+    /** Writes all the pending items and stops the writer thread */
+    void close();
+
+    bool isOpen() const {
+        return m_file != NULL;
+    }
+
+    /** Appends one item, made of a header and a payload.
+        Returns false if the trace could not be written. */
+    bool write(const void *header, unsigned headerSize,
+               const void *payload, unsigned payloadSize) {
+        unsigned size = headerSize + payloadSize;
+        Block *block = &m_blocks[m_head];
+        if (block->size + size > block->data.size()) {
+            submit();
+            block = &m_blocks[m_head];
+            if (size > block->data.size()) {
+                block->data.resize(size);
+            }
+        }
+
+        memcpy(&block->data[block->size], header, headerSize);
+        if (payloadSize) {
+            memcpy(&block->data[block->size + headerSize], payload, payloadSize);
+        }
+        block->size += size;
+        ++block->itemCount;
+
+        return !m_failed;
+    }
+
+    /** Hands the current block over to the writer thread */
+    void submit();
+
+    /** Returns once all items appended so far are in the file */
+    void flush();
+};
+
+} // namespace plugins
+} // namespace s2e
+
+#endif
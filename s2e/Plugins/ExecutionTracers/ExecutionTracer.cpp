@@ -40,8 +40,6 @@
 #include <s2e/ConfigFile.h>
 #include <s2e/Utils.h>
 
-#include <llvm/System/TimeValue.h>
-
 #include <iostream>
 
 namespace s2e {
@@ -51,6 +49,26 @@ S2E_DEFINE_PLUGIN(ExecutionTracer, "ExecutionTracer plugin", "",);
 
 void ExecutionTracer::initialize()
 {
+    ConfigFile *cfg = s2e()->getConfig();
+
+    //Items are buffered in blockCount blocks of blockSize bytes
+    //and written to the trace by a separate thread
+    unsigned blockSize = cfg->getInt(getConfigKey() + ".blockSize", 64 * 1024);
+    unsigned blockCount = cfg->getInt(getConfigKey() + ".blockCount", 16);
+
+    //Compressed traces are split in zlib-compressed blocks, with an index
+    //at the end of the file (see TraceEntries.h)
+    bool compress = cfg->getBool(getConfigKey() + ".compress", false);
+
+    if (blockSize < sizeof(ExecutionTraceItemHeader) || blockCount < 2) {
+        s2e()->getWarningsStream() << "ExecutionTracer: blockSize must hold at least one item"
+                " and blockCount must be at least 2" << std::endl;
+        exit(-1);
+    }
+
+    m_writer = new ExecutionTraceWriter(blockSize, blockCount, compress);
+    m_clock.calibrate();
+
     createNewTraceFile(false);
 
     s2e()->getCorePlugin()->onStateFork.connect(
@@ -67,7 +85,7 @@ void ExecutionTracer::initialize()
 
 ExecutionTracer::~ExecutionTracer()
 {
-    fclose(m_LogFile);
+    delete m_writer;
 }
 
 void ExecutionTracer::createNewTraceFile(bool append)
@@ -75,13 +93,11 @@ void ExecutionTracer::createNewTraceFile(bool append)
 
     if (append) {
         assert(m_fileName.size() > 0);
-        m_LogFile = fopen(m_fileName.c_str(), "a");
     }else {
         m_fileName = s2e()->getOutputFilename("ExecutionTracer.dat");
-        m_LogFile = fopen(m_fileName.c_str(), "wb");
     }
 
-    if (!m_LogFile) {
+    if (!m_writer->open(m_fileName, append)) {
         s2e()->getWarningsStream() << "Could not create ExecutionTracer.dat" << std::endl;
         exit(-1);
     }
@@ -90,8 +106,11 @@ void ExecutionTracer::createNewTraceFile(bool append)
 
 void ExecutionTracer::onTimer()
 {
-    if (m_LogFile) {
-        fflush(m_LogFile);
+    m_clock.calibrate();
+
+    //Write out the items of the last second without waiting for them
+    if (m_writer->isOpen()) {
+        m_writer->submit();
     }
 }
 
@@ -101,40 +120,33 @@ uint32_t ExecutionTracer::writeData(
 {
     ExecutionTraceItemHeader item;
 
-    assert(m_LogFile);
+    assert(m_writer->isOpen());
 
-    item.timeStamp = llvm::sys::TimeValue::now().usec();
+    item.timeStamp = m_clock.now();
     item.size = size;
     item.type = type;
     item.stateId = state->getID();
     item.pid = state->getPid();
 
-    if (fwrite(&item, sizeof(item), 1, m_LogFile) != 1) {
+    if (!m_writer->write(&item, sizeof(item), data, size)) {
         return 0;
     }
 
-    if (size) {
-        if (fwrite(data, size, 1, m_LogFile) != 1) {
-            //at this point the log is corrupted.
-            assert(false);
-        }
-    }
-
     return ++m_CurrentIndex;
 }
 
 void ExecutionTracer::flush()
 {
-    if (m_LogFile) {
-        fflush(m_LogFile);
+    if (m_writer->isOpen()) {
+        m_writer->flush();
     }
 }
 
 void ExecutionTracer::onProcessFork(bool preFork, bool isChild, unsigned parentProcId)
 {
+    //The writer thread does not survive fork()
     if (preFork) {
-        fclose(m_LogFile);
-        m_LogFile = NULL;
+        m_writer->close();
     }else {
         if (isChild) {
             createNewTraceFile(false);
@@ -45,6 +45,7 @@
 #include <stdio.h>
 
 #include "TraceEntries.h"
+#include "ExecutionTraceWriter.h"
 
 namespace s2e {
 namespace plugins {
@@ -63,7 +64,8 @@ class ExecutionTracer : public Plugin
     S2E_PLUGIN
 
     std::string m_fileName;
-    FILE* m_LogFile;
+    ExecutionTraceWriter *m_writer;
+    ExecutionTraceClock m_clock;
     uint32_t m_CurrentIndex;
     OSMonitor *m_Monitor;
     ExecTracerModules m_Modules;
@@ -73,7 +75,7 @@ class ExecutionTracer : public Plugin
     void onTimer();
     void createNewTraceFile(bool append);
 public:
-    ExecutionTracer(S2E* s2e): Plugin(s2e) {}
+    ExecutionTracer(S2E* s2e): Plugin(s2e), m_writer(NULL) {}
     ~ExecutionTracer();
     void initialize();
 
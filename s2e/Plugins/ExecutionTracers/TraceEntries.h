@@ -76,6 +76,47 @@ struct ExecutionTraceItemHeader{
     //uint8_t  payload[];
 }__attribute__((packed));
 
+/**
+ * Uncompressed traces are a plain sequence of items (header + payload).
+ *
+ * Compressed traces start with an ExecutionTraceFileHeader, followed by
+ * blocks. Each block is an ExecutionTraceBlockHeader followed by the
+ * zlib-compressed items, which have the same layout as in an uncompressed
+ * trace once inflated. The trace ends with an index of all the blocks
+ * and an ExecutionTraceFooter. A trace that was appended to (e.g., by the
+ * parent after a process fork) contains several footers, the last one
+ * indexes the whole file.
+ */
+#define EXECTRACE_FILE_MAGIC   0x45543253 /* "S2TE" */
+#define EXECTRACE_BLOCK_MAGIC  0x4b4c4254 /* "TBLK" */
+#define EXECTRACE_FOOTER_MAGIC 0x58444e49 /* "INDX" */
+#define EXECTRACE_VERSION      1
+
+struct ExecutionTraceFileHeader {
+    uint32_t magic;
+    uint32_t version;
+}__attribute__((packed));
+
+struct ExecutionTraceBlockHeader {
+    uint32_t magic;
+    uint32_t compressedSize;
+    uint32_t size;       //Size of the inflated items
+    uint32_t itemCount;
+    uint64_t firstItem;  //Position of the first item in the trace
+}__attribute__((packed));
+
+struct ExecutionTraceIndexEntry {
+    uint64_t offset;     //File offset of the block header
+    uint64_t firstItem;
+    uint32_t itemCount;
+}__attribute__((packed));
+
+struct ExecutionTraceFooter {
+    uint64_t indexOffset;
+    uint32_t blockCount;
+    uint32_t magic;
+}__attribute__((packed));
+
 struct ExecutionTraceModuleLoad {
     char name[32];
     uint64_t loadBase;
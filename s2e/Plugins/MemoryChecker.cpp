@@ -52,6 +52,7 @@ extern "C" {
 
 #include <klee/Internal/ADT/ImmutableMap.h>
 
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 
@@ -115,6 +116,223 @@ namespace {
             << "    type = " << r.type << "\n";
         return out;
     }
+
+    /**
+     * Byte-granularity copy of the permissions of the memory map, for the
+     * 32-bit guest address space. It only answers whether an access is
+     * fine, the memory map remains the reference for everything else.
+     *
+     * The shadow is a two-level page table of shadow pages. The directory,
+     * the tables and the pages are reference counted and shared between
+     * the copies made at fork time, they are copied on the first write.
+     * Pages entirely covered by one region point to a shared uniform page.
+     */
+    class ShadowMemory {
+    public:
+        /* Shadow byte: MemoryChecker::Permissions + first byte of a region */
+        enum { REGION_START = 0x80 };
+
+    private:
+        enum {
+            PAGE_BITS = 12, TABLE_BITS = 10, DIRECTORY_BITS = 10,
+            PAGE_SIZE = 1 << PAGE_BITS,
+            TABLE_SIZE = 1 << TABLE_BITS,
+            DIRECTORY_SIZE = 1 << DIRECTORY_BITS
+        };
+
+        struct Page {
+            unsigned refCount;
+            uint8_t bytes[PAGE_SIZE];
+        };
+
+        struct Table {
+            unsigned refCount;
+            Page *pages[TABLE_SIZE];
+        };
+
+        struct Directory {
+            unsigned refCount;
+            Table *tables[DIRECTORY_SIZE];
+        };
+
+        Directory *m_directory;
+
+        void operator=(const ShadowMemory &);
+
+        static void release(Page *page) {
+            if (page && --page->refCount == 0) {
+                delete page;
+            }
+        }
+
+        static void release(Table *table) {
+            if (table && --table->refCount == 0) {
+                for (unsigned i = 0; i < TABLE_SIZE; ++i) {
+                    release(table->pages[i]);
+                }
+                delete table;
+            }
+        }
+
+        /* Pages whose bytes are all equal to value, never freed */
+        static Page *getUniformPage(uint8_t value) {
+            static Page *pages[256];
+            if (!pages[value]) {
+                pages[value] = new Page();
+                pages[value]->refCount = 1;
+                memset(pages[value]->bytes, value, PAGE_SIZE);
+            }
+            ++pages[value]->refCount;
+            return pages[value];
+        }
+
+        Table *&getWritableTable(uint64_t address) {
+            if (m_directory->refCount > 1) {
+                --m_directory->refCount;
+                m_directory = new Directory(*m_directory);
+                m_directory->refCount = 1;
+                for (unsigned i = 0; i < DIRECTORY_SIZE; ++i) {
+                    if (m_directory->tables[i]) {
+                        ++m_directory->tables[i]->refCount;
+                    }
+                }
+            }
+
+            Table *&table = m_directory->tables[address >> (PAGE_BITS + TABLE_BITS)];
+            if (!table) {
+                table = new Table();
+                table->refCount = 1;
+            } else if (table->refCount > 1) {
+                --table->refCount;
+                table = new Table(*table);
+                table->refCount = 1;
+                for (unsigned i = 0; i < TABLE_SIZE; ++i) {
+                    if (table->pages[i]) {
+                        ++table->pages[i]->refCount;
+                    }
+                }
+            }
+            return table;
+        }
+
+        Page *&getPageEntry(uint64_t address) {
+            Table *table = getWritableTable(address);
+            return table->pages[(address >> PAGE_BITS) & (TABLE_SIZE - 1)];
+        }
+
+        uint8_t *getWritablePage(uint64_t address) {
+            Page *&page = getPageEntry(address);
+            if (!page) {
+                page = new Page();
+                page->refCount = 1;
+                memset(page->bytes, 0, PAGE_SIZE);
+            } else if (page->refCount > 1) {
+                --page->refCount;
+                page = new Page(*page);
+                page->refCount = 1;
+            }
+            return page->bytes;
+        }
+
+    public:
+        ShadowMemory() {
+            m_directory = new Directory();
+            m_directory->refCount = 1;
+        }
+
+        ShadowMemory(const ShadowMemory &other) {
+            m_directory = other.m_directory;
+            ++m_directory->refCount;
+        }
+
+        ~ShadowMemory() {
+            if (--m_directory->refCount == 0) {
+                for (unsigned i = 0; i < DIRECTORY_SIZE; ++i) {
+                    release(m_directory->tables[i]);
+                }
+                delete m_directory;
+            }
+        }
+
+        /* Returns the shadow bytes of the page of address, NULL if none */
+        inline const uint8_t *getPage(uint64_t address) const {
+            if (address >> (PAGE_BITS + TABLE_BITS + DIRECTORY_BITS)) {
+                return NULL;
+            }
+            const Table *table = m_directory->tables[address >> (PAGE_BITS + TABLE_BITS)];
+            if (!table) {
+                return NULL;
+            }
+            const Page *page = table->pages[(address >> PAGE_BITS) & (TABLE_SIZE - 1)];
+            return page ? page->bytes : NULL;
+        }
+
+        /**
+         * Returns true if all the bytes of the access belong to the same
+         * region and have the requested permissions. False means that the
+         * memory map must be consulted.
+         */
+        inline bool check(uint64_t start, unsigned size, uint8_t perms) const {
+            unsigned offset = start & (PAGE_SIZE - 1);
+            if (size == 0 || offset + size > PAGE_SIZE) {
+                return false;
+            }
+
+            const uint8_t *bytes = getPage(start);
+            if (!bytes) {
+                return false;
+            }
+            bytes += offset;
+
+            if ((bytes[0] & perms) != perms) {
+                return false;
+            }
+            for (unsigned i = 1; i < size; ++i) {
+                if ((bytes[i] & (perms | REGION_START)) != perms) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /* Sets the shadow of [start, start + size) to value */
+        void fill(uint64_t start, uint64_t size, uint8_t value) {
+            uint64_t limit = 1ULL << (PAGE_BITS + TABLE_BITS + DIRECTORY_BITS);
+            if (start >= limit) {
+                return;
+            }
+
+            uint64_t end = start + size;
+            if (end > limit || end < start) {
+                end = limit;
+            }
+
+            while (start < end) {
+                uint64_t pageStart = start & ~uint64_t(PAGE_SIZE - 1);
+                uint64_t pageEnd = pageStart + PAGE_SIZE;
+
+                if (start == pageStart && end >= pageEnd) {
+                    //Skip the copy when the page is entirely overwritten
+                    Page *&page = getPageEntry(start);
+                    release(page);
+                    page = value ? getUniformPage(value) : NULL;
+                } else {
+                    uint64_t chunkEnd = std::min(end, pageEnd);
+                    uint8_t *bytes = getWritablePage(start);
+                    memset(bytes + (start - pageStart), value, chunkEnd - start);
+                }
+
+                start = pageEnd;
+            }
+        }
+
+        void setByte(uint64_t address, uint8_t value) {
+            if (address >> (PAGE_BITS + TABLE_BITS + DIRECTORY_BITS)) {
+                return;
+            }
+            getWritablePage(address)[address & (PAGE_SIZE - 1)] = value;
+        }
+    };
 } // namespace
 
 class MemoryCheckerState: public PluginState
@@ -122,6 +340,7 @@ class MemoryCheckerState: public PluginState
 public:
     MemoryMap m_memoryMap;
     ResourceHandleMap m_resourceMap;
+    ShadowMemory m_shadow;
 
 public:
     MemoryCheckerState() {}
@@ -147,6 +366,14 @@ public:
     void setResourceMap(const ResourceHandleMap& resourceMap) {
         m_resourceMap = resourceMap;
     }
+
+    const ShadowMemory &getShadow() const {
+        return m_shadow;
+    }
+
+    ShadowMemory &getShadow() {
+        return m_shadow;
+    }
 };
 
 void MemoryChecker::initialize()
@@ -267,10 +494,16 @@ void MemoryChecker::onDataMemoryAccess(S2EExecutionState *state,
 
     onPreCheck.emit(state, start, accessSize, isWrite);
 
+    uint8_t perms = isWrite ? WRITE : READ;
+    if (!m_checkMemoryErrors || isAccessAllowed(state, start, accessSize, perms)) {
+        return;
+    }
+
+    //Slow path, the memory map knows why the access failed
     std::stringstream err;
     bool result = checkMemoryAccess(state, start,
                       accessSize,
-                      isWrite ? 2 : 1, err);
+                      perms, err);
 
 
     if (!result) {
@@ -492,6 +725,10 @@ void MemoryChecker::grantMemory(S2EExecutionState *state,
 
     plgState->setMemoryMap(memoryMap.replace(std::make_pair(region->range, region)));
 
+    uint8_t shadowValue = perms & READWRITE;
+    plgState->getShadow().fill(start, size, shadowValue);
+    plgState->getShadow().setByte(start, shadowValue | ShadowMemory::REGION_START);
+
 }
 
 bool MemoryChecker::revokeMemory(S2EExecutionState *state,
@@ -582,6 +819,7 @@ bool MemoryChecker::revokeMemory(S2EExecutionState *state,
 
         //we can not just delete it since it can be used by other states!
         //delete const_cast<MemoryRegion*>(res->second);
+        plgState->getShadow().fill(res->first.start, res->first.size, 0);
         plgState->setMemoryMap(memoryMap.remove(region->range));
     } while(false);
 
@@ -807,6 +1045,13 @@ bool MemoryChecker::checkMemoryAccess(S2EExecutionState *state,
     return !hasError;
 }
 
+bool MemoryChecker::isAccessAllowed(S2EExecutionState *state,
+                                    uint64_t start, unsigned size, uint8_t perms) const
+{
+    DECLARE_PLUGINSTATE_CONST(MemoryCheckerState, state);
+    return plgState->getShadow().check(start, size, perms);
+}
+
 bool MemoryChecker::findMemoryRegion(S2EExecutionState *state,
                                      uint64_t address,
                                      uint64_t *start, uint64_t *size) const
@@ -223,6 +223,10 @@ public:
             const std::string &regionTypePattern);
 
 
+    // Shadow memory lookup, false when checkMemoryAccess must decide
+    bool isAccessAllowed(S2EExecutionState *state,
+                         uint64_t start, unsigned size, uint8_t perms) const;
+
     // Check accessibility of memory region
     bool checkMemoryAccess(S2EExecutionState *state,
                            uint64_t start, uint64_t size, uint8_t perms,
@@ -364,7 +364,7 @@ bool ModuleExecutionDetector::isModuleConfigured(const std::string &moduleId) co
 
 const ModuleDescriptor *ModuleExecutionDetector::getModule(S2EExecutionState *state, uint64_t pc, bool tracked)
 {
-    DECLARE_PLUGINSTATE(ModuleTransitionState, state);
+    DECLARE_PLUGINSTATE_CONST(ModuleTransitionState, state);
     uint64_t pid = m_Monitor->getPid(state, pc);
 
     const ModuleDescriptor *currentModule =
@@ -390,7 +390,7 @@ void ModuleExecutionDetector::onTranslateBlockStart(
     TranslationBlock *tb,
     uint64_t pc)
 {
-    DECLARE_PLUGINSTATE(ModuleTransitionState, state);
+    DECLARE_PLUGINSTATE_CONST(ModuleTransitionState, state);
 
     uint64_t pid = m_Monitor->getPid(state, pc);
 
@@ -415,7 +415,7 @@ void ModuleExecutionDetector::onTranslateBlockEnd(
         bool staticTarget,
         uint64_t targetPc)
 {
-    DECLARE_PLUGINSTATE(ModuleTransitionState, state);
+    DECLARE_PLUGINSTATE_CONST(ModuleTransitionState, state);
 
     const ModuleDescriptor *currentModule =
             getCurrentDescriptor(state);
@@ -491,10 +491,17 @@ const ModuleDescriptor *ModuleExecutionDetector::getCurrentDescriptor(S2EExecuti
 void ModuleExecutionDetector::onExecution(
     S2EExecutionState *state, uint64_t pc)
 {
-    DECLARE_PLUGINSTATE(ModuleTransitionState, state);
-
     const ModuleDescriptor *currentModule = getCurrentDescriptor(state);
 
+    //Only ask for write access on actual transitions, to keep
+    //sharing the plugin state with the other forked states.
+    DECLARE_PLUGINSTATE_NCONST(ModuleTransitionState, constState, state);
+    if (constState->m_PreviousModule == currentModule) {
+        return;
+    }
+
+    DECLARE_PLUGINSTATE(ModuleTransitionState, state);
+
     //gTRACE("pid=%#"PRIx64" pc=%#"PRIx64"\n", pid, pc);
     if (plgState->m_PreviousModule != currentModule) {
 #if 0
@@ -544,208 +551,273 @@ void ModuleExecutionDetector::dumpMemory(S2EExecutionState *state,
 /*****************************************************************************/
 /*****************************************************************************/
 
-ModuleTransitionState::ModuleTransitionState()
+ModuleDescriptorTable::ModuleDescriptorTable()
 {
-    m_PreviousModule = NULL;
-    m_CachedModule = NULL;
+    m_table = new Table();
+    m_table->refCount = 1;
+    m_lastHit = NULL;
 }
 
-ModuleTransitionState::~ModuleTransitionState()
+ModuleDescriptorTable::ModuleDescriptorTable(const ModuleDescriptorTable &other)
 {
-    foreach2(it, m_Descriptors.begin(), m_Descriptors.end()) {
-        delete *it;
-    }
+    m_table = other.m_table;
+    ++m_table->refCount;
+    m_lastHit = other.m_lastHit;
+}
 
-    foreach2(it, m_NotTrackedDescriptors.begin(), m_NotTrackedDescriptors.end()) {
-        delete *it;
-    }
+ModuleDescriptorTable::~ModuleDescriptorTable()
+{
+    release(m_table);
 }
 
-ModuleTransitionState* ModuleTransitionState::clone() const
+ModuleDescriptorTable &ModuleDescriptorTable::operator=(const ModuleDescriptorTable &other)
 {
-    ModuleTransitionState *ret = new ModuleTransitionState();
+    ++other.m_table->refCount;
+    release(m_table);
+    m_table = other.m_table;
+    m_lastHit = other.m_lastHit;
+    return *this;
+}
 
-    foreach2(it, m_Descriptors.begin(), m_Descriptors.end()) {
-        ret->m_Descriptors.insert(new ModuleDescriptor(**it));
+void ModuleDescriptorTable::release(Table *table)
+{
+    if (--table->refCount) {
+        return;
     }
 
-    foreach2(it, m_NotTrackedDescriptors.begin(), m_NotTrackedDescriptors.end()) {
-        assert(*it != m_CachedModule && *it != m_PreviousModule);
-        ret->m_NotTrackedDescriptors.insert(new ModuleDescriptor(**it));
+    foreach2(it, table->entries.begin(), table->entries.end()) {
+        if (--(*it)->refCount == 0) {
+            delete *it;
+        }
     }
+    delete table;
+}
 
-    if (m_CachedModule) {
-        DescriptorSet::iterator it = ret->m_Descriptors.find(m_CachedModule);
-        assert(it != ret->m_Descriptors.end());
-        ret->m_CachedModule = *it;
+void ModuleDescriptorTable::unshare()
+{
+    if (m_table->refCount == 1) {
+        return;
     }
 
-    if (m_PreviousModule) {
-        DescriptorSet::iterator it = ret->m_Descriptors.find(m_PreviousModule);
-        assert(it != ret->m_Descriptors.end());
-        ret->m_PreviousModule = *it;
+    Table *table = new Table(*m_table);
+    table->refCount = 1;
+    foreach2(it, table->entries.begin(), table->entries.end()) {
+        ++(*it)->refCount;
     }
 
-    return ret;
+    --m_table->refCount;
+    m_table = table;
 }
 
-PluginState* ModuleTransitionState::factory(Plugin *p, S2EExecutionState *state)
+unsigned ModuleDescriptorTable::upperBound(uint64_t pid, uint64_t address) const
 {
-    ModuleTransitionState *s = new ModuleTransitionState();
-
-    p->s2e()->getDebugStream() << "Creating initial module transition state" << std::endl;
-
-    return s;
+    const std::vector<Entry*> &entries = m_table->entries;
+    unsigned low = 0, high = entries.size();
+
+    while (low < high) {
+        unsigned mid = low + (high - low) / 2;
+        const ModuleDescriptor &d = entries[mid]->desc;
+        if (d.Pid < pid || (d.Pid == pid && d.LoadBase <= address)) {
+            low = mid + 1;
+        }else {
+            high = mid;
+        }
+    }
+    return low;
 }
 
-const ModuleDescriptor *ModuleTransitionState::getDescriptor(uint64_t pid, uint64_t pc, bool tracked) const
+const ModuleDescriptor *ModuleDescriptorTable::lookup(uint64_t pid, uint64_t pc) const
 {
-    if (m_CachedModule) {
-        const ModuleDescriptor &md = *m_CachedModule;
-        uint64_t prevModStart = md.LoadBase;
-        uint64_t prevModSize = md.Size;
-        uint64_t prevModPid = md.Pid;
-        if (pid == prevModPid && pc >= prevModStart && pc < prevModStart + prevModSize) {
-            //We stayed in the same module
-            return m_CachedModule;
-        }
+    unsigned i = upperBound(pid, pc);
+    if (i == 0) {
+        return NULL;
     }
 
-    ModuleDescriptor d;
-    d.Pid = pid;
-    d.LoadBase = pc;
-    d.Size = 1;
-    DescriptorSet::iterator it = m_Descriptors.find(&d);
-    if (it != m_Descriptors.end()) {
-        m_CachedModule = *it;
-        return *it;
+    const Entry *e = m_table->entries[i - 1];
+    if (e->desc.Pid != pid || pc >= e->desc.LoadBase + e->desc.Size) {
+        return NULL;
     }
 
-    m_CachedModule = NULL;
+    m_lastHit = e;
+    return &e->desc;
+}
+
+const ModuleDescriptor *ModuleDescriptorTable::findOverlapping(const ModuleDescriptor &desc) const
+{
+    const std::vector<Entry*> &entries = m_table->entries;
 
-    if (!tracked) {
-        it = m_NotTrackedDescriptors.find(&d);
-        if (it != m_NotTrackedDescriptors.end()) {
-            //XXX: implement proper caching
-            assert(*it != m_CachedModule && *it != m_PreviousModule);
-            return *it;
-        }
+    //Modules of the same pid do not overlap each other, so only the
+    //one that starts right before the end of desc needs to be checked.
+    uint64_t last = desc.Size ? desc.LoadBase + desc.Size - 1 : desc.LoadBase;
+    unsigned i = upperBound(desc.Pid, last);
+    if (i == 0) {
+        return NULL;
     }
 
-    return NULL;
+    const ModuleDescriptor &d = entries[i - 1]->desc;
+    if (d.Pid != desc.Pid || d.LoadBase + d.Size <= desc.LoadBase) {
+        return NULL;
+    }
+    return &d;
 }
 
-bool ModuleTransitionState::loadDescriptor(const ModuleDescriptor &desc, bool track)
+bool ModuleDescriptorTable::insert(const ModuleDescriptor &desc)
 {
-    if (track) {
-        m_Descriptors.insert(new ModuleDescriptor(desc));
-    }else {
-        if (m_NotTrackedDescriptors.find(&desc) == m_NotTrackedDescriptors.end()) {
-            m_NotTrackedDescriptors.insert(new ModuleDescriptor(desc));
-        }
-        else {
-            return false;
-        }
+    if (findOverlapping(desc)) {
+        return false;
     }
+
+    unshare();
+
+    Entry *e = new Entry();
+    e->refCount = 1;
+    e->desc = desc;
+
+    std::vector<Entry*> &entries = m_table->entries;
+    entries.insert(entries.begin() + upperBound(desc.Pid, desc.LoadBase), e);
     return true;
 }
 
-void ModuleTransitionState::unloadDescriptor(const ModuleDescriptor &desc)
+void ModuleDescriptorTable::erase(const ModuleDescriptor *desc)
 {
-    ModuleDescriptor d;
-    d.LoadBase = desc.LoadBase;
-    d.Pid = desc.Pid;
-    d.Size = desc.Size;
-
-    DescriptorSet::iterator it = m_Descriptors.find(&d);
-    if (it != m_Descriptors.end()) {
-        if (m_CachedModule == *it) {
-            m_CachedModule = NULL;
+    unshare();
+    m_lastHit = NULL;
+
+    std::vector<Entry*> &entries = m_table->entries;
+    foreach2(it, entries.begin(), entries.end()) {
+        if (&(*it)->desc == desc) {
+            if (--(*it)->refCount == 0) {
+                delete *it;
+            }
+            entries.erase(it);
+            return;
         }
+    }
+    assert(false && "Descriptor not in the table");
+}
 
-        if (m_PreviousModule == *it) {
-            m_PreviousModule = NULL;
-        }
+void ModuleDescriptorTable::eraseWithPid(uint64_t pid)
+{
+    unsigned first = upperBound(pid - 1, (uint64_t) -1);
+    unsigned last = upperBound(pid, (uint64_t) -1);
+    if (pid == 0) {
+        first = 0;
+    }
 
-        const ModuleDescriptor *md = *it;
-        size_t s = m_Descriptors.erase(*it);
-        assert(s == 1);
-        delete md;
+    if (first == last) {
+        return;
     }
 
-    it = m_NotTrackedDescriptors.find(&d);
-    if (it != m_NotTrackedDescriptors.end()) {
-        assert(*it != m_CachedModule && *it != m_PreviousModule);
-        const ModuleDescriptor *md = *it;
-        size_t s = m_NotTrackedDescriptors.erase(*it);
-        assert(s == 1);
-        delete md;
+    unshare();
+    m_lastHit = NULL;
+
+    std::vector<Entry*> &entries = m_table->entries;
+    for (unsigned i = first; i < last; ++i) {
+        if (--entries[i]->refCount == 0) {
+            delete entries[i];
+        }
     }
+    entries.erase(entries.begin() + first, entries.begin() + last);
 }
 
-void ModuleTransitionState::unloadDescriptorsWithPid(uint64_t pid)
+/*****************************************************************************/
+/*****************************************************************************/
+/*****************************************************************************/
+
+ModuleTransitionState::ModuleTransitionState()
 {
-    DescriptorSet::iterator it, it1;
+    m_PreviousModule = NULL;
+}
 
-    for (it = m_Descriptors.begin(); it != m_Descriptors.end(); ) {
-        if ((*it)->Pid != pid) {
-            ++it;
-        }else {
-            it1 = it;
-            ++it1;
+ModuleTransitionState::~ModuleTransitionState()
+{
+}
 
-            if (m_CachedModule == *it) {
-                m_CachedModule = NULL;
-            }
+ModuleTransitionState* ModuleTransitionState::clone() const
+{
+    ModuleTransitionState *ret = new ModuleTransitionState();
 
-            if (m_PreviousModule == *it) {
-                m_PreviousModule = NULL;
-            }
+    //The tables and the descriptors are shared until one of the states
+    //loads or unloads a module.
+    ret->m_Descriptors = m_Descriptors;
+    ret->m_NotTrackedDescriptors = m_NotTrackedDescriptors;
+    ret->m_PreviousModule = m_PreviousModule;
 
-            const ModuleDescriptor *md = *it;
-            m_Descriptors.erase(*it);
-            delete md;
+    return ret;
+}
 
-            it = it1;
-        }
+PluginState* ModuleTransitionState::factory(Plugin *p, S2EExecutionState *state)
+{
+    ModuleTransitionState *s = new ModuleTransitionState();
+
+    p->s2e()->getDebugStream() << "Creating initial module transition state" << std::endl;
+
+    return s;
+}
+
+const ModuleDescriptor *ModuleTransitionState::getDescriptor(uint64_t pid, uint64_t pc, bool tracked) const
+{
+    const ModuleDescriptor *md = m_Descriptors.find(pid, pc);
+    if (md) {
+        return md;
     }
 
-    //XXX: avoid copy/paste
-    for (it = m_NotTrackedDescriptors.begin(); it != m_NotTrackedDescriptors.end(); ) {
-        if ((*it)->Pid != pid) {
-            ++it;
-        }else {
-            it1 = it;
-            ++it1;
+    if (!tracked) {
+        return m_NotTrackedDescriptors.find(pid, pc);
+    }
 
-            if (m_CachedModule == *it) {
-                m_CachedModule = NULL;
-            }
+    return NULL;
+}
 
-            if (m_PreviousModule == *it) {
-                m_PreviousModule = NULL;
-            }
+bool ModuleTransitionState::loadDescriptor(const ModuleDescriptor &desc, bool track)
+{
+    if (track) {
+        m_Descriptors.insert(desc);
+        return true;
+    }
 
-            const ModuleDescriptor *md = *it;
-            m_NotTrackedDescriptors.erase(*it);
-            delete md;
+    return m_NotTrackedDescriptors.insert(desc);
+}
 
-            it = it1;
+void ModuleTransitionState::unloadDescriptor(const ModuleDescriptor &desc)
+{
+    const ModuleDescriptor *md = m_Descriptors.findOverlapping(desc);
+    if (md) {
+        if (m_PreviousModule == md) {
+            m_PreviousModule = NULL;
         }
+        m_Descriptors.erase(md);
+    }
+
+    md = m_NotTrackedDescriptors.findOverlapping(desc);
+    if (md) {
+        assert(md != m_PreviousModule);
+        m_NotTrackedDescriptors.erase(md);
+    }
+}
+
+void ModuleTransitionState::unloadDescriptorsWithPid(uint64_t pid)
+{
+    if (m_PreviousModule && m_PreviousModule->Pid == pid) {
+        m_PreviousModule = NULL;
     }
+
+    m_Descriptors.eraseWithPid(pid);
+    m_NotTrackedDescriptors.eraseWithPid(pid);
 }
 
 bool ModuleTransitionState::exists(const ModuleDescriptor *desc, bool tracked) const
 {
-    bool ret;
-    ret = m_Descriptors.find(desc) != m_Descriptors.end();
-    if (ret) {
-        return ret;
+    if (m_Descriptors.findOverlapping(*desc)) {
+        return true;
     }
 
     if (tracked) {
         return false;
     }
 
-    return m_NotTrackedDescriptors.find(desc) != m_NotTrackedDescriptors.end();
+    return m_NotTrackedDescriptors.findOverlapping(*desc) != NULL;
 }
+
+} // namespace plugins
+} // namespace s2e
@@ -212,16 +212,78 @@ public:
 };
 
 
-class ModuleTransitionState:public PluginState
+/**
+ *  Module descriptors sorted by pid and load base, in a flat array.
+ *  Copies share the array and the descriptors until one of them
+ *  is modified. Descriptors keep their address as long as they are
+ *  loaded, even after the array has been copied.
+ */
+class ModuleDescriptorTable
 {
 private:
-    typedef std::set<const ModuleDescriptor*, ModuleDescriptor::ModuleByLoadBase> DescriptorSet;
+    struct Entry {
+        unsigned refCount;
+        ModuleDescriptor desc;
+    };
+
+    struct Table {
+        unsigned refCount;
+        std::vector<Entry*> entries;
+    };
+
+    Table *m_table;
+
+    /* Last descriptor returned by find() */
+    mutable const Entry *m_lastHit;
+
+    static void release(Table *table);
+    void unshare();
+
+    /* Index of the first entry that starts after (pid, address) */
+    unsigned upperBound(uint64_t pid, uint64_t address) const;
+
+public:
+    ModuleDescriptorTable();
+    ModuleDescriptorTable(const ModuleDescriptorTable &other);
+    ~ModuleDescriptorTable();
+    ModuleDescriptorTable &operator=(const ModuleDescriptorTable &other);
+
+    /** Returns the module of pid that contains pc */
+    inline const ModuleDescriptor *find(uint64_t pid, uint64_t pc) const {
+        const Entry *e = m_lastHit;
+        if (e && e->desc.Pid == pid &&
+                pc >= e->desc.LoadBase && pc < e->desc.LoadBase + e->desc.Size) {
+            return &e->desc;
+        }
+        return lookup(pid, pc);
+    }
 
+    const ModuleDescriptor *lookup(uint64_t pid, uint64_t pc) const;
+
+    /** Returns a module of desc.Pid that overlaps desc */
+    const ModuleDescriptor *findOverlapping(const ModuleDescriptor &desc) const;
+
+    /** Fails if the new module overlaps an existing one */
+    bool insert(const ModuleDescriptor &desc);
+    void erase(const ModuleDescriptor *desc);
+    void eraseWithPid(uint64_t pid);
+
+    unsigned size() const {
+        return m_table->entries.size();
+    }
+
+    const ModuleDescriptor &operator[](unsigned i) const {
+        return m_table->entries[i]->desc;
+    }
+};
+
+class ModuleTransitionState:public PluginState
+{
+private:
     const ModuleDescriptor *m_PreviousModule;
-    mutable const ModuleDescriptor *m_CachedModule;
 
-    DescriptorSet m_Descriptors;
-    DescriptorSet m_NotTrackedDescriptors;
+    ModuleDescriptorTable m_Descriptors;
+    ModuleDescriptorTable m_NotTrackedDescriptors;
 
     const ModuleDescriptor *getDescriptor(uint64_t pid, uint64_t pc, bool tracked=true) const;
     bool loadDescriptor(const ModuleDescriptor &desc, bool track);
@@ -93,6 +93,8 @@ void CooperativeSearcher::initializeSearcher()
 
 klee::ExecutionState& CooperativeSearcher::selectState()
 {
+    processScheduleRequests();
+
     if (m_currentState) {
         return *m_currentState;
     }
@@ -133,6 +135,40 @@ bool CooperativeSearcher::empty()
     return m_states.empty();
 }
 
+//Handle the ScheduleNext requests that other processes
+//could not satisfy themselves
+void CooperativeSearcher::processScheduleRequests()
+{
+    SharedQueue<uint32_t, 16> &queue =
+            m_shared.get()->scheduleRequests[s2e()->getCurrentProcessId()];
+
+    uint32_t stateId;
+    while (queue.pop(stateId)) {
+        States::iterator it = m_states.find(stateId);
+        if (it != m_states.end()) {
+            s2e()->getMessagesStream() <<
+                    "CooperativeSearcher picked the state " << stateId <<
+                    " on behalf of another process" << std::endl;
+            m_currentState = (*it).second;
+        }
+    }
+}
+
+//The state may be owned by another process, ask all of them
+void CooperativeSearcher::postScheduleRequest(uint32_t stateId)
+{
+    unsigned current = s2e()->getCurrentProcessId();
+    for (unsigned i = 0; i < s2e()->getMaxProcesses(); ++i) {
+        if (i == current || s2e()->getProcessIndexForId(i) == (unsigned) -1) {
+            continue;
+        }
+        if (!m_shared.get()->scheduleRequests[i].push(stateId)) {
+            s2e()->getWarningsStream() << "CooperativeSearcher: request queue of process "
+                    << i << " is full" << std::endl;
+        }
+    }
+}
+
 void CooperativeSearcher::onCustomInstruction(S2EExecutionState* state, uint64_t opcode)
 {
     //XXX: find a better way of allocating custom opcodes
@@ -164,9 +200,14 @@ void CooperativeSearcher::onCustomInstruction(S2EExecutionState* state, uint64_t
 
             States::iterator it = m_states.find(nextState);
             if (it == m_states.end()) {
-                s2e()->getWarningsStream(state)
-                    << "ERROR: Invalid state passed to " <<
-                    "CooperativeSearcher ScheduleNext: " << std::dec << nextState << std::endl;
+                if (s2e()->getCurrentProcessCount() > 1) {
+                    postScheduleRequest(nextState);
+                } else {
+                    s2e()->getWarningsStream(state)
+                        << "ERROR: Invalid state passed to " <<
+                        "CooperativeSearcher ScheduleNext: " << std::dec << nextState << std::endl;
+                }
+                break;
             }
 
             m_currentState = (*it).second;
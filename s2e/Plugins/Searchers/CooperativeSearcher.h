@@ -37,7 +37,9 @@
 #ifndef S2E_PLUGINS_COOPSEARCHER_H
 #define S2E_PLUGINS_COOPSEARCHER_H
 
+#include <s2e/s2e_config.h>
 #include <s2e/Plugin.h>
+#include <s2e/Synchronization.h>
 #include <s2e/Plugins/CorePlugin.h>
 #include <s2e/Plugins/ModuleExecutionDetector.h>
 #include <s2e/S2EExecutionState.h>
@@ -51,6 +53,10 @@ namespace plugins {
 
 #define COOPSEARCHER_OPCODE 0xAB
 
+//Lets a process ask the other ones to schedule a state it does not own
+struct CooperativeSearcherShared {
+    SharedQueue<uint32_t, 16> scheduleRequests[S2E_MAX_PROCESSES];
+};
 
 class CooperativeSearcher : public Plugin, public klee::Searcher
 {
@@ -83,7 +89,11 @@ private:
     States m_states;
     S2EExecutionState *m_currentState;
 
+    S2ESharedObject<CooperativeSearcherShared> m_shared;
+
     void initializeSearcher();
+    void processScheduleRequests();
+    void postScheduleRequest(uint32_t stateId);
 
     void onCustomInstruction(S2EExecutionState* state, uint64_t opcode);
 };
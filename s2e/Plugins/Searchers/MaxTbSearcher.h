@@ -81,11 +81,12 @@ public:
         }
 
         bool operator()(const S2EExecutionState *s1, const S2EExecutionState *s2) const{
-            const MaxTbSearcherState *p1 = static_cast<MaxTbSearcherState*>(p->getPluginState(const_cast<S2EExecutionState*>(s1), &MaxTbSearcherState::factory));
-            const MaxTbSearcherState *p2 = static_cast<MaxTbSearcherState*>(p->getPluginState(const_cast<S2EExecutionState*>(s2), &MaxTbSearcherState::factory));
+            const MaxTbSearcherState *p1 = static_cast<const MaxTbSearcherState*>(p->getPluginStateConst(const_cast<S2EExecutionState*>(s1), &MaxTbSearcherState::factory));
+            const MaxTbSearcherState *p2 = static_cast<const MaxTbSearcherState*>(p->getPluginStateConst(const_cast<S2EExecutionState*>(s2), &MaxTbSearcherState::factory));
 
+            //Forked states may share the same plugin state object
             if (p1->m_metric == p2->m_metric) {
-                return p1 < p2;
+                return s1 < s2;
             }
             return p1->m_metric < p2->m_metric;
         }
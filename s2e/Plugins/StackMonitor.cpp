@@ -418,7 +418,7 @@ void StackMonitor::onModuleTransition(S2EExecutionState* state, const ModuleDesc
 
 bool StackMonitor::getFrameInfo(S2EExecutionState *state, uint64_t sp, bool &onTheStack, StackFrameInfo &info) const
 {
-    DECLARE_PLUGINSTATE(StackMonitorState, state);
+    DECLARE_PLUGINSTATE_CONST(StackMonitorState, state);
     return plgState->getFrameInfo(state, sp, onTheStack, info);
 }
 
@@ -46,6 +46,7 @@
 #include <s2e/S2EExecutor.h>
 #include <s2e/S2EExecutionState.h>
 #include <s2e/Database.h>
+#include <s2e/Slab.h>
 
 #include <s2e/s2e_qemu.h>
 
@@ -174,6 +175,19 @@ void print_stacktrace(void)
 }
 #endif //CONFIG_WIN32
 
+namespace {
+    llvm::cl::opt<bool>
+    UseSlabAllocator("use-slab-allocator",
+            llvm::cl::desc("Allocate small objects (e.g., the object states"
+                           " copied when cloning states) from the S2E slab allocator"),
+            llvm::cl::init(false));
+
+    llvm::cl::opt<bool>
+    SlabHugePages("slab-huge-pages",
+            llvm::cl::desc("Ask the OS to back the slab allocator arenas with huge pages"),
+            llvm::cl::init(false));
+}
+
 namespace s2e {
 
 using namespace std;
@@ -302,8 +316,10 @@ S2E::S2E(int argc, char** argv, TCGLLVMContext *tcgLLVMContext,
     initPlugins();
 
     /* Init the custom memory allocator */
-    //void slab_init();
-    //slab_init();
+    if (UseSlabAllocator && !slab_init(SlabHugePages)) {
+        getWarningsStream() << "The slab allocator failed its self test,"
+                " using the system allocator" << std::endl;
+    }
 }
 
 void S2E::writeBitCodeToFile()
@@ -323,6 +339,10 @@ void S2E::writeBitCodeToFile()
 
 S2E::~S2E()
 {
+    if (UseSlabAllocator) {
+        slab_print_stats(getMessagesStream());
+    }
+
     //Delete all the stuff used by the instance
     foreach(Plugin* p, m_activePluginsList)
         delete p;
@@ -333,6 +353,7 @@ S2E::~S2E()
     assert(shared->processIds[m_currentProcessId] == m_currentProcessIndex);
     shared->processIds[m_currentProcessId] = (unsigned) -1;
     shared->processPids[m_currentProcessId] = (unsigned) -1;
+    shared->stateCounts.set(m_currentProcessId, 0);
     --shared->currentProcessCount;
 
     m_sync.release();
@@ -654,13 +675,6 @@ void S2E::printf(std::ostream &os, const char *fmt, ...)
     os << str;
 }
 
-void S2E::refreshPlugins()
-{
-    foreach2(it, m_activePluginsList.begin(), m_activePluginsList.end()) {
-        (*it)->refresh();
-    }
-}
-
 int S2E::fork()
 {
 #ifdef CONFIG_WIN32
@@ -727,28 +741,20 @@ int S2E::fork()
 
 unsigned S2E::fetchAndIncrementStateId()
 {
-    S2EShared *shared = m_sync.acquire();
-    unsigned ret = shared->lastStateId;
-    ++shared->lastStateId;
-    m_sync.release();
-    return ret;
+    S2EShared *shared = m_sync.get();
+    return __sync_fetch_and_add(&shared->lastStateId, 1);
 }
 
+//The count is only modified under the lock, a plain read is enough
 unsigned S2E::getCurrentProcessCount()
 {
-    S2EShared *shared = m_sync.acquire();
-    unsigned ret = shared->currentProcessCount;
-    m_sync.release();
-    return ret;
+    return *(volatile unsigned*)&m_sync.get()->currentProcessCount;
 }
 
 unsigned S2E::getProcessIndexForId(unsigned id)
 {
     assert(id < m_maxProcesses);
-    S2EShared *shared = m_sync.acquire();
-    unsigned ret = shared->processIds[id];
-    m_sync.release();
-    return ret;
+    return *(volatile unsigned*)&m_sync.get()->processIds[id];
 }
 
 bool S2E::checkDeadProcesses()
@@ -768,6 +774,7 @@ bool S2E::checkDeadProcesses()
             //Process is dead, we have to decrement everyting
             shared->processIds[i] = (unsigned) -1;
             shared->processPids[i] = (unsigned) -1;
+            shared->stateCounts.set(i, 0);
             --shared->currentProcessCount;
             ret = true;
         }
@@ -777,6 +784,37 @@ bool S2E::checkDeadProcesses()
     return ret;
 }
 
+//Called by a process that has nothing left to explore.
+//The first busy process to notice it will fork and give half of
+//its states to the child.
+void S2E::requestWork()
+{
+    __sync_fetch_and_add(&m_sync.get()->workRequests, 1);
+}
+
+bool S2E::takeWorkRequest()
+{
+    S2EShared *shared = m_sync.get();
+    unsigned requests;
+    do {
+        requests = *(volatile unsigned*)&shared->workRequests;
+        if (requests == 0) {
+            return false;
+        }
+    } while (!__sync_bool_compare_and_swap(&shared->workRequests, requests, requests - 1));
+    return true;
+}
+
+void S2E::setCurrentProcessStateCount(unsigned count)
+{
+    m_sync.get()->stateCounts.set(m_currentProcessId, count);
+}
+
+uint64_t S2E::getTotalStateCount() const
+{
+    return m_sync.get()->stateCounts.sum();
+}
+
 } // namespace s2e
 
 /******************************/
@@ -67,13 +67,16 @@ class S2EExecutionState;
 
 class Database;
 
-//Structure used for synchronization among multiple instances of S2E
+//Structure used for synchronization among multiple instances of S2E.
+//Fields marked lock-free are accessed with atomic operations only,
+//the other ones require holding the lock.
 struct S2EShared {
     unsigned currentProcessCount;
     unsigned lastFileId;
     //We must have unique state ids across all processes
     //otherwise offline tools will be extremely confused when
     //aggregating different execution trace files.
+    //Lock-free.
     unsigned lastStateId;
 
     //Array of currently running instances.
@@ -81,7 +84,16 @@ struct S2EShared {
     //the instance index.
     unsigned processIds[S2E_MAX_PROCESSES];
     unsigned processPids[S2E_MAX_PROCESSES];
+
+    //Number of processes that ran out of states and asked
+    //busy processes to hand over part of their work. Lock-free.
+    unsigned workRequests;
+
+    //Number of states of each process, indexed by process id. Lock-free.
+    PerProcessCounter<S2E_MAX_PROCESSES> stateCounts;
+
     S2EShared() {
+        workRequests = 0;
         for (unsigned i=0; i<S2E_MAX_PROCESSES; ++i)    {
             processIds[i] = (unsigned)-1;
             processPids[i] = (unsigned)-1;
@@ -163,6 +175,9 @@ public:
     /** Get Core plugin */
     inline CorePlugin* getCorePlugin() const { return m_corePlugin; }
 
+    /** Get plugins factory */
+    PluginsFactory* getPluginsFactory() const { return m_pluginsFactory; }
+
     /** Get database */
     Database *getDb() const {
         return m_database;
@@ -206,10 +221,6 @@ public:
     /* Runtime information */
     S2EExecutor* getExecutor() { return m_s2eExecutor; }
 
-    //XXX: A plugin can hold cached state information. When a state is deleted,
-    //remove all the cached info from all plugins.
-    void refreshPlugins();
-
     void writeBitCodeToFile();
 
     int fork();
@@ -230,6 +241,13 @@ public:
     unsigned getCurrentProcessCount();
 
     bool checkDeadProcesses();
+
+    /* Work stealing between processes */
+    void requestWork();
+    bool takeWorkRequest();
+
+    void setCurrentProcessStateCount(unsigned count);
+    uint64_t getTotalStateCount() const;
 };
 
 } // namespace s2e
@@ -75,6 +75,15 @@ S2EDeviceState *S2EDeviceState::s_CurrentState = NULL;
 std::vector<void *> S2EDeviceState::s_Devices;
 bool S2EDeviceState::s_DevicesInited=false;
 
+S2EDeviceState::DeviceBlobs S2EDeviceState::s_LiveBlobs;
+bool S2EDeviceState::s_LiveBlobsValid = false;
+uint64_t S2EDeviceState::s_LastVersion = 0;
+
+unsigned char *S2EDeviceState::s_Buffer = NULL;
+unsigned int S2EDeviceState::s_BufferSize = 0;
+unsigned int S2EDeviceState::s_Offset = 0;
+const S2EDeviceState::DeviceBlob *S2EDeviceState::s_ReadBlob = NULL;
+
 
 
 #define REGISTER_DEVICE(dev) { if (!strcmp(s2e_qemu_get_se_idstr(se), dev)) { s_Devices.push_back(se); }}
@@ -87,54 +96,135 @@ S2EDeviceState::S2EDeviceState(const S2EDeviceState &)
 //This is assumed to be called on fork.
 //At that time, we need to save the state of the VM to 
 //be later restored.
+//Both copies share the device snapshots of the parent. The blobs
+//are immutable, a new one is created when a device changes.
 //XXX: use reference counting to delete the device states
 void S2EDeviceState::clone(S2EDeviceState **state1, S2EDeviceState **state2)
 {
     //We must make two copies
 
     S2EDeviceState* copy1 = new S2EDeviceState();
-    copy1->m_Parent = this;
-    copy1->m_State = 0;
-    copy1->m_StateSize = 0;
     copy1->m_canTransferSector = m_canTransferSector;
+    copy1->m_Blobs.resize(m_Blobs.size(), NULL);
+    for (unsigned i = 0; i < m_Blobs.size(); ++i) {
+        setBlob(copy1->m_Blobs[i], m_Blobs[i]);
+    }
+    cloneDiskState(copy1);
     *state1 = copy1;
 
     S2EDeviceState* copy2 = new S2EDeviceState();
-    copy2->m_Parent = this;
-    copy2->m_State = 0;
-    copy2->m_StateSize = 0;
     copy2->m_canTransferSector = m_canTransferSector;
+    copy2->m_Blobs.resize(m_Blobs.size(), NULL);
+    for (unsigned i = 0; i < m_Blobs.size(); ++i) {
+        setBlob(copy2->m_Blobs[i], m_Blobs[i]);
+    }
+    cloneDiskState(copy2);
     *state2 = copy2;
+
+    //The parent is not used anymore after a fork, drop its references
+    //so that the first write of each copy does not always have to copy.
+    foreach2(it, m_BlockDevices.begin(), m_BlockDevices.end()) {
+        releaseOverlay((*it).second);
+    }
+    m_BlockDevices.clear();
 }
 
-void S2EDeviceState::cloneDiskState()
+//The copy shares the sector overlays of this state until it writes
+void S2EDeviceState::cloneDiskState(S2EDeviceState *to)
 {
     foreach2(it, m_BlockDevices.begin(), m_BlockDevices.end()) {
-        SectorMap &sm = (*it).second;
-        foreach2(smit, sm.begin(), sm.end()) {
-            uint8_t *newSector = new uint8_t[512];
-            memcpy(newSector, (*smit).second, 512);
-            (*smit).second = newSector;
+        SectorOverlay *overlay = (*it).second;
+        ++overlay->refCount;
+        to->m_BlockDevices[(*it).first] = overlay;
+    }
+}
+
+void S2EDeviceState::releaseOverlay(SectorOverlay *overlay)
+{
+    assert(overlay->refCount > 0);
+    if (--overlay->refCount > 0) {
+        return;
+    }
+
+    foreach2(it, overlay->sectors.begin(), overlay->sectors.end()) {
+        Sector *sector = (*it).second;
+        if (--sector->refCount == 0) {
+            delete sector;
+        }
+    }
+    delete overlay;
+}
+
+//Returns the sector map of the device, unsharing it if needed.
+//Sectors themselves are shared and only copied when overwritten.
+S2EDeviceState::SectorMap &S2EDeviceState::getWritableSectors(BlockDriverState *bs)
+{
+    SectorOverlay *&overlay = m_BlockDevices[bs];
+    if (!overlay) {
+        overlay = new SectorOverlay();
+        overlay->refCount = 1;
+    } else if (overlay->refCount > 1) {
+        SectorOverlay *copy = new SectorOverlay();
+        copy->refCount = 1;
+        copy->sectors = overlay->sectors;
+        foreach2(it, copy->sectors.begin(), copy->sectors.end()) {
+            ++(*it).second->refCount;
         }
+        --overlay->refCount;
+        overlay = copy;
     }
+    return overlay->sectors;
 }
 
 S2EDeviceState::S2EDeviceState()
 {
-    m_Parent = NULL;
     m_canTransferSector = true;
 }
 
 S2EDeviceState::~S2EDeviceState()
 {
-    /* TODO */
+    foreach2(it, m_Blobs.begin(), m_Blobs.end()) {
+        setBlob(*it, NULL);
+    }
+
+    foreach2(it, m_BlockDevices.begin(), m_BlockDevices.end()) {
+        releaseOverlay((*it).second);
+    }
+}
+
+S2EDeviceState::DeviceBlob *S2EDeviceState::createBlob(const uint8_t *data, unsigned int size)
+{
+    DeviceBlob *blob = new DeviceBlob();
+    blob->data = size ? new uint8_t[size] : NULL;
+    blob->size = size;
+    blob->version = ++s_LastVersion;
+    blob->refCount = 0;
+    if (size) {
+        memcpy(blob->data, data, size);
+    }
+    return blob;
+}
+
+//Makes slot point to blob, releasing the blob previously stored there
+void S2EDeviceState::setBlob(DeviceBlob *&slot, DeviceBlob *blob)
+{
+    if (blob) {
+        ++blob->refCount;
+    }
+
+    if (slot) {
+        assert(slot->refCount > 0);
+        if (--slot->refCount == 0) {
+            delete [] slot->data;
+            delete slot;
+        }
+    }
+
+    slot = blob;
 }
 
 void S2EDeviceState::initDeviceState()
 {
-    m_State = NULL;
-    m_StateSize = 0;
-    
     assert(!s_DevicesInited);
 
     std::set<std::string> ignoreList;
@@ -188,58 +278,102 @@ void S2EDeviceState::initDeviceState()
 
 int s2edev_dbg=0;
 
+/**
+ *  Each device is serialized on its own and compared with what the
+ *  device held after the last snapshot or restore. Devices that did not
+ *  change keep sharing the existing blob, so idle devices cost neither
+ *  memory nor copies across forks.
+ */
 void S2EDeviceState::saveDeviceState()
 {
     s2e_dev_snapshot_enable = 1;
     vm_stop(0);
-    m_Offset = 0;
     assert(s_CurrentState == NULL);
     s_CurrentState = this;
 
+    m_Blobs.resize(s_Devices.size(), NULL);
+    s_LiveBlobs.resize(s_Devices.size(), NULL);
+
     //DPRINTF("Saving device state %p\n", this);
     /* Iterate through all device descritors and call
     * their snapshot function */
-    for (vector<void*>::iterator it = s_Devices.begin(); it != s_Devices.end(); it++) {
-        //unsigned o = m_Offset;
-        void *se = *it;
+    for (unsigned i = 0; i < s_Devices.size(); ++i) {
+        void *se = s_Devices[i];
+        s_Offset = 0;
         //DPRINTF("%s ", s2e_qemu_get_se_idstr(se));
         s2e_qemu_save_state(se);
-        //DPRINTF("sz=%d - ", m_Offset - o);
+        //DPRINTF("sz=%d - ", s_Offset);
+
+        DeviceBlob *live = s_LiveBlobs[i];
+        if (!live || live->size != s_Offset ||
+            (s_Offset && memcmp(live->data, s_Buffer, s_Offset))) {
+            live = createBlob(s_Buffer, s_Offset);
+            setBlob(s_LiveBlobs[i], live);
+        }
+
+        setBlob(m_Blobs[i], live);
     }
     //DPRINTF("\n");
 
-    ShrinkBuffer();
+    /* The executor always saves the outgoing state before restoring
+       another one, so the live table is accurate for the next restore. */
+    s_LiveBlobsValid = true;
+
     s2e_dev_snapshot_enable = 0;
     s_CurrentState = NULL;
     vm_start();
 }
 
+/**
+ *  Only the devices whose snapshot differs from what QEMU currently holds
+ *  are reloaded. The VM is not stopped at all when every device is
+ *  already up to date (e.g., switching between siblings that did not
+ *  touch any device since the fork).
+ */
 void S2EDeviceState::restoreDeviceState()
 {
     assert(s_CurrentState == NULL);
-//    assert(m_StateSize);
-//    assert(m_State);
 
-    s_CurrentState = this;
+    s_LiveBlobs.resize(s_Devices.size(), NULL);
 
-    vm_stop(0);
-    s2e_dev_snapshot_enable = 1;
+    std::vector<unsigned> toLoad;
+    for (unsigned i = 0; i < m_Blobs.size(); ++i) {
+        const DeviceBlob *live = s_LiveBlobs[i];
+        if (!m_Blobs[i]) {
+            continue;
+        }
+        if (s_LiveBlobsValid && live && live->version == m_Blobs[i]->version) {
+            continue;
+        }
+        toLoad.push_back(i);
+    }
 
-    m_Offset = 0;
+    if (!toLoad.empty()) {
+        s_CurrentState = this;
 
-    //DPRINTF("Restoring device state %p\n", this);
-    for (vector<void*>::iterator it = s_Devices.begin(); it != s_Devices.end(); it++) {
-        //unsigned o = m_Offset;
-        void *se = *it;
-        //DPRINTF("%s ", s2e_qemu_get_se_idstr(se));  
-        s2e_qemu_load_state(se);
-        //DPRINTF("sz=%d - ", m_Offset - o);
+        vm_stop(0);
+        s2e_dev_snapshot_enable = 1;
+
+        //DPRINTF("Restoring device state %p\n", this);
+        foreach2(it, toLoad.begin(), toLoad.end()) {
+            void *se = s_Devices[*it];
+            s_ReadBlob = m_Blobs[*it];
+            s_Offset = 0;
+            //DPRINTF("%s ", s2e_qemu_get_se_idstr(se));
+            s2e_qemu_load_state(se);
+            setBlob(s_LiveBlobs[*it], m_Blobs[*it]);
+        }
+        //DPRINTF("\n");
+
+        s_ReadBlob = NULL;
+        s2e_dev_snapshot_enable = 0;
+        s_CurrentState = NULL;
+        vm_start();
     }
-    //DPRINTF("\n");
 
-    s2e_dev_snapshot_enable = 0;
-    s_CurrentState = NULL;
-    vm_start();
+    /* The guest will run from now on, the live table only remains a
+       reference for detecting unchanged devices in the next save. */
+    s_LiveBlobsValid = false;
 }
 
 
@@ -254,68 +388,49 @@ bool S2EDeviceState::canTransferSector() const
 
 void S2EDeviceState::AllocateBuffer(unsigned int Sz)
 {
-    if (!m_State) {
-        unsigned int NewSize = Sz < 256 ? 256 : Sz;
-        m_State = (unsigned char *)malloc(NewSize);
-        if (!m_State) {
-            cerr << "Cannot allocate memory for device state snapshot" << endl;
-            exit(-1);
-        }
-        m_StateSize = NewSize;
-        m_Offset = 0;
+    if (s_Offset + Sz <= s_BufferSize) {
         return;
     }
 
-    if (m_Offset + Sz >= m_StateSize) {
-        /* Need to expand the buffer */
-        unsigned int NewSize = Sz < 256 ? 256 : Sz;
-        m_StateSize += NewSize;
-        m_State = (unsigned char*)realloc(m_State, m_StateSize);
-        if (!m_State) {
-            cerr << "Cannot reallocate memory for device state snapshot" << endl;
-            exit(-1);
-        }
-        return;
+    /* The scratch buffer is shared by all states and never shrinks */
+    unsigned int NewSize = s_BufferSize ? s_BufferSize : s_PreferedStateSize;
+    while (NewSize < s_Offset + Sz) {
+        NewSize *= 2;
     }
-}
 
-void S2EDeviceState::ShrinkBuffer()
-{
-    if (m_Offset != m_StateSize) {
-        unsigned char *NewBuf = (unsigned char*)realloc(m_State, m_Offset);
-        if (!NewBuf) {
-            cerr << "Cannot shrink device state snapshot" << endl;
-            return;
-        }
-        m_State = NewBuf;
-        m_StateSize = m_Offset;
+    unsigned char *NewBuf = (unsigned char*)realloc(s_Buffer, NewSize);
+    if (!NewBuf) {
+        cerr << "Cannot allocate memory for device state snapshot" << endl;
+        exit(-1);
     }
+    s_Buffer = NewBuf;
+    s_BufferSize = NewSize;
 }
 
 void S2EDeviceState::PutByte(int v)
 {
     AllocateBuffer(1);
-    m_State[m_Offset++] = v;
+    s_Buffer[s_Offset++] = v;
 }
 
 void S2EDeviceState::PutBuffer(const uint8_t *buf, int size1)
 {
     AllocateBuffer(size1);
-    memcpy(&m_State[m_Offset], buf, size1);
-    m_Offset += size1;
+    memcpy(&s_Buffer[s_Offset], buf, size1);
+    s_Offset += size1;
 }
 
 int S2EDeviceState::GetByte()
 {
-    assert(m_Offset + 1 <= m_StateSize);
-    return m_State[m_Offset++];
+    assert(s_ReadBlob && s_Offset + 1 <= s_ReadBlob->size);
+    return s_ReadBlob->data[s_Offset++];
 }
 
 int S2EDeviceState::GetBuffer(uint8_t *buf, int size1)
 {
-    assert(m_Offset + size1 <= m_StateSize);
-    memcpy(buf, &m_State[m_Offset], size1);
-    m_Offset += size1;
+    assert(s_ReadBlob && s_Offset + size1 <= s_ReadBlob->size);
+    memcpy(buf, &s_ReadBlob->data[s_Offset], size1);
+    s_Offset += size1;
     return size1;
 }
 
@@ -325,20 +440,21 @@ int S2EDeviceState::GetBuffer(uint8_t *buf, int size1)
 
 int S2EDeviceState::writeSector(struct BlockDriverState *bs, int64_t sector, const uint8_t *buf, int nb_sectors)
 {
-    SectorMap &dev = m_BlockDevices[bs];
+    SectorMap &dev = getWritableSectors(bs);
  //   DPRINTF("writeSector %#"PRIx64" count=%d\n", sector, nb_sectors);
     for (int64_t i = sector; i<sector+nb_sectors; i++) {
-        SectorMap::iterator it = dev.find(i);
-        uint8_t *secbuf;
-        
-        if (it == dev.end()) {
-            secbuf = new uint8_t[512];
-            dev[i] = secbuf;            
-        }else {
-            secbuf = (*it).second;
+        Sector *&secbuf = dev[i];
+
+        //Sectors shared with other states are copied on write
+        if (!secbuf || secbuf->refCount > 1) {
+            if (secbuf) {
+                --secbuf->refCount;
+            }
+            secbuf = new Sector();
+            secbuf->refCount = 1;
         }
 
-        memcpy(secbuf, buf, 512);
+        memcpy(secbuf->data, buf, 512);
         buf+=512;
     }
     return 0;
@@ -348,31 +464,40 @@ int S2EDeviceState::writeSector(struct BlockDriverState *bs, int64_t sector, con
 int S2EDeviceState::readSector(struct BlockDriverState *bs, int64_t sector, uint8_t *buf, int nb_sectors,
                                s2e_raw_read fb)
 {
-    bool hasRead = false;
   //  DPRINTF("readSector %#"PRIx64" count=%d\n", sector, nb_sectors);
-    for (int64_t i = sector; i<sector+nb_sectors; i++) {
-        for (S2EDeviceState *curState = this; curState; curState = curState->m_Parent) {
-            SectorMap &dev = curState->m_BlockDevices[bs];
-            SectorMap::iterator it = dev.find(i);
-            
-            if (it != dev.end()) {
-                memcpy(buf, (*it).second, 512);
+    BlockDeviceToSectorMap::const_iterator devit = m_BlockDevices.find(bs);
+    const SectorMap *dev = devit == m_BlockDevices.end() ? NULL : &(*devit).second->sectors;
+
+    int64_t end = sector + nb_sectors;
+    int64_t i = sector;
+    while (i < end) {
+        //Copy the run of sectors that were written by this state
+        if (dev) {
+            SectorMap::const_iterator it;
+            while (i < end && (it = dev->find(i)) != dev->end()) {
+                memcpy(buf, (*it).second->data, 512);
                 buf+=512;
-                hasRead = true;
-                break;
+                ++i;
             }
         }
-        //Did not find any written sector, read from the original disk
-        if (!hasRead) {
-            m_canTransferSector = false;
-            int ret = fb(bs, i, buf, 1);
-            m_canTransferSector = true;
-            if(ret < 0) {
-                return ret;
-            }
-            buf+=512;
-            hasRead = false;
+
+        if (i == end) {
+            break;
+        }
+
+        //Read the run of sectors that were never written from the original disk
+        int64_t first = i++;
+        while (i < end && (!dev || !dev->count(i))) {
+            ++i;
+        }
+
+        m_canTransferSector = false;
+        int ret = fb(bs, first, buf, i - first);
+        m_canTransferSector = true;
+        if(ret < 0) {
+            return ret;
         }
+        buf += 512 * (i - first);
     }
     return 0;
 }
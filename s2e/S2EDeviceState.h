@@ -41,6 +41,7 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <tr1/unordered_map>
 #include <stdint.h>
 
 #include "s2e_block.h"
@@ -51,30 +52,70 @@ class S2EExecutionState;
 
 class S2EDeviceState {
 private:
-    typedef std::map<int64_t, uint8_t *> SectorMap;
-    typedef std::map<BlockDriverState *, SectorMap> BlockDeviceToSectorMap;
+    /** Content of a written sector, shared by all overlays that map it */
+    struct Sector {
+        unsigned int refCount;
+        uint8_t data[512];
+    };
+
+    /**
+     * Flat copy-on-write overlay of all the sectors written to a block
+     * device by a state and its ancestors. Forked states share the same
+     * overlay until one of them writes to the disk.
+     */
+    typedef std::tr1::unordered_map<int64_t, Sector *> SectorMap;
+    struct SectorOverlay {
+        unsigned int refCount;
+        SectorMap sectors;
+    };
+    typedef std::map<BlockDriverState *, SectorOverlay *> BlockDeviceToSectorMap;
+
+    /**
+     * Serialized state of one device. Blobs are immutable once created
+     * and are shared by reference count between all the states (and the
+     * live device table) that hold the same device contents.
+     */
+    struct DeviceBlob {
+        uint8_t *data;
+        unsigned int size;
+        uint64_t version;
+        unsigned int refCount;
+    };
+    typedef std::vector<DeviceBlob *> DeviceBlobs;
 
     static std::vector<void *> s_Devices;
     static std::set<std::string> s_customDevices;
     static bool s_DevicesInited;
     static S2EDeviceState *s_CurrentState;
 
-    unsigned char *m_State;
-    unsigned int m_StateSize;
-    unsigned int m_Offset;
+    /* What each device currently holds in QEMU */
+    static DeviceBlobs s_LiveBlobs;
+    static bool s_LiveBlobsValid;
+    static uint64_t s_LastVersion;
 
+    /* Scratch buffer for serializing/deserializing one device */
+    static unsigned char *s_Buffer;
+    static unsigned int s_BufferSize;
+    static unsigned int s_Offset;
+    static const DeviceBlob *s_ReadBlob;
 
     static unsigned int s_PreferedStateSize;
 
-    S2EDeviceState *m_Parent;
+    /* Snapshot of each device in s_Devices, in the same order */
+    DeviceBlobs m_Blobs;
+
     BlockDeviceToSectorMap m_BlockDevices;
     bool  m_canTransferSector;
     
 
-    void AllocateBuffer(unsigned int Sz);
-    void ShrinkBuffer();
+    static void AllocateBuffer(unsigned int Sz);
+
+    static DeviceBlob *createBlob(const uint8_t *data, unsigned int size);
+    static void setBlob(DeviceBlob *&slot, DeviceBlob *blob);
 
-    void cloneDiskState();
+    void cloneDiskState(S2EDeviceState *to);
+    SectorMap &getWritableSectors(BlockDriverState *bs);
+    static void releaseOverlay(SectorOverlay *overlay);
 
     S2EDeviceState(const S2EDeviceState &);
 public:
@@ -72,6 +72,7 @@ extern struct CPUX86State *env;
 
 #include <llvm/Support/CommandLine.h>
 
+#include <algorithm>
 #include <iomanip>
 #include <sstream>
 
@@ -85,6 +86,27 @@ extern llvm::cl::opt<bool> DebugLogStateMerge;
 
 namespace {
 CPUTLBEntry s_cputlb_empty_entry = { -1, -1, -1, -1 };
+
+/* Checks the concrete mask of [offset, offset + size) with a single
+   word compare, for accesses of up to 8 bytes */
+inline bool isConcreteRange(const klee::ObjectState *os,
+                            uint64_t offset, uint64_t size)
+{
+    return size <= 8 && _s2e_check_concrete(
+                const_cast<klee::ObjectState*>(os), offset, size);
+}
+
+/* Lets the compiler emit a single load/store for the usual sizes */
+inline void copyConcrete(uint8_t *dst, const uint8_t *src, uint64_t size)
+{
+    switch (size) {
+        case 1: *dst = *src; break;
+        case 2: small_memcpy(dst, src, 2); break;
+        case 4: small_memcpy(dst, src, 4); break;
+        case 8: small_memcpy(dst, src, 8); break;
+        default: memcpy(dst, src, size); break;
+    }
+}
 }
 
 extern llvm::cl::opt<bool> PrintModeSwitch;
@@ -104,8 +126,9 @@ S2EExecutionState::S2EExecutionState(klee::KFunction *kf) :
         klee::ExecutionState(kf), m_stateID(g_s2e->fetchAndIncrementStateId()),
         m_symbexEnabled(true), m_startSymbexAtPC((uint64_t) -1),
         m_active(true), m_runningConcrete(true),
+        m_symbolicRegistersMask(0), m_symbolicRegistersMaskValid(false),
         m_cpuRegistersObject(NULL), m_cpuSystemObject(NULL),
-        m_qemuIcount(0), m_lastS2ETb(NULL),
+        m_tlbGeneration(0), m_qemuIcount(0), m_lastS2ETb(NULL), m_traceUnlinkCount(0),
         m_lastMergeICount((uint64_t)-1),
         m_needFinalizeTBExec(false), m_nextSymbVarId(0), m_runningExceptionEmulationCode(false)
 {
@@ -118,18 +141,17 @@ S2EExecutionState::~S2EExecutionState()
 {
     assert(m_lastS2ETb == NULL);
 
-    PluginStateMap::iterator it;
     g_s2e->getDebugStream() << "Deleting state " << std::dec <<
             m_stateID << " 0x" << std::hex << this << std::endl;
 
     //print_stacktrace();
 
-    for(it = m_PluginState.begin(); it != m_PluginState.end(); ++it) {
-        delete it->second;
+    foreach2(it, m_PluginState.begin(), m_PluginState.end()) {
+        if (*it) {
+            releasePluginState(*it);
+        }
     }
 
-    g_s2e->refreshPlugins();
-
     //XXX: This cannot be done, as device states may refer to each other
     //delete m_deviceState;
 
@@ -244,6 +266,8 @@ void S2EExecutionState::addressSpaceChange(const klee::MemoryObject *mo,
         //is left with stale references to memory objects. We patch these
         //objects here.
         m_cpuRegistersObject = newState;
+        //The new object may have different symbolic bytes
+        invalidateSymbolicRegistersMask();
     } else if (mo == m_cpuSystemState) {
         m_cpuSystemObject = newState;
     } else {
@@ -255,6 +279,47 @@ void S2EExecutionState::addressSpaceChange(const klee::MemoryObject *mo,
     }
 }
 
+void S2EExecutionState::releasePluginState(PluginState *state)
+{
+    assert(state->m_shareCount > 0);
+    if (--state->m_shareCount == 0) {
+        delete state;
+    }
+}
+
+void S2EExecutionState::unsharePluginState(PluginState *&state)
+{
+    PluginState *copy = state->clone();
+    assert(copy && copy->m_shareCount == 1);
+    releasePluginState(state);
+    state = copy;
+}
+
+PluginState *S2EExecutionState::createPluginState(Plugin *plugin,
+                                                  PluginStateFactory factory)
+{
+    //The factory may access the states of other plugins, which can
+    //resize the slot array. Call it before taking any reference.
+    PluginState *ret = factory(plugin, this);
+    assert(ret);
+    setPluginState(plugin, ret);
+    return ret;
+}
+
+void S2EExecutionState::setPluginState(Plugin *plugin, PluginState *state)
+{
+    assert(state);
+    unsigned slot = plugin->getPluginSlot();
+    assert(slot < g_s2e->getPluginsFactory()->getPluginSlotCount());
+    if (slot >= m_PluginState.size()) {
+        m_PluginState.resize(g_s2e->getPluginsFactory()->getPluginSlotCount(), NULL);
+    }
+    if (m_PluginState[slot]) {
+        releasePluginState(m_PluginState[slot]);
+    }
+    m_PluginState[slot] = state;
+}
+
 ExecutionState* S2EExecutionState::clone()
 {
     // When cloning, all ObjectState becomes not owned by neither of states
@@ -297,11 +362,27 @@ ExecutionState* S2EExecutionState::clone()
     ret->m_timersState = new TimersState;
     *ret->m_timersState = *m_timersState;
 
-    // Clone the plugins
-    PluginStateMap::iterator it;
-    ret->m_PluginState.clear();
-    for(it = m_PluginState.begin(); it != m_PluginState.end(); ++it) {
-        ret->m_PluginState.insert(std::make_pair((*it).first, (*it).second->clone()));
+    // Both states have the same page tables, keep the translations
+    ret->m_tlbGeneration = tlb_generation;
+
+    // Share the plugin states, they are cloned on the first write access.
+    // The copy constructor already copied the slot array.
+    // States handed out for writing may still be modified through a
+    // pointer obtained before the fork (e.g., the fork happens in a
+    // signal emitted by a plugin state method). They stay ours and the
+    // new state gets its own copy.
+    for (unsigned i = 0; i < m_PluginState.size(); ++i) {
+        PluginState *state = m_PluginState[i];
+        if (!state) {
+            continue;
+        }
+        if (state->m_writable) {
+            assert(state->m_shareCount == 1);
+            ret->m_PluginState[i] = state->clone();
+            assert(ret->m_PluginState[i]->m_shareCount == 1);
+        } else {
+            ++state->m_shareCount;
+        }
     }
 
     // This objects are not in TLB and won't cause any changes to it
@@ -359,6 +440,7 @@ void S2EExecutionState::writeCpuRegister(unsigned offset,
 
     if(!m_runningConcrete || !m_cpuRegistersObject->isConcrete(offset, width)) {
         m_cpuRegistersObject->write(offset, value);
+        updateSymbolicRegistersMask(offset, Expr::getMinBytesForWidth(width));
 
     } else {
         /* XXX: should we check getSymbolicRegisterMask ? */
@@ -625,98 +707,120 @@ uint64_t S2EExecutionState::getPid() const
 }
 
 #ifdef TARGET_ARM
-uint64_t S2EExecutionState::getSymbolicRegistersMask() const
+/* Bit i of the symbolic registers mask covers the 32-bit word i of the
+   register object: spsr, banked_spsr, banked r13, banked r14, usr_regs,
+   fiq_regs, CF, VF, NF, ZF and regs[0..14] */
+static const unsigned SymbolicRegisterWords = 48;
+
+static inline uint64_t symbolicRegisterBit(unsigned word)
 {
-    const ObjectState* os = m_cpuRegistersObject;
-    if(os->isAllConcrete())
-        return 0;
+    return (uint64_t) 1 << word;
+}
+#elif defined(TARGET_I386)
+/* XXX: x86-specific. regs[0..7] map to bits 5-12,
+   cc_op, cc_src, cc_dst and cc_tmp to bits 1-4 */
+static const unsigned SymbolicRegisterWords = 12;
 
-    uint64_t mask = 0;
+static inline uint64_t symbolicRegisterBit(unsigned word)
+{
+    return word < 8 ? (uint64_t) 1 << (word + 5) : (uint64_t) 1 << (word - 7);
+}
+#endif
 
-        if(!os->isConcrete(0, 4*8)) // spsr
-            mask |= ((uint64_t)(1) << 0);
-        for(int i = 0; i < 6; ++i) { /* banked_spsr */
-                if(!os->isConcrete((1+i)*4, 4*8))
-                    mask |= ((uint64_t)(1) << (i+1));
-        }
-        for(int i = 0; i < 6; ++i) { /* banked r13 */
-                if(!os->isConcrete((7+i)*4, 4*8))
-                    mask |= ((uint64_t)(1) << (7+i));
-        }
-        for(int i = 0; i < 6; ++i) { /* banked r14 */
-                if(!os->isConcrete((13+i)*4, 4*8))
-                    mask |= ((uint64_t)(1) << (13+i));
-        }
-        for(int i = 0; i < 5; ++i) { /* usr_regs */
-                if(!os->isConcrete((19+i)*4, 4*8))
-                    mask |= ((uint64_t)(1) << (19+i));
-        }
-        for(int i = 0; i < 5; ++i) { /* fiq_regs */
-                if(!os->isConcrete((24+i)*4, 4*8))
-                    mask |= ((uint64_t)(1) << (24+i));
-        }
-        if(!os->isConcrete( 29*4, 4*8)) // CF
-            mask |= ((uint64_t)(1) << 29);
-        if(!os->isConcrete( 30*4, 4*8)) // VF
-            mask |= ((uint64_t)(1) << 30);
-        if(!os->isConcrete(31*4, 4*8)) // NF
-            mask |= ((uint64_t)(1) << 31);
-        if(!os->isConcrete(32*4, 4*8)) // ZF
-            mask |= ((uint64_t)(1) << 32);
-        for(int i = 0; i < 15; ++i) { /* regs */
-                if(!os->isConcrete((33+i)*4, 4*8))
-                    mask |= (uint64_t)(1) << (33+i);
+uint64_t S2EExecutionState::getSymbolicRegistersMask() const
+{
+    if (!m_symbolicRegistersMaskValid) {
+        m_symbolicRegistersMask = 0;
+        if (!m_cpuRegistersObject->isAllConcrete()) {
+            m_symbolicRegistersMask =
+                    computeSymbolicRegistersMask(0, SymbolicRegisterWords * 4, NULL);
         }
-
-    return mask;
+        m_symbolicRegistersMaskValid = true;
+    }
+    return m_symbolicRegistersMask;
 }
 
-#elif defined(TARGET_I386)
-uint64_t S2EExecutionState::getSymbolicRegistersMask() const
+/** Returns the mask bits of the symbolic registers in the given range.
+    covered receives all the mask bits of the range. */
+uint64_t S2EExecutionState::computeSymbolicRegistersMask(unsigned offset,
+                                                         unsigned size,
+                                                         uint64_t *covered) const
 {
     const ObjectState* os = m_cpuRegistersObject;
-    if(os->isAllConcrete())
-        return 0;
+    unsigned end = std::min((offset + size + 3) / 4, SymbolicRegisterWords);
 
-    uint64_t mask = 0;
-    /* XXX: x86-specific */
-    for(int i = 0; i < 8; ++i) { /* regs */
-        if(!os->isConcrete(i*4, 4*8))
-            mask |= (1 << (i+5));
-    }
-    if(!os->isConcrete( 8*4, 4*8)) // cc_op
-        mask |= (1 << 1);
-    if(!os->isConcrete( 9*4, 4*8)) // cc_src
-        mask |= (1 << 2);
-    if(!os->isConcrete(10*4, 4*8)) // cc_dst
-        mask |= (1 << 3);
-    if(!os->isConcrete(11*4, 4*8)) // cc_tmp
-        mask |= (1 << 4);
+    uint64_t mask = 0, bits = 0;
+    for (unsigned i = offset / 4; i < end; ++i) {
+        bits |= symbolicRegisterBit(i);
+        if (!os->isConcrete(i * 4, 4*8)) {
+            mask |= symbolicRegisterBit(i);
+        }
+    }
+
+    if (covered) {
+        *covered = bits;
+    }
     return mask;
 }
-#else
-uint64_t S2EExecutionState::getSymbolicRegistersMask() const
-{
-	assert(false & "Update Hardcoded masking of symbolic fields of CPUState for your target.");
-}
-#endif
-
 
+void S2EExecutionState::updateSymbolicRegistersMask(unsigned offset, unsigned size)
+{
+    if (!m_symbolicRegistersMaskValid) {
+        return;
+    }
 
+    uint64_t covered;
+    uint64_t mask = computeSymbolicRegistersMask(offset, size, &covered);
+    m_symbolicRegistersMask = (m_symbolicRegistersMask & ~covered) | mask;
+}
 
 bool S2EExecutionState::readMemoryConcrete(uint64_t address, void *buf,
                                    uint64_t size, AddressType addressType)
 {
     uint8_t *d = (uint8_t*)buf;
-    while (size>0) {
-        ref<Expr> v = readMemory(address, Expr::Int8, addressType);
-        if (v.isNull() || !isa<ConstantExpr>(v)) {
+    while (size > 0) {
+        /* Translate once per page */
+        uint64_t length = TARGET_PAGE_SIZE - (address & ~TARGET_PAGE_MASK);
+        if (length > size) {
+            length = size;
+        }
+
+        uint64_t hostAddress = getHostAddress(address, addressType);
+        if (hostAddress == (uint64_t) -1) {
             return false;
         }
-        *d = (uint8_t)cast<ConstantExpr>(v)->getZExtValue(8);
-        size--;
-        d++;
-        address++;
+
+        uint64_t remaining = length;
+        while (remaining > 0) {
+            uint64_t offset = hostAddress & ~S2E_RAM_OBJECT_MASK;
+            uint64_t chunk = S2E_RAM_OBJECT_SIZE - offset;
+            if (chunk > remaining) {
+                chunk = remaining;
+            }
+
+            ObjectPair op = addressSpace.findObject(hostAddress & S2E_RAM_OBJECT_MASK);
+
+            assert(op.first && op.first->isUserSpecified
+                   && op.first->size == S2E_RAM_OBJECT_SIZE);
+
+            if (op.second->isAllConcrete()) {
+                ObjectState *os = const_cast<ObjectState*>(op.second);
+                memcpy(d, os->getConcreteStore(true) + offset, chunk);
+            } else {
+                for (uint64_t i = 0; i < chunk; ++i) {
+                    if (!op.second->readConcrete8(offset + i, d + i)) {
+                        return false;
+                    }
+                }
+            }
+
+            d += chunk;
+            hostAddress += chunk;
+            remaining -= chunk;
+        }
+
+        address += length;
+        size -= length;
     }
     return true;
 }
@@ -725,46 +829,419 @@ bool S2EExecutionState::writeMemoryConcrete(uint64_t address, void *buf,
                                    uint64_t size, AddressType addressType)
 {
     uint8_t *d = (uint8_t*)buf;
-    while (size>0) {
-        klee::ref<klee::ConstantExpr> val = klee::ConstantExpr::create(*d, klee::Expr::Int8);
-        bool b = writeMemory(address, val,  addressType);
-        if (!b) {
+    while (size > 0) {
+        /* Translate once per page */
+        uint64_t length = TARGET_PAGE_SIZE - (address & ~TARGET_PAGE_MASK);
+        if (length > size) {
+            length = size;
+        }
+
+        uint64_t hostAddress = getHostAddress(address, addressType);
+        if (hostAddress == (uint64_t) -1) {
             return false;
         }
-        size--;
-        d++;
-        address++;
+
+        uint64_t remaining = length;
+        while (remaining > 0) {
+            uint64_t offset = hostAddress & ~S2E_RAM_OBJECT_MASK;
+            uint64_t chunk = S2E_RAM_OBJECT_SIZE - offset;
+            if (chunk > remaining) {
+                chunk = remaining;
+            }
+
+            ObjectPair op = addressSpace.findObject(hostAddress & S2E_RAM_OBJECT_MASK);
+
+            assert(op.first && op.first->isUserSpecified
+                   && op.first->size == S2E_RAM_OBJECT_SIZE);
+
+            ObjectState *wos = addressSpace.getWriteable(op.first, op.second);
+            if (wos->isAllConcrete()) {
+                memcpy(wos->getConcreteStore(true) + offset, d, chunk);
+            } else {
+                /* Overwrites the symbolic bytes */
+                for (uint64_t i = 0; i < chunk; ++i) {
+                    wos->write8(offset + i, d[i]);
+                }
+            }
+
+            d += chunk;
+            hostAddress += chunk;
+            remaining -= chunk;
+        }
+
+        address += length;
+        size -= length;
     }
     return true;
 }
 
+unsigned S2EExecutionState::getTlbGeneration() const
+{
+    return m_active ? tlb_generation : m_tlbGeneration;
+}
+
+uint64_t S2EExecutionState::getAddressSpaceRoot() const
+{
+#ifdef TARGET_ARM
+    uint32_t features = readCpuState(CPU_OFFSET(features), 32);
+    if (features & (1u << ARM_FEATURE_MPU)) {
+        /* MPU cores do not translate, but changing the regions or their
+           permissions does not flush the TLB. Make such changes miss. */
+        uint64_t root = readCpuState(CPU_OFFSET(cp15.c5_data), 32);
+        for (unsigned n = 0; n < 8; ++n) {
+            root = (root * 1099511628211ULL) ^
+                   readCpuState(CPU_OFFSET(cp15.c6_region) +
+                                n * sizeof(uint32_t), 32);
+        }
+        return root;
+    }
+
+    return readCpuState(CPU_OFFSET(cp15.c2_base0), 32) |
+           (readCpuState(CPU_OFFSET(cp15.c2_base1), 32) << 32);
+#elif defined(TARGET_I386)
+    return readCpuState(CPU_OFFSET(cr[3]), 8*sizeof(target_ulong));
+#endif
+}
+
+#ifdef TARGET_ARM
+/* Privileged read permission, as computed by check_ap() */
+static bool armCanRead(uint32_t sys, uint32_t features, int ap, int domain)
+{
+    if (domain == 3) {
+        return true;
+    }
+
+    switch (ap) {
+    case 0: return ((sys >> 8) & 3) == 1 || ((sys >> 8) & 3) == 2;
+    case 4: return false;
+    case 7: return features & (1u << ARM_FEATURE_V7);
+    default: return true;
+    }
+}
+#endif
+
+/**
+ * Same walk as cpu_get_phys_page_debug, but reads the control
+ * registers and the page tables of this state instead of the ones
+ * of the active state.
+ */
+uint64_t S2EExecutionState::walkPageTables(uint64_t page) const
+{
+    /* Page table reads go to this state's own memory */
+    S2EExecutionState *self = const_cast<S2EExecutionState*>(this);
+
+#ifdef TARGET_ARM
+    uint32_t address = page;
+    uint32_t sys = readCpuState(CPU_OFFSET(cp15.c1_sys), 32);
+    uint32_t features = readCpuState(CPU_OFFSET(features), 32);
+
+    if (address < 0x02000000) {
+        address += readCpuState(CPU_OFFSET(cp15.c13_fcse), 32);
+    }
+
+    if (!(sys & 1)) {
+        return address;
+    }
+
+    if (features & (1u << ARM_FEATURE_MPU)) {
+        /* Same checks as get_phys_addr_mpu for a privileged data read */
+        int n;
+        for (n = 7; n >= 0; n--) {
+            uint32_t base = readCpuState(CPU_OFFSET(cp15.c6_region) +
+                                         n * sizeof(uint32_t), 32);
+            if ((base & 1) == 0) {
+                continue;
+            }
+            uint32_t mask = 1 << ((base >> 1) & 0x1f);
+            mask = (mask << 1) - 1;
+            if (((base ^ address) & ~mask) == 0) {
+                break;
+            }
+        }
+        if (n < 0) {
+            return (uint64_t) -1;
+        }
+
+        uint32_t ap = (readCpuState(CPU_OFFSET(cp15.c5_data), 32) >> (n * 4)) & 0xf;
+        if (ap == 0 || ap == 4 || ap > 6) {
+            return (uint64_t) -1;
+        }
+        return address;
+    }
+
+    uint32_t table;
+    if (address & readCpuState(CPU_OFFSET(cp15.c2_mask), 32)) {
+        table = readCpuState(CPU_OFFSET(cp15.c2_base1), 32) & 0xffffc000;
+    } else {
+        table = readCpuState(CPU_OFFSET(cp15.c2_base0), 32) &
+                readCpuState(CPU_OFFSET(cp15.c2_base_mask), 32);
+    }
+    table |= (address >> 18) & 0x3ffc;
+
+    uint32_t desc;
+    if (!self->readMemoryConcrete(table, &desc, sizeof(desc), PhysicalAddress)) {
+        return (uint64_t) -1;
+    }
+
+    uint32_t dacr = readCpuState(CPU_OFFSET(cp15.c3), 32);
+    int type = desc & 3;
+    int domain, ap;
+    uint32_t physAddr;
+
+    if (sys & (1 << 23)) {
+        /* ARMv6 format */
+        if (type == 0 || type == 3) {
+            return (uint64_t) -1;
+        }
+        if (type == 2 && (desc & (1 << 18))) {
+            domain = dacr & 3;
+        } else {
+            domain = (dacr >> ((desc >> 4) & 0x1e)) & 3;
+        }
+        if (domain == 0 || domain == 2) {
+            return (uint64_t) -1;
+        }
+
+        if (type == 2) {
+            if (desc & (1 << 18)) {
+                physAddr = (desc & 0xff000000) | (address & 0x00ffffff);
+            } else {
+                physAddr = (desc & 0xfff00000) | (address & 0x000fffff);
+            }
+            ap = ((desc >> 10) & 3) | ((desc >> 13) & 4);
+        } else {
+            table = (desc & 0xfffffc00) | ((address >> 10) & 0x3fc);
+            if (!self->readMemoryConcrete(table, &desc, sizeof(desc), PhysicalAddress)) {
+                return (uint64_t) -1;
+            }
+            ap = ((desc >> 4) & 3) | ((desc >> 7) & 4);
+            switch (desc & 3) {
+            case 0: return (uint64_t) -1;
+            case 1: physAddr = (desc & 0xffff0000) | (address & 0xffff); break;
+            default: physAddr = (desc & 0xfffff000) | (address & 0xfff); break;
+            }
+        }
+
+        if (domain != 3 && (sys & (1 << 29)) && (ap & 1) == 0) {
+            return (uint64_t) -1;
+        }
+    } else {
+        /* ARMv5 format */
+        if (type == 0) {
+            return (uint64_t) -1;
+        }
+        domain = (dacr >> ((desc >> 4) & 0x1e)) & 3;
+        if (domain == 0 || domain == 2) {
+            return (uint64_t) -1;
+        }
+
+        if (type == 2) {
+            physAddr = (desc & 0xfff00000) | (address & 0x000fffff);
+            ap = (desc >> 10) & 3;
+        } else {
+            if (type == 1) {
+                table = (desc & 0xfffffc00) | ((address >> 10) & 0x3fc);
+            } else {
+                table = (desc & 0xfffff000) | ((address >> 8) & 0xffc);
+            }
+            if (!self->readMemoryConcrete(table, &desc, sizeof(desc), PhysicalAddress)) {
+                return (uint64_t) -1;
+            }
+            switch (desc & 3) {
+            case 0:
+                return (uint64_t) -1;
+            case 1:
+                physAddr = (desc & 0xffff0000) | (address & 0xffff);
+                ap = (desc >> (4 + ((address >> 13) & 6))) & 3;
+                break;
+            case 2:
+                physAddr = (desc & 0xfffff000) | (address & 0xfff);
+                ap = (desc >> (4 + ((address >> 13) & 6))) & 3;
+                break;
+            default:
+                if (type == 1) {
+                    if (!(features & (1u << ARM_FEATURE_XSCALE))) {
+                        return (uint64_t) -1;
+                    }
+                    physAddr = (desc & 0xfffff000) | (address & 0xfff);
+                } else {
+                    physAddr = (desc & 0xfffffc00) | (address & 0x3ff);
+                }
+                ap = (desc >> 4) & 3;
+                break;
+            }
+        }
+    }
+
+    if (!armCanRead(sys, features, ap, domain)) {
+        return (uint64_t) -1;
+    }
+    return physAddr;
+
+#elif defined(TARGET_I386)
+    target_ulong cr0 = readCpuState(CPU_OFFSET(cr[0]), 8*sizeof(target_ulong));
+    target_ulong cr3 = readCpuState(CPU_OFFSET(cr[3]), 8*sizeof(target_ulong));
+    target_ulong cr4 = readCpuState(CPU_OFFSET(cr[4]), 8*sizeof(target_ulong));
+    uint64_t a20Mask = readCpuState(CPU_OFFSET(a20_mask), 64);
+    uint64_t pte;
+    uint64_t pageSize;
+
+    if (cr4 & CR4_PAE_MASK) {
+        uint64_t pdpe, pde;
+
+#ifdef TARGET_X86_64
+        if (readCpuState(CPU_OFFSET(hflags), 32) & HF_LMA_MASK) {
+            uint64_t pml4e;
+            int64_t sext = (int64_t) page >> 47;
+            if (sext != 0 && sext != -1) {
+                return (uint64_t) -1;
+            }
+
+            uint64_t pml4eAddr = ((cr3 & ~0xfff) + (((page >> 39) & 0x1ff) << 3)) & a20Mask;
+            if (!self->readMemoryConcrete(pml4eAddr, &pml4e, sizeof(pml4e), PhysicalAddress)
+                    || !(pml4e & PG_PRESENT_MASK)) {
+                return (uint64_t) -1;
+            }
+
+            uint64_t pdpeAddr = ((pml4e & ~0xfff) + (((page >> 30) & 0x1ff) << 3)) & a20Mask;
+            if (!self->readMemoryConcrete(pdpeAddr, &pdpe, sizeof(pdpe), PhysicalAddress)
+                    || !(pdpe & PG_PRESENT_MASK)) {
+                return (uint64_t) -1;
+            }
+        } else
+#endif
+        {
+            uint64_t pdpeAddr = ((cr3 & ~0x1f) + ((page >> 27) & 0x18)) & a20Mask;
+            if (!self->readMemoryConcrete(pdpeAddr, &pdpe, sizeof(pdpe), PhysicalAddress)
+                    || !(pdpe & PG_PRESENT_MASK)) {
+                return (uint64_t) -1;
+            }
+        }
+
+        uint64_t pdeAddr = ((pdpe & ~0xfff) + (((page >> 21) & 0x1ff) << 3)) & a20Mask;
+        if (!self->readMemoryConcrete(pdeAddr, &pde, sizeof(pde), PhysicalAddress)
+                || !(pde & PG_PRESENT_MASK)) {
+            return (uint64_t) -1;
+        }
+
+        if (pde & PG_PSE_MASK) {
+            pageSize = 2048 * 1024;
+            pte = pde & ~((pageSize - 1) & ~0xfff);
+        } else {
+            pageSize = 4096;
+            uint64_t pteAddr = ((pde & ~0xfff) + (((page >> 12) & 0x1ff) << 3)) & a20Mask;
+            if (!self->readMemoryConcrete(pteAddr, &pte, sizeof(pte), PhysicalAddress)) {
+                return (uint64_t) -1;
+            }
+        }
+        if (!(pte & PG_PRESENT_MASK)) {
+            return (uint64_t) -1;
+        }
+    } else {
+        if (!(cr0 & CR0_PG_MASK)) {
+            pte = page;
+            pageSize = 4096;
+        } else {
+            uint32_t pde;
+            uint64_t pdeAddr = ((cr3 & ~0xfff) + ((page >> 20) & 0xffc)) & a20Mask;
+            if (!self->readMemoryConcrete(pdeAddr, &pde, sizeof(pde), PhysicalAddress)
+                    || !(pde & PG_PRESENT_MASK)) {
+                return (uint64_t) -1;
+            }
+
+            if ((pde & PG_PSE_MASK) && (cr4 & CR4_PSE_MASK)) {
+                pte = pde & ~0x003ff000;
+                pageSize = 4096 * 1024;
+            } else {
+                uint32_t pte32;
+                uint64_t pteAddr = ((pde & ~0xfff) + ((page >> 10) & 0xffc)) & a20Mask;
+                if (!self->readMemoryConcrete(pteAddr, &pte32, sizeof(pte32), PhysicalAddress)
+                        || !(pte32 & PG_PRESENT_MASK)) {
+                    return (uint64_t) -1;
+                }
+                pte = pte32;
+                pageSize = 4096;
+            }
+        }
+        pte &= a20Mask;
+    }
+
+    return (pte & TARGET_PAGE_MASK) + ((page & TARGET_PAGE_MASK) & (pageSize - 1));
+#endif
+}
+
+S2ETranslationCacheEntry *S2EExecutionState::lookupTranslation(uint64_t page) const
+{
+    uint64_t root = getAddressSpaceRoot();
+    unsigned generation = getTlbGeneration();
+
+    S2ETranslationCacheEntry &e = m_translationCache[
+            (page >> TARGET_PAGE_BITS) & ((1 << S2E_TRANSLATION_CACHE_BITS) - 1)];
+
+    /* The generation changes on TLB flushes of the active state */
+    if (e.page == page && e.root == root && e.generation == generation) {
+        return &e;
+    }
+
+    uint64_t physPage;
+    if (m_active) {
+        target_phys_addr_t physicalAddress = cpu_get_phys_page_debug(env, page);
+        if (physicalAddress == (target_phys_addr_t) -1) {
+            return NULL;
+        }
+        physPage = physicalAddress;
+    } else {
+        physPage = walkPageTables(page);
+        if (physPage == (uint64_t) -1) {
+            return NULL;
+        }
+    }
+
+    e.page = page;
+    e.root = root;
+    e.physPage = physPage & TARGET_PAGE_MASK;
+    e.generation = generation;
+    e.hostPage = 0;
+    return &e;
+}
+
 uint64_t S2EExecutionState::getPhysicalAddress(uint64_t virtualAddress) const
 {
-    assert(m_active && "Can not use getPhysicalAddress when the state"
-                       " is not active (TODO: fix it)");
-    target_phys_addr_t physicalAddress =
-        cpu_get_phys_page_debug(env, virtualAddress & TARGET_PAGE_MASK);
-    if(physicalAddress == (target_phys_addr_t) -1)
+    S2ETranslationCacheEntry *e = lookupTranslation(virtualAddress & TARGET_PAGE_MASK);
+    if (!e) {
         return (uint64_t) -1;
+    }
 
-    return physicalAddress | (virtualAddress & ~TARGET_PAGE_MASK);
+    return e->physPage | (virtualAddress & ~TARGET_PAGE_MASK);
 }
 
 uint64_t S2EExecutionState::getHostAddress(uint64_t address,
                                            AddressType addressType) const
 {
-    if(addressType != HostAddress) {
-        uint64_t hostAddress = address & TARGET_PAGE_MASK;
-        if(addressType == VirtualAddress) {
-            hostAddress = getPhysicalAddress(hostAddress);
-            if(hostAddress == (uint64_t) -1)
+    if(addressType == VirtualAddress) {
+        S2ETranslationCacheEntry *e = lookupTranslation(address & TARGET_PAGE_MASK);
+        if (!e) {
+            return (uint64_t) -1;
+        }
+
+        /* Physical memory mappings change with tlb_generation too, but
+           not m_tlbGeneration, so check it separately */
+        if (!e->hostPage || e->hostGeneration != tlb_generation) {
+            uint64_t hostPage = (uint64_t) qemu_get_phys_ram_ptr(e->physPage);
+            if (!hostPage) {
                 return (uint64_t) -1;
+            }
+            e->hostPage = hostPage;
+            e->hostGeneration = tlb_generation;
         }
 
+        return e->hostPage | (address & ~TARGET_PAGE_MASK);
+
+    } else if(addressType == PhysicalAddress) {
         /* We can not use qemu_get_ram_ptr directly. Mapping of IO memory
            can be modified after memory registration and qemu_get_ram_ptr will
            return incorrect values in such cases */
-        hostAddress = (uint64_t) qemu_get_phys_ram_ptr(hostAddress);
+        uint64_t hostAddress = (uint64_t) qemu_get_phys_ram_ptr(address & TARGET_PAGE_MASK);
         if(!hostAddress)
             return (uint64_t) -1;
 
@@ -778,37 +1255,70 @@ uint64_t S2EExecutionState::getHostAddress(uint64_t address,
 bool S2EExecutionState::readString(uint64_t address, std::string &s, unsigned maxLen)
 {
     s = "";
-    do {
-        uint8_t c;
-        SREADR(this, address, c);
 
-        if (c) {
-            s = s + (char)c;
-        }else {
-            return true;
+    uint8_t buf[TARGET_PAGE_SIZE];
+    while (maxLen > 0) {
+        /* Read up to the end of the page, then look for the terminator */
+        unsigned length = TARGET_PAGE_SIZE - (address & ~TARGET_PAGE_MASK);
+        if (length > maxLen) {
+            length = maxLen;
+        }
+
+        if (!readMemoryConcrete(address, buf, length)) {
+            /* The failing byte may follow the terminator */
+            for (unsigned i = 0; i < length; ++i) {
+                uint8_t c;
+                SREADR(this, address + i, c);
+                if (!c) {
+                    return true;
+                }
+                s += (char) c;
+            }
+        } else {
+            uint8_t *end = (uint8_t*) memchr(buf, 0, length);
+            if (end) {
+                s.append((const char*) buf, end - buf);
+                return true;
+            }
+            s.append((const char*) buf, length);
         }
-        address++;
-        maxLen--;
-    }while(maxLen>=0);
+
+        address += length;
+        maxLen -= length;
+    }
     return true;
 }
 
 bool S2EExecutionState::readUnicodeString(uint64_t address, std::string &s, unsigned maxLen)
 {
     s = "";
-    do {
-        uint16_t c;
-        SREADR(this, address, c);
 
-        if (c) {
-            s = s + (char)c;
-        }else {
-            return true;
+    uint16_t buf[TARGET_PAGE_SIZE / sizeof(uint16_t)];
+    while (maxLen > 0) {
+        /* Characters that straddle two pages are read on their own */
+        unsigned count = (TARGET_PAGE_SIZE - (address & ~TARGET_PAGE_MASK)) / sizeof(uint16_t);
+        if (count == 0) {
+            count = 1;
+        }
+        if (count > maxLen) {
+            count = maxLen;
+        }
+
+        bool concrete = readMemoryConcrete(address, buf, count * sizeof(uint16_t));
+        for (unsigned i = 0; i < count; ++i) {
+            uint16_t c = buf[i];
+            if (!concrete) {
+                SREADR(this, address + i * sizeof(uint16_t), c);
+            }
+            if (!c) {
+                return true;
+            }
+            s += (char) c;
         }
 
-        address+=2;
-        maxLen--;
-    }while(maxLen>=0);
+        address += count * sizeof(uint16_t);
+        maxLen -= count;
+    }
     return true;
 }
 
@@ -1020,6 +1530,12 @@ void S2EExecutionState::readRamConcreteCheck(uint64_t hostAddress, uint8_t* buf,
                op.first->address == page_addr &&
                op.first->size == S2E_RAM_OBJECT_SIZE);
 
+        if (isConcreteRange(op.second, page_offset, size)) {
+            ObjectState *os = const_cast<ObjectState*>(op.second);
+            copyConcrete(buf, os->getConcreteStore(true) + page_offset, size);
+            return;
+        }
+
         for(uint64_t i=0; i<size; ++i) {
             if(!op.second->readConcrete8(page_offset+i, buf+i)) {
                 if (PrintModeSwitch) {
@@ -1061,6 +1577,12 @@ void S2EExecutionState::readRamConcrete(uint64_t hostAddress, uint8_t* buf, uint
                op.first->address == page_addr &&
                op.first->size == S2E_RAM_OBJECT_SIZE);
 
+        if (isConcreteRange(op.second, page_offset, size)) {
+            ObjectState *os = const_cast<ObjectState*>(op.second);
+            copyConcrete(buf, os->getConcreteStore(true) + page_offset, size);
+            return;
+        }
+
         ObjectState *wos = NULL;
         for(uint64_t i=0; i<size; ++i) {
             if(!op.second->readConcrete8(page_offset+i, buf+i)) {
@@ -1104,6 +1626,14 @@ void S2EExecutionState::writeRamConcrete(uint64_t hostAddress, const uint8_t* bu
 
         ObjectState* wos =
                 addressSpace.getWriteable(op.first, op.second);
+
+        /* Stores to concrete bytes go to the concrete store directly,
+           like the softmmu fast path does */
+        if (isConcreteRange(wos, page_offset, size)) {
+            copyConcrete(wos->getConcreteStore(true) + page_offset, buf, size);
+            return;
+        }
+
         for(uint64_t i=0; i<size; ++i) {
             wos->write8(page_offset+i, buf[i]);
         }
@@ -1161,6 +1691,7 @@ void S2EExecutionState::readRegisterConcrete(
                 wos->write8(offset+i, buf[i]);
             }
         }
+        updateSymbolicRegistersMask(offset, size);
     } else {
         //XXX: check if the size is always small enough
         small_memcpy(buf, ((uint8_t*)cpuState)+offset, size);
@@ -1206,6 +1737,7 @@ void S2EExecutionState::readRegisterConcrete(
                 wos->write8(offset+i, buf[i]);
             }
         }
+        updateSymbolicRegistersMask(offset, size);
     } else {
         //XXX: check if the size is always small enough
         small_memcpy(buf, ((uint8_t*)cpuState)+offset, size);
@@ -1237,6 +1769,7 @@ void S2EExecutionState::writeRegisterConcrete(CPUARMState *cpuState,
         ObjectState* wos = m_cpuRegistersObject;
         for(unsigned i = 0; i < size; ++i)
             wos->write8(offset+i, buf[i]);
+        updateSymbolicRegistersMask(offset, size);
     } else {
         assert(m_cpuRegistersObject->isConcrete(offset, size*8));
         small_memcpy(((uint8_t*)cpuState)+offset, buf, size);
@@ -1258,6 +1791,7 @@ void S2EExecutionState::writeRegisterConcrete(CPUX86State *cpuState,
         ObjectState* wos = m_cpuRegistersObject;
         for(unsigned i = 0; i < size; ++i)
             wos->write8(offset+i, buf[i]);
+        updateSymbolicRegistersMask(offset, size);
     } else {
         assert(m_cpuRegistersObject->isConcrete(offset, size*8));
         small_memcpy(((uint8_t*)cpuState)+offset, buf, size);
@@ -1484,6 +2018,8 @@ bool S2EExecutionState::merge(const ExecutionState &_b)
 
     assert(!m_active && !b.m_active);
 
+    invalidateSymbolicRegistersMask();
+
     std::ostream& s = g_s2e->getMessagesStream(this);
 
     if(DebugLogStateMerge)
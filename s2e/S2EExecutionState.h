@@ -42,6 +42,7 @@
 
 #include "S2EStatsTracker.h"
 #include "MemoryCache.h"
+#include "Plugin.h"
 #include "s2e_config.h"
 
 extern "C" {
@@ -68,8 +69,8 @@ class S2EDeviceState;
 class S2EExecutionState;
 struct S2ETranslationBlock;
 
-//typedef std::tr1::unordered_map<const Plugin*, PluginState*> PluginStateMap;
-typedef std::map<const Plugin*, PluginState*> PluginStateMap;
+//Plugin states indexed by Plugin::getPluginSlot(), NULL if not created yet
+typedef std::vector<PluginState*> PluginStateSlots;
 typedef PluginState* (*PluginStateFactory)(Plugin *p, S2EExecutionState *s);
 
 typedef MemoryCachePool<klee::ObjectPair,
@@ -77,6 +78,24 @@ typedef MemoryCachePool<klee::ObjectPair,
                 TARGET_PAGE_BITS,
                 S2E_MEMCACHE_SUPERPAGE_BITS> S2EMemoryCache;
 
+/** Software TLB entry for a guest virtual page of one address space */
+struct S2ETranslationCacheEntry
+{
+    uint64_t page;
+    uint64_t root;
+    uint64_t physPage;
+    unsigned generation;
+
+    /* The host page is looked up lazily, I/O pages have none */
+    uint64_t hostPage;
+    unsigned hostGeneration;
+
+    S2ETranslationCacheEntry() {
+        page = (uint64_t) -1;
+        hostPage = 0;
+    }
+};
+
 struct S2EPhysCacheEntry
 {
     uint64_t hostPage;
@@ -99,7 +118,11 @@ protected:
     /** Unique numeric ID for the state */
     int m_stateID;
 
-    PluginStateMap m_PluginState;
+    PluginStateSlots m_PluginState;
+
+    PluginState *createPluginState(Plugin *plugin, PluginStateFactory factory);
+    void unsharePluginState(PluginState *&state);
+    static void releasePluginState(PluginState *state);
 
     bool m_symbexEnabled;
 
@@ -119,6 +142,11 @@ protected:
     */
     bool m_runningConcrete;
 
+    /** Cached result of getSymbolicRegistersMask. Register writes made
+        through this class update it, KLEE execution invalidates it. */
+    mutable uint64_t m_symbolicRegistersMask;
+    mutable bool m_symbolicRegistersMaskValid;
+
     typedef std::set<std::pair<uint64_t,uint64_t> > ToRunSymbolically;
     ToRunSymbolically m_toRunSymbolically;
 
@@ -139,6 +167,14 @@ protected:
 
     S2EMemoryCache m_memcache;
 
+    /** Software TLB used by getPhysicalAddress and getHostAddress */
+    mutable S2ETranslationCacheEntry
+            m_translationCache[1 << S2E_TRANSLATION_CACHE_BITS];
+
+    /** Value of tlb_generation when the state was switched out.
+        The page tables of an inactive state do not change. */
+    unsigned m_tlbGeneration;
+
     /* The following structure is used to store QEMU time accounting
        variables while the state is inactive */
     TimersState* m_timersState;
@@ -146,6 +182,9 @@ protected:
 
     S2ETranslationBlock* m_lastS2ETb;
 
+    /** Value of tb_unlink_count when the state entered its current trace */
+    uint32_t m_traceUnlinkCount;
+
     uint64_t m_lastMergeICount;
 
     bool m_needFinalizeTBExec;
@@ -164,6 +203,18 @@ protected:
 
     std::string getUniqueVarName(const std::string &name);
 
+    unsigned getTlbGeneration() const;
+    S2ETranslationCacheEntry *lookupTranslation(uint64_t page) const;
+    uint64_t walkPageTables(uint64_t page) const;
+
+    uint64_t computeSymbolicRegistersMask(unsigned offset, unsigned size,
+                                          uint64_t *covered) const;
+    void updateSymbolicRegistersMask(unsigned offset, unsigned size);
+
+    void invalidateSymbolicRegistersMask() {
+        m_symbolicRegistersMaskValid = false;
+    }
+
 public:
     enum AddressType {
         VirtualAddress, PhysicalAddress, HostAddress
@@ -184,16 +235,35 @@ public:
     /*************************************************/
 
     PluginState* getPluginState(Plugin *plugin, PluginStateFactory factory) {
-        PluginStateMap::iterator it = m_PluginState.find(plugin);
-        if (it == m_PluginState.end()) {
-            PluginState *ret = factory(plugin, this);
-            assert(ret);
-            m_PluginState[plugin] = ret;
-            return ret;
+        unsigned slot = plugin->getPluginSlot();
+        PluginState *state;
+        if (slot >= m_PluginState.size() || !m_PluginState[slot]) {
+            state = createPluginState(plugin, factory);
+        } else {
+            PluginState *&ref = m_PluginState[slot];
+            if (ref->m_shareCount > 1 && !ref->isImmutable()) {
+                unsharePluginState(ref);
+            }
+            state = ref;
+        }
+        //The caller may keep using the pointer across a fork, see clone()
+        if (!state->isImmutable()) {
+            state->m_writable = true;
+        }
+        return state;
+    }
+
+    //Does not copy the plugin state if it is shared with other states
+    const PluginState* getPluginStateConst(Plugin *plugin, PluginStateFactory factory) {
+        unsigned slot = plugin->getPluginSlot();
+        if (slot >= m_PluginState.size() || !m_PluginState[slot]) {
+            return createPluginState(plugin, factory);
         }
-        return (*it).second;
+        return m_PluginState[slot];
     }
 
+    void setPluginState(Plugin *plugin, PluginState *state);
+
     /* Returns true if a TB wants to be re-executed in symbolic mode.
      * See s2e/README_Symbex_Interruption_Bug.txt for details.
      */
@@ -276,7 +346,9 @@ public:
     bool isRamSharedConcrete(uint64_t hostAddress);
 
 
-    /** Read value from memory, returning false if the value is symbolic */
+    /** Read value from memory, returning false if the value is symbolic.
+        Addresses are translated once per page, and fully concrete
+        memory objects are copied in bulk. */
     bool readMemoryConcrete(uint64_t address, void *buf, uint64_t size,
                             AddressType addressType = VirtualAddress);
 
@@ -320,17 +392,29 @@ public:
 #endif
 
 
-    /** Read an ASCIIZ string from memory */
+    /** Read a whole structure from memory, returning false if
+        any of its bytes is symbolic or unmapped */
+    template<typename T>
+    bool readStruct(uint64_t address, T *data,
+                    AddressType addressType = VirtualAddress) {
+        return readMemoryConcrete(address, data, sizeof(T), addressType);
+    }
+
+    /** Read an ASCIIZ string of at most maxLen characters from memory */
     bool readString(uint64_t address, std::string &s, unsigned maxLen=256);
     bool readUnicodeString(uint64_t address, std::string &s, unsigned maxLen=256);
 
-    /** Virtual address translation (debug mode). Returns -1 on failure. */
+    /** Virtual address translation (debug mode). Returns -1 on failure.
+        Works for inactive states too, by walking their own page tables. */
     uint64_t getPhysicalAddress(uint64_t virtualAddress) const;
 
     /** Address translation (debug mode). Returns host address or -1 on failure */
     uint64_t getHostAddress(uint64_t address,
                             AddressType addressType = VirtualAddress) const;
 
+    /** Returns the page table root of the current address space */
+    uint64_t getAddressSpaceRoot() const;
+
     /** Access to state's memory. Address is virtual or physical,
         depending on 'physical' argument. Returns NULL or false in
         case of failure (can't resolve virtual address or physical
@@ -109,6 +109,7 @@ uint64_t helper_set_cc_op_eflags(void);
 #include <llvm/System/TimeValue.h>
 
 #include <vector>
+#include <algorithm>
 
 #include <sstream>
 
@@ -151,6 +152,44 @@ namespace {
             cl::desc("Remove Select statements from LLVM code"),
             cl::init(false));
 
+    cl::opt<unsigned>
+    TbOptimizationLevel("tb-optimization-level",
+            cl::desc("Optimization passes run on the LLVM code of each TB:"
+                     " 0 - none, 1 - mem2reg and instcombine,"
+                     " 2 - also GVN and dead store elimination"),
+            cl::init(2));
+
+    cl::opt<bool>
+    TbCache("tb-cache",
+            cl::desc("Reuse the LLVM code of translation blocks whose"
+                     " TCG ops were already translated, even after tb_flush"),
+            cl::init(true));
+
+    cl::opt<unsigned>
+    TbCacheSize("tb-cache-size",
+            cl::desc("Maximum number of translation blocks kept in the"
+                     " translation block cache, the least recently used"
+                     " ones are evicted first"),
+            cl::init(16384));
+
+    cl::opt<std::string>
+    TbCacheFile("tb-cache-file",
+            cl::desc("Bitcode file to load the translation block cache from"
+                     " at startup and to save it to at exit"),
+            cl::init(""));
+
+    cl::opt<unsigned>
+    TraceThreshold("trace-threshold",
+            cl::desc("Compile chains of translation blocks executed in KLEE"
+                     " into a single function after this many executions"
+                     " of their first block (0 disables traces)"),
+            cl::init(128));
+
+    cl::opt<unsigned>
+    MaxTraceLength("max-trace-length",
+            cl::desc("Maximum number of translation blocks in a trace"),
+            cl::init(8));
+
     cl::opt<bool>
     StateSharedMemory("state-shared-memory",
             cl::desc("Allow unimportant memory regions (like video RAM) to be shared between states"),
@@ -168,11 +207,35 @@ namespace {
                      " disabling leads to faster but possibly incorrect execution"),
             cl::init(true));
 
+    cl::opt<bool>
+    SwitchChangedObjectsOnly("state-switch-changed-objects-only",
+            cl::desc("When switching or forking states, only copy shared-concrete"
+                     " objects whose contents actually differ"),
+            cl::init(true));
+
+    cl::opt<bool>
+    ProcessWorkStealing("s2e-work-stealing",
+            cl::desc("Let S2E processes that run out of states take over"
+                     " half of the states of a busy process"),
+            cl::init(true));
+
+    cl::opt<unsigned>
+    WorkStealingMinStates("s2e-work-stealing-min-states",
+            cl::desc("Minimum number of states a process must have"
+                     " to hand over some of them to an idle process"),
+            cl::init(2));
+
     cl::opt<bool>
     KeepLLVMFunctions("keep-llvm-functions",
             cl::desc("Never delete generated LLVM functions"),
             cl::init(false));
 
+    cl::opt<unsigned>
+    CompactLLVMModuleThreshold("compact-llvm-module-threshold",
+            cl::desc("Erase the LLVM functions of deleted translation blocks"
+                     " from the module once that many accumulated"),
+            cl::init(1024));
+
     cl::opt<bool>
     ForkOnSymbolicAddress("fork-on-symbolic-address",
             cl::desc("Fork on each memory access with symbolic address"),
@@ -451,6 +514,45 @@ void S2EExecutor::handlerTracePortAccess(Executor* executor,
     }
 }
 
+/* Called by traces between two of their tbs. The trace goes on only if
+   tb left through the exit the trace follows and if no tb was unlinked
+   since this state entered the trace. */
+void S2EExecutor::handlerTraceNext(Executor* executor,
+                                     ExecutionState* state,
+                                     klee::KInstruction* target,
+                                     std::vector<klee::ref<klee::Expr> > &args)
+{
+    S2EExecutor* s2eExecutor = static_cast<S2EExecutor*>(executor);
+    S2EExecutionState* s2eState = static_cast<S2EExecutionState*>(state);
+
+    assert(args.size() == 3);
+    TranslationBlock *tb = (TranslationBlock*)
+            cast<klee::ConstantExpr>(args[0])->getZExtValue();
+    unsigned exit = cast<klee::ConstantExpr>(args[1])->getZExtValue();
+    TranslationBlock *next = (TranslationBlock*)
+            cast<klee::ConstantExpr>(args[2])->getZExtValue();
+
+    sigset_t oldset;
+    s2e_disable_signals(&oldset);
+
+    bool linked = tcg_llvm_runtime.goto_tb == exit &&
+            tcg_llvm_runtime.tb_unlink_count == s2eState->m_traceUnlinkCount &&
+            tb->s2e_tb_next[exit] == next;
+
+    if(linked) {
+        /* Same bookkeeping as when chaining outside of traces */
+        ++tb->s2e_tb->chainCount[exit];
+        tcg_llvm_runtime.goto_tb = 0xff;
+        env->s2e_current_tb = next;
+        s2eExecutor->updateLastS2ETb(s2eState, next);
+    }
+
+    s2e_enable_signals(&oldset);
+
+    s2eExecutor->bindLocal(target, *state,
+                           klee::ConstantExpr::create(linked, Expr::Int8));
+}
+
 void S2EExecutor::handleForkAndConcretize(Executor* executor,
                                      ExecutionState* state,
                                      klee::KInstruction* target,
@@ -747,6 +849,28 @@ S2EExecutor::S2EExecutor(S2E* s2e, TCGLLVMContext *tcgLLVMContext,
         m_tcgLLVMContext->getFunctionPassManager()->doInitialization();
     }
 
+    m_tcgLLVMContext->setTbOptimizationLevel(TbOptimizationLevel);
+    if(UseSelectCleaner && m_tcgLLVMContext->getTbPassManager()) {
+        m_tcgLLVMContext->getTbPassManager()->add(new SelectRemovalPass());
+        m_tcgLLVMContext->getTbPassManager()->doInitialization();
+    }
+
+    if(TbCache) {
+        m_tcgLLVMContext->enableTbCache(
+                hash64(UseSelectCleaner), TbCacheSize);
+
+        std::string error;
+        if(!TbCacheFile.empty() &&
+           !m_tcgLLVMContext->loadTbCache(TbCacheFile, &error)) {
+            s2e->getWarningsStream() << "Could not load translation block cache "
+                    << TbCacheFile << ": " << error << std::endl;
+        } else if(!TbCacheFile.empty()) {
+            s2e->getMessagesStream() << "Loaded " << std::dec
+                    << m_tcgLLVMContext->getTbCacheSize()
+                    << " translation blocks from " << TbCacheFile << std::endl;
+        }
+    }
+
     /* Set module for the executor */
 #if 1
     char* filename =  qemu_find_file(QEMU_FILE_TYPE_LIB, "op_helper.bc");
@@ -830,6 +954,10 @@ S2EExecutor::S2EExecutor(S2E* s2e, TCGLLVMContext *tcgLLVMContext,
     assert(function);
     addSpecialFunctionHandler(function, handleForkAndConcretize);
 
+    function = kmodule->module->getFunction("tcg_llvm_trace_next");
+    assert(function);
+    addSpecialFunctionHandler(function, handlerTraceNext);
+
     searcher = constructUserSearcher(*this);
 
     m_stateManager = NULL;
@@ -855,12 +983,34 @@ void S2EExecutor::initializeStatistics()
 
 void S2EExecutor::flushTb() {
     tb_flush(env); // release references to TB functions
+    compactLLVMModule();
+}
+
+void S2EExecutor::releaseLLVMFunction(llvm::Function *f)
+{
+    static_cast<S2EExternalDispatcher*>(externalDispatcher)->removeFunction(f);
+    kmodule->removeFunction(f);
+    m_tcgLLVMContext->releaseFunction(f);
+}
+
+void S2EExecutor::compactLLVMModule()
+{
+    stats::llvmFunctionsErased += m_tcgLLVMContext->compactModule();
 }
 
 S2EExecutor::~S2EExecutor()
 {
     if(statsTracker)
         statsTracker->done();
+
+    //Only the first process writes the cache, others would overwrite it
+    if(TbCache && !TbCacheFile.empty() && m_s2e->getCurrentProcessIndex() == 0) {
+        std::string error;
+        if(!m_tcgLLVMContext->saveTbCache(TbCacheFile, &error)) {
+            m_s2e->getWarningsStream() << "Could not save translation block cache: "
+                    << error << std::endl;
+        }
+    }
 }
 
 S2EExecutionState* S2EExecutor::createInitialState()
@@ -1159,6 +1309,7 @@ void S2EExecutor::switchToConcrete(S2EExecutionState *state)
             if(!wos->isAllConcrete()) {
                 /* The object contains symbolic values. We have to
                concretize it */
+                state->invalidateSymbolicRegistersMask();
 
                 for(unsigned i = 0; i < wos->size; ++i) {
                     ref<Expr> e = wos->read8(i);
@@ -1259,6 +1410,7 @@ void S2EExecutor::doStateSwitch(S2EExecutionState* oldState,
         uint8_t *oldStore = oldState->m_cpuSystemObject->getConcreteStore();
         memcpy(oldStore, (uint8_t*) cpuMo->address, cpuMo->size);
 
+        oldState->m_tlbGeneration = tlb_generation;
         oldState->m_active = false;
     }
 
@@ -1282,34 +1434,68 @@ void S2EExecutor::doStateSwitch(S2EExecutionState* oldState,
 
     uint64_t totalCopied = 0;
     uint64_t objectsCopied = 0;
+    uint64_t objectsSkipped = 0;
     foreach(MemoryObject* mo, m_saveOnContextSwitch) {
         if(mo == cpuMo)
             continue;
 
+        /* Once saved, oldOS holds exactly what is in the host memory */
+        const ObjectState *oldOS = NULL;
+        bool copied = false;
+
         if(oldState) {
-            const ObjectState *oldOS = oldState->addressSpace.findObject(mo);
-            ObjectState *oldWOS = oldState->addressSpace.getWriteable(mo, oldOS);
-            uint8_t *oldStore = oldWOS->getConcreteStore();
-            assert(oldStore);
-            memcpy(oldStore, (uint8_t*) mo->address, mo->size);
+            oldOS = oldState->addressSpace.findObject(mo);
+            if(!SwitchChangedObjectsOnly ||
+                    memcmp(oldOS->getConcreteStore(), (uint8_t*) mo->address, mo->size)) {
+                ObjectState *oldWOS = oldState->addressSpace.getWriteable(mo, oldOS);
+                uint8_t *oldStore = oldWOS->getConcreteStore();
+                assert(oldStore);
+                memcpy(oldStore, (uint8_t*) mo->address, mo->size);
+                oldOS = oldWOS;
+                totalCopied += mo->size;
+                copied = true;
+            }
         }
 
         if(newState) {
             const ObjectState *newOS = newState->addressSpace.findObject(mo);
             const uint8_t *newStore = newOS->getConcreteStore();
             assert(newStore);
-            memcpy((uint8_t*) mo->address, newStore, mo->size);
+
+            /* Both states share the same ObjectState (e.g., siblings that
+               did not write to this object since the fork). The host
+               memory is already up to date. */
+            if(!SwitchChangedObjectsOnly ||
+                    (newOS != oldOS && memcmp((uint8_t*) mo->address, newStore, mo->size))) {
+                memcpy((uint8_t*) mo->address, newStore, mo->size);
+                totalCopied += mo->size;
+                copied = true;
+            }
         }
 
-        totalCopied += mo->size;
-        objectsCopied++;
+        if(copied)
+            objectsCopied++;
+        else
+            objectsSkipped++;
     }
 
-    s2e_debug_print("Copied %d (count=%d)\n", totalCopied, objectsCopied);
+    ++stats::stateSwitches;
+    stats::stateSwitchBytesCopied += totalCopied;
+
+    s2e_debug_print("Copied %"PRIu64" bytes (count=%"PRIu64", skipped=%"PRIu64")\n",
+                    totalCopied, objectsCopied, objectsSkipped);
 
     if(FlushTBsOnStateSwitch)
         tb_flush(env);
 
+    //The TLB was switched along with the CPU state, but the translations
+    //cached elsewhere belong to the previous state.
+    tlb_generation++;
+
+    //A state resumed in the middle of a trace must not trust the links
+    //it checked before being switched out.
+    tcg_llvm_runtime.tb_unlink_count++;
+
     cpu_enable_ticks();
     //m_s2e->getCorePlugin()->onStateSwitch.emit(oldState, newState);
 }
@@ -1333,8 +1519,17 @@ S2EExecutionState* S2EExecutor::selectNextState(S2EExecutionState *state)
         updateStates(state);
     }
 
+    if (ProcessWorkStealing && m_s2e->getMaxProcesses() > 1) {
+        shareStatesWithIdleProcess();
+        updateStates(state);
+    }
+
     if(states.empty()) {
         m_s2e->getWarningsStream() << "All states were terminated" << std::endl;
+        if (ProcessWorkStealing && m_s2e->getMaxProcesses() > 1) {
+            //Our slot will be freed on exit, let busy processes refill it
+            m_s2e->requestWork();
+        }
         foreach(S2EExecutionState* s, m_deletedStates) {
             unrefS2ETb(s->m_lastS2ETb);
             s->m_lastS2ETb = NULL;
@@ -1453,6 +1648,9 @@ inline void S2EExecutor::executeOneInstruction(S2EExecutionState *state)
 
     stepInstruction(*state);
 
+    /* The instruction may store to the register object */
+    state->invalidateSymbolicRegistersMask();
+
     bool shouldExitCpu = false;
     try {
 
@@ -1625,15 +1823,14 @@ uintptr_t S2EExecutor::executeTranslationBlockKlee(
             assert(tb->llvm_function);
         }
 
-        if(tb->s2e_tb != state->m_lastS2ETb) {
-            unrefS2ETb(state->m_lastS2ETb);
-            state->m_lastS2ETb = tb->s2e_tb;
-            state->m_lastS2ETb->refCount += 1;
-        }
+        updateLastS2ETb(state, tb);
+
+        S2ETrace *trace = getTrace(state, tb);
 
         /* Prepare function execution */
         prepareFunctionExecution(state,
-                tb->llvm_function, std::vector<ref<Expr> >(1,
+                trace ? trace->function : tb->llvm_function,
+                std::vector<ref<Expr> >(1,
                     Expr::createPointer((uint64_t) tb_function_args)));
 
         /* Information for GETPC() macro */
@@ -1643,8 +1840,9 @@ uintptr_t S2EExecutor::executeTranslationBlockKlee(
         while(state->stack.size() != 1) {
             executeOneInstruction(state);
 
-            /* Check to goto_tb request */
-            if(tcg_llvm_runtime.goto_tb != 0xff) {
+            /* Check to goto_tb request. Traces follow their own
+               links and are chained once they return. */
+            if(!trace && tcg_llvm_runtime.goto_tb != 0xff) {
                 assert(tcg_llvm_runtime.goto_tb < 2);
 
                 /* The next should be atomic with respect to signals */
@@ -1665,6 +1863,7 @@ uintptr_t S2EExecutor::executeTranslationBlockKlee(
 #ifndef NDEBUG
                     TranslationBlock* old_tb = tb;
 #endif
+                    ++tb->s2e_tb->chainCount[tcg_llvm_runtime.goto_tb];
 
                     assert(state->stack.size() == 2);
                     state->popFrame();
@@ -1700,6 +1899,27 @@ uintptr_t S2EExecutor::executeTranslationBlockKlee(
         state->prevPC = 0;
         state->pc = m_dummyMain->instructions;
 
+        if(trace && tcg_llvm_runtime.goto_tb != 0xff) {
+            /* The trace left its chain in the block it entered last */
+            tb = env->s2e_current_tb;
+            assert(tcg_llvm_runtime.goto_tb < 2);
+
+            sigset_t oldset;
+            s2e_disable_signals(&oldset);
+
+            TranslationBlock* next_tb =
+                    tb->s2e_tb_next[tcg_llvm_runtime.goto_tb];
+            if(next_tb) {
+                ++tb->s2e_tb->chainCount[tcg_llvm_runtime.goto_tb];
+                tb = next_tb;
+                env->s2e_current_tb = tb;
+            } else {
+                tcg_llvm_runtime.goto_tb = 0xff;
+            }
+
+            s2e_enable_signals(&oldset);
+        }
+
     } while(tcg_llvm_runtime.goto_tb != 0xff);
 
     //g_s2e_exec_ret_addr = 0;
@@ -1714,6 +1934,94 @@ uintptr_t S2EExecutor::executeTranslationBlockKlee(
     return cast<klee::ConstantExpr>(resExpr)->getZExtValue();
 }
 
+void S2EExecutor::updateLastS2ETb(S2EExecutionState *state,
+                                  TranslationBlock *tb)
+{
+    if(tb->s2e_tb != state->m_lastS2ETb) {
+        unrefS2ETb(state->m_lastS2ETb);
+        state->m_lastS2ETb = tb->s2e_tb;
+        state->m_lastS2ETb->refCount += 1;
+    }
+}
+
+S2ETrace* S2EExecutor::getTrace(S2EExecutionState *state, TranslationBlock *tb)
+{
+    S2ETranslationBlock *s2e_tb = tb->s2e_tb;
+    if(!TraceThreshold) {
+        return NULL;
+    }
+
+    if(!s2e_tb->trace) {
+        if(++s2e_tb->executionCountKlee % TraceThreshold) {
+            return NULL;
+        }
+        s2e_tb->trace = buildTrace(tb);
+        if(!s2e_tb->trace) {
+            return NULL;
+        }
+    }
+
+    /* Read the counter before checking the links, so that the trace
+       notices any block unlinked after this point */
+    uint32_t unlinkCount = tcg_llvm_runtime.tb_unlink_count;
+
+    S2ETrace *trace = s2e_tb->trace;
+    for(unsigned i = 0; i < trace->exits.size(); ++i) {
+        TranslationBlock *next = trace->tbs[i+1];
+        if(trace->tbs[i]->s2e_tb_next[trace->exits[i]] != next ||
+           next->s2e_tb != trace->s2e_tbs[i]) {
+            return NULL;
+        }
+    }
+
+    state->m_traceUnlinkCount = unlinkCount;
+    return trace;
+}
+
+S2ETrace* S2EExecutor::buildTrace(TranslationBlock *tb)
+{
+    std::vector<TranslationBlock*> tbs(1, tb);
+    std::vector<unsigned> exits;
+
+    /* Follow the most frequently taken links */
+    while(tbs.size() < MaxTraceLength) {
+        S2ETranslationBlock *s2e_tb = tb->s2e_tb;
+        unsigned n = s2e_tb->chainCount[1] > s2e_tb->chainCount[0] ? 1 : 0;
+        TranslationBlock *next = tb->s2e_tb_next[n];
+
+        if(!s2e_tb->chainCount[n] || !next || !next->llvm_function ||
+           std::find(tbs.begin(), tbs.end(), next) != tbs.end()) {
+            break;
+        }
+
+        exits.push_back(n);
+        tbs.push_back(next);
+        tb = next;
+    }
+
+    if(tbs.size() < 2) {
+        return NULL;
+    }
+
+    S2ETrace *trace = new S2ETrace;
+    trace->tbs = tbs;
+    trace->exits = exits;
+    trace->function = m_tcgLLVMContext->generateTrace(
+            &tbs[0], &exits[0], tbs.size());
+
+    for(unsigned i = 1; i < tbs.size(); ++i) {
+        trace->s2e_tbs.push_back(tbs[i]->s2e_tb);
+        tbs[i]->s2e_tb->refCount += 1;
+    }
+
+    ++stats::translationBlockTraces;
+
+    m_s2e->getDebugStream() << "Built trace of " << std::dec << tbs.size()
+            << " blocks at pc 0x" << std::hex << tbs[0]->pc << std::endl;
+
+    return trace;
+}
+
 uintptr_t S2EExecutor::executeTranslationBlockConcrete(S2EExecutionState *state,
                                                        TranslationBlock *tb)
 {
@@ -1768,6 +2076,7 @@ static inline void s2e_tb_reset_jump(TranslationBlock *tb, unsigned int n)
         /* suppress the jump to next tb in generated code */
         tb_set_jmp_target(tb, n, (uintptr_t)(tb->tc_ptr + tb->tb_next_offset[n]));
         tb->s2e_tb_next[n] = NULL;
+        tcg_llvm_runtime.tb_unlink_count++;
     }
 }
 
@@ -1835,6 +2144,11 @@ uintptr_t S2EExecutor::executeTranslationBlock(
                     /* TB reads symbolic variables */
                     executeKlee = true;
 
+                    if(smask & (tb->reg_rmask | tb->reg_wmask))
+                        ++stats::translationBlocksKleeRegisters;
+                    if(tb->helper_accesses_mem & 4)
+                        ++stats::translationBlocksKleeHelpers;
+
                 } else {
                     s2e_tb_reset_jump_smask(tb, 0, smask);
                     s2e_tb_reset_jump_smask(tb, 1, smask);
@@ -1964,6 +2278,67 @@ void S2EExecutor::deleteState(klee::ExecutionState *state)
     m_deletedStates.push_back(static_cast<S2EExecutionState*>(state));
 }
 
+/**
+ *  Rebalances work between processes. When an idle process requested
+ *  work, fork and keep one half of the states in each process.
+ *  Unlike doProcessFork, this splits all the states of the process,
+ *  not only the ones that were just forked.
+ */
+void S2EExecutor::shareStatesWithIdleProcess()
+{
+    m_s2e->setCurrentProcessStateCount(states.size());
+
+    if (states.size() < std::max(2u, (unsigned) WorkStealingMinStates)) {
+        return;
+    }
+
+    //Leave the requests to the processes that have more states than us
+    unsigned processCount = m_s2e->getCurrentProcessCount();
+    if (processCount > 1 && states.size() * processCount < m_s2e->getTotalStateCount()) {
+        return;
+    }
+
+    if (!m_s2e->takeWorkRequest()) {
+        return;
+    }
+
+    std::vector<S2EExecutionState*> allStates;
+    foreach2(it, states.begin(), states.end()) {
+        allStates.push_back(static_cast<S2EExecutionState*>(*it));
+    }
+
+    unsigned splitIndex = allStates.size() / 2;
+    unsigned parentId = m_s2e->getCurrentProcessIndex();
+
+    m_s2e->getCorePlugin()->onProcessFork.emit(true, false, -1);
+    int child = m_s2e->fork();
+    if (child < 0) {
+        //No free slot yet (the idle process may not have exited),
+        //leave the request for the next selection.
+        m_s2e->getCorePlugin()->onProcessFork.emit(false, false, -1);
+        m_s2e->requestWork();
+        return;
+    }
+
+    if (child == 1) {
+        m_s2e->getDebugStream() << "Took " << allStates.size() - splitIndex
+                << " states from process " << parentId << std::endl;
+        m_s2e->getCorePlugin()->onProcessFork.emit(false, true, parentId);
+        for (unsigned i = 0; i < splitIndex; ++i) {
+            terminateStateAtFork(*allStates[i]);
+        }
+    } else {
+        m_s2e->getDebugStream() << "Gave " << allStates.size() - splitIndex
+                << " states to an idle process" << std::endl;
+        m_s2e->getCorePlugin()->onProcessFork.emit(false, false, parentId);
+        for (unsigned i = splitIndex; i < allStates.size(); ++i) {
+            terminateStateAtFork(*allStates[i]);
+        }
+    }
+
+    m_s2e->getCorePlugin()->onProcessForkComplete.emit(child == 1);
+}
+
 void S2EExecutor::doProcessFork(S2EExecutionState *originalState,
                                 const vector<S2EExecutionState*>& newStates)
 {
@@ -2090,6 +2465,14 @@ void S2EExecutor::doStateFork(S2EExecutionState *originalState,
                     continue;
 
                 const ObjectState *os = newState->addressSpace.findObject(mo);
+
+                /* Keep sharing the ObjectState with the parent if it is
+                   already up to date, avoiding a copy-on-write */
+                if(SwitchChangedObjectsOnly &&
+                        !memcmp(os->getConcreteStore(), (uint8_t*) mo->address, mo->size)) {
+                    continue;
+                }
+
                 ObjectState *wos = newState->addressSpace.getWriteable(mo, os);
                 uint8_t *store = wos->getConcreteStore();
 
@@ -2353,13 +2736,26 @@ void S2EExecutor::unrefS2ETb(S2ETranslationBlock* s2e_tb)
 {
     if(s2e_tb && 0 == --s2e_tb->refCount) {
         if(s2e_tb->llvm_function && !KeepLLVMFunctions) {
-            S2EExternalDispatcher *s2eDispatcher = static_cast<S2EExternalDispatcher*>(externalDispatcher);
-            s2eDispatcher->removeFunction(s2e_tb->llvm_function);
-            kmodule->removeFunction(s2e_tb->llvm_function);
+            releaseLLVMFunction(s2e_tb->llvm_function);
+        }
+        if(s2e_tb->trace) {
+            if(!KeepLLVMFunctions) {
+                releaseLLVMFunction(s2e_tb->trace->function);
+            }
+            foreach(S2ETranslationBlock *member, s2e_tb->trace->s2e_tbs) {
+                unrefS2ETb(member);
+            }
+            delete s2e_tb->trace;
         }
         foreach(void* s, s2e_tb->executionSignals) {
             delete static_cast<ExecutionSignal*>(s);
         }
+        delete s2e_tb;
+
+        if(m_tcgLLVMContext->getDeadFunctionCount() >=
+                CompactLLVMModuleThreshold) {
+            compactLLVMModule();
+        }
     }
 }
 
@@ -2580,6 +2976,10 @@ void s2e_tb_alloc(S2E*, TranslationBlock *tb)
     tb->s2e_tb = new S2ETranslationBlock;
     tb->s2e_tb->llvm_function = NULL;
     tb->s2e_tb->refCount = 1;
+    tb->s2e_tb->executionCountKlee = 0;
+    tb->s2e_tb->chainCount[0] = 0;
+    tb->s2e_tb->chainCount[1] = 0;
+    tb->s2e_tb->trace = NULL;
 
     /* Push one copy of a signal to use it as a cache */
     tb->s2e_tb->executionSignals.push_back(new s2e::ExecutionSignal);
@@ -2591,6 +2991,17 @@ void s2e_tb_alloc(S2E*, TranslationBlock *tb)
 void s2e_set_tb_function(S2E*, TranslationBlock *tb)
 {
     tb->s2e_tb->llvm_function = tb->llvm_function;
+
+    ++stats::translationBlocksLLVM;
+    if(tb->tcg_llvm_context->isLastTbFromCache()) {
+        ++stats::translationBlocksLLVMCached;
+        return;
+    }
+
+    unsigned generated, optimized;
+    tb->tcg_llvm_context->getLastTbInstructionCount(&generated, &optimized);
+    stats::llvmInstructionsGenerated += generated;
+    stats::llvmInstructionsOptimized += optimized;
 }
 
 void s2e_tb_free(S2E* s2e, TranslationBlock *tb)
@@ -58,6 +58,7 @@ namespace s2e {
 class S2E;
 class S2EExecutionState;
 class S2ETranslationBlock;
+struct S2ETrace;
 
 class CpuExitException
 {
@@ -121,6 +122,10 @@ public:
 
     void flushTb();
 
+    TCGLLVMContext* getTcgLLVMContext() const {
+        return m_tcgLLVMContext;
+    }
+
     /** Create initial execution state */
     S2EExecutionState* createInitialState();
 
@@ -241,6 +246,11 @@ protected:
                                          klee::KInstruction* target,
                                          std::vector<klee::ref<klee::Expr> > &args);
 
+    static void handlerTraceNext(klee::Executor* executor,
+                                         klee::ExecutionState* state,
+                                         klee::KInstruction* target,
+                                         std::vector<klee::ref<klee::Expr> > &args);
+
     void prepareFunctionExecution(S2EExecutionState *state,
                            llvm::Function* function,
                            const std::vector<klee::ref<klee::Expr> >& args);
@@ -249,6 +259,18 @@ protected:
     uintptr_t executeTranslationBlockKlee(S2EExecutionState *state,
                                           TranslationBlock *tb);
 
+    void updateLastS2ETb(S2EExecutionState *state, TranslationBlock *tb);
+
+    /** Returns the trace starting at tb if it is still linked,
+        building it when tb gets hot */
+    S2ETrace* getTrace(S2EExecutionState *state, TranslationBlock *tb);
+    S2ETrace* buildTrace(TranslationBlock *tb);
+
+    /** Drops every reference to the function of a deleted translation
+        block or trace, so that compactLLVMModule() can erase it */
+    void releaseLLVMFunction(llvm::Function *f);
+    void compactLLVMModule();
+
     uintptr_t executeTranslationBlockConcrete(S2EExecutionState *state,
                                               TranslationBlock *tb);
 
@@ -264,6 +286,8 @@ protected:
     void doProcessFork(S2EExecutionState *originalState,
                        const std::vector<S2EExecutionState*>& newStates);
 
+    void shareStatesWithIdleProcess();
+
 
     /** Copy concrete values to their proper location, concretizing
         if necessary (most importantly it will concretize CPU registers.
@@ -317,6 +341,30 @@ struct S2ETranslationBlock
         when this translation block will be flushed.
         XXX: how could we avoid using void* here ? */
     std::vector<void*> executionSignals;
+
+    /** Number of symbolic executions starting at this block */
+    unsigned executionCountKlee;
+
+    /** Number of times symbolic execution followed s2e_tb_next[i] */
+    unsigned chainCount[2];
+
+    /** Trace of hot blocks starting at this one, or NULL */
+    S2ETrace *trace;
+};
+
+/** Chain of translation blocks compiled into a single LLVM function */
+struct S2ETrace
+{
+    llvm::Function *function;
+
+    /** Blocks of the trace, tbs[i + 1] is reached from tbs[i]
+        through s2e_tb_next[exits[i]] */
+    std::vector<TranslationBlock*> tbs;
+    std::vector<unsigned> exits;
+
+    /** S2ETranslationBlocks of tbs[1..n], referenced by the trace
+        because their execution signals are used by its code */
+    std::vector<S2ETranslationBlock*> s2e_tbs;
 };
 
 } // namespace s2e
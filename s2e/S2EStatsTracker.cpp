@@ -34,6 +34,9 @@
  *
  */
 
+// XXX: qemu stuff should be included before anything from KLEE or LLVM !
+#include <tcg-llvm.h>
+
 #include "S2EStatsTracker.h"
 
 #include <s2e/S2EExecutor.h>
@@ -67,6 +70,8 @@ namespace stats {
     Statistic translationBlocks("TranslationBlocks", "TBs");
     Statistic translationBlocksConcrete("TranslationBlocksConcrete", "TBsConcrete");
     Statistic translationBlocksKlee("TranslationBlocksKlee", "TBsKlee");
+    Statistic translationBlocksKleeRegisters("TranslationBlocksKleeRegisters", "TBsKleeRegs");
+    Statistic translationBlocksKleeHelpers("TranslationBlocksKleeHelpers", "TBsKleeHelpers");
 
     Statistic cpuInstructions("CpuInstructions", "CpuI");
     Statistic cpuInstructionsConcrete("CpuInstructionsConcrete", "CpuIConcrete");
@@ -74,6 +79,16 @@ namespace stats {
 
     Statistic concreteModeTime("ConcreteModeTime", "ConcModeTime");
     Statistic symbolicModeTime("SymbolicModeTime", "SymbModeTime");
+
+    Statistic stateSwitches("StateSwitches", "StSw");
+    Statistic stateSwitchBytesCopied("StateSwitchBytesCopied", "StSwBytes");
+
+    Statistic translationBlocksLLVM("TranslationBlocksLLVM", "TBsLLVM");
+    Statistic translationBlocksLLVMCached("TranslationBlocksLLVMCached", "TBsLLVMCached");
+    Statistic llvmInstructionsGenerated("LLVMInstructionsGenerated", "LLVMIGen");
+    Statistic llvmInstructionsOptimized("LLVMInstructionsOptimized", "LLVMIOpt");
+    Statistic translationBlockTraces("TranslationBlockTraces", "TBTraces");
+    Statistic llvmFunctionsErased("LLVMFunctionsErased", "LLVMFErased");
 } // namespace stats
 } // namespace klee
 
@@ -152,11 +167,25 @@ void S2EStatsTracker::writeStatsHeader() {
              << "'TranslationBlocks',"
              << "'TranslationBlocksConcrete',"
              << "'TranslationBlocksKlee',"
+             << "'TranslationBlocksKleeRegisters',"
+             << "'TranslationBlocksKleeHelpers',"
              << "'CpuInstructions',"
              << "'CpuInstructionsConcrete',"
              << "'CpuInstructionsKlee',"
              << "'ConcreteModeTime',"
              << "'SymbolicModeTime',"
+             << "'StateSwitches',"
+             << "'StateSwitchBytesCopied',"
+             << "'TranslationBlocksLLVM',"
+             << "'TranslationBlocksLLVMCached',"
+             << "'LLVMInstructionsGenerated',"
+             << "'LLVMInstructionsOptimized',"
+             << "'TranslationBlockTraces',"
+             << "'LLVMFunctionsLive',"
+             << "'LLVMFunctionsDead',"
+             << "'LLVMFunctionsErased',"
+             << "'JITBytesLive',"
+             << "'JITBytesFreed',"
              << "'UserTime',"
              << "'WallTime',"
              << "'QueryTime',"
@@ -170,6 +199,9 @@ void S2EStatsTracker::writeStatsHeader() {
 }
 
 void S2EStatsTracker::writeStatsLine() {
+  TCGLLVMContext *tcgLLVMContext =
+          static_cast<S2EExecutor&>(executor).getTcgLLVMContext();
+
   *statsFile //<< "(" << stats::instructions
              //<< "," << fullBranches
              //<< "," << partialBranches
@@ -183,11 +215,25 @@ void S2EStatsTracker::writeStatsLine() {
              << "," << stats::translationBlocks
              << "," << stats::translationBlocksConcrete
              << "," << stats::translationBlocksKlee
+             << "," << stats::translationBlocksKleeRegisters
+             << "," << stats::translationBlocksKleeHelpers
              << "," << stats::cpuInstructions
              << "," << stats::cpuInstructionsConcrete
              << "," << stats::cpuInstructionsKlee
              << "," << stats::concreteModeTime / 1000000.
              << "," << stats::symbolicModeTime / 1000000.
+             << "," << stats::stateSwitches
+             << "," << stats::stateSwitchBytesCopied
+             << "," << stats::translationBlocksLLVM
+             << "," << stats::translationBlocksLLVMCached
+             << "," << stats::llvmInstructionsGenerated
+             << "," << stats::llvmInstructionsOptimized
+             << "," << stats::translationBlockTraces
+             << "," << tcgLLVMContext->getLiveFunctionCount()
+             << "," << tcgLLVMContext->getDeadFunctionCount()
+             << "," << stats::llvmFunctionsErased
+             << "," << tcgLLVMContext->getLiveJitBytes()
+             << "," << tcgLLVMContext->getFreedJitBytes()
              << "," << util::getUserTime()
              << "," << elapsed()
              << "," << stats::queryTime / 1000000.
@@ -45,6 +45,8 @@ namespace stats {
     extern klee::Statistic translationBlocks;
     extern klee::Statistic translationBlocksConcrete;
     extern klee::Statistic translationBlocksKlee;
+    extern klee::Statistic translationBlocksKleeRegisters;
+    extern klee::Statistic translationBlocksKleeHelpers;
 
     extern klee::Statistic cpuInstructions;
     extern klee::Statistic cpuInstructionsConcrete;
@@ -52,6 +54,16 @@ namespace stats {
 
     extern klee::Statistic concreteModeTime;
     extern klee::Statistic symbolicModeTime;
+
+    extern klee::Statistic stateSwitches;
+    extern klee::Statistic stateSwitchBytesCopied;
+
+    extern klee::Statistic translationBlocksLLVM;
+    extern klee::Statistic translationBlocksLLVMCached;
+    extern klee::Statistic llvmInstructionsGenerated;
+    extern klee::Statistic llvmInstructionsOptimized;
+    extern klee::Statistic translationBlockTraces;
+    extern klee::Statistic llvmFunctionsErased;
 } // namespace stats
 } // namespace klee
 
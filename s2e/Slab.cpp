@@ -36,9 +36,9 @@
 
 #include <iostream>
 #include <exception>
+#include <algorithm>
 
 //#define DEBUG_ALLOC
-//#define TESTSUITE_ALLOC
 
 #include "Slab.h"
 
@@ -47,6 +47,7 @@
 #include <windows.h>
 #else
 #include <stdlib.h>
+#include <sched.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -57,47 +58,143 @@
 namespace s2e
 {
 
-PageAllocator::PageAllocator()
+RegionTable::RegionTable()
 {
+    for (unsigned i=0; i<(1 << L1_BITS); ++i) {
+        m_level1[i] = NULL;
+    }
+}
 
+RegionTable::~RegionTable()
+{
+    for (unsigned i=0; i<(1 << L1_BITS); ++i) {
+        ::free(m_level1[i]);
+    }
 }
 
-PageAllocator::~PageAllocator()
+void RegionTable::set(uintptr_t region, bool present)
 {
-    RegionMap::iterator it;
+    assert((region & (REGION_SIZE - 1)) == 0);
 
-    for (it = m_regions.begin(); it != m_regions.end(); ++it) {
-        osFree((*it).first);
+    uint64_t r = (uint64_t) region >> REGION_BITS;
+    uint64_t l1 = r >> L2_BITS;
+    uint64_t l2 = r & ((1 << L2_BITS) - 1);
+    assert(l1 < (1 << L1_BITS));
+
+    //Must not go through operator new, we are the allocator
+    if (!m_level1[l1]) {
+        m_level1[l1] = (uint64_t*) calloc((1 << L2_BITS) / 64, sizeof(uint64_t));
+        assert(m_level1[l1]);
     }
 
-    RegionSet::iterator sit;
-    for (sit = m_busyRegions.begin(); sit != m_busyRegions.end(); ++sit) {
-        osFree((*sit));
+    if (present) {
+        m_level1[l1][l2 / 64] |= 1ULL << (l2 % 64);
+    } else {
+        m_level1[l1][l2 / 64] &= ~(1ULL << (l2 % 64));
     }
+}
 
+PageAllocator::PageAllocator(bool hugePages)
+{
+    m_hugePages = hugePages;
+    m_usedPages = 0;
+    m_peakUsedPages = 0;
 }
 
-uintptr_t PageAllocator::osAlloc()
+PageAllocator::~PageAllocator()
+{
+    std::vector<uintptr_t>::iterator it;
+    for (it = m_arenas.begin(); it != m_arenas.end(); ++it) {
+        osFreeArena(*it);
+    }
+}
+
+//Arenas are aligned on the region size so that each region
+//maps to exactly one entry of the region table.
+uintptr_t PageAllocator::osAllocArena()
 {
 #ifdef _WIN32
-    return(uintptr_t) VirtualAlloc(NULL, getRegionSize(), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
-#elif defined(__APPLE__)
-    return (uintptr_t) mmap(NULL, getRegionSize(), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+    uintptr_t base = (uintptr_t) VirtualAlloc(NULL, ARENA_SIZE + REGION_SIZE, MEM_RESERVE, PAGE_READWRITE);
+    if (!base) {
+        return 0;
+    }
+    uintptr_t arena = (base + REGION_SIZE - 1) & ~(uintptr_t)(REGION_SIZE - 1);
+    if (!VirtualAlloc((PVOID)arena, ARENA_SIZE, MEM_COMMIT, PAGE_READWRITE)) {
+        return 0;
+    }
+    return arena;
 #else
-    return (uintptr_t) mmap(NULL, getRegionSize(), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+#if defined(__APPLE__)
+    int flags = MAP_PRIVATE|MAP_ANON;
+#else
+    int flags = MAP_PRIVATE|MAP_ANONYMOUS;
+#endif
+    void *p = mmap(NULL, ARENA_SIZE + REGION_SIZE, PROT_READ|PROT_WRITE, flags, -1, 0);
+    if (p == MAP_FAILED) {
+        return 0;
+    }
+
+    uintptr_t base = (uintptr_t) p;
+    uintptr_t arena = (base + REGION_SIZE - 1) & ~(uintptr_t)(REGION_SIZE - 1);
+    uintptr_t end = base + ARENA_SIZE + REGION_SIZE;
+
+    if (arena > base) {
+        munmap((void*)base, arena - base);
+    }
+    if (end > arena + ARENA_SIZE) {
+        munmap((void*)(arena + ARENA_SIZE), end - (arena + ARENA_SIZE));
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (m_hugePages) {
+        madvise((void*)arena, ARENA_SIZE, MADV_HUGEPAGE);
+    }
+#endif
+
+    return arena;
 #endif
 }
 
-void PageAllocator::osFree(uintptr_t region)
+void PageAllocator::osFreeArena(uintptr_t arena)
 {
 #ifdef _WIN32
-    BOOL b = VirtualFree((PVOID)region, 0, MEM_RELEASE);
-    assert(b);
+    //The whole reservation is released by the OS on exit
+    VirtualFree((PVOID)arena, ARENA_SIZE, MEM_DECOMMIT);
 #else
-    munmap((void*)region, getRegionSize());
+    munmap((void*)arena, ARENA_SIZE);
 #endif
 }
 
+uintptr_t PageAllocator::osAlloc()
+{
+    if (m_freeRegions.empty()) {
+        uintptr_t arena = osAllocArena();
+        if (!arena) {
+            return 0;
+        }
+
+        m_arenas.push_back(arena);
+        for (uintptr_t r = arena + ARENA_SIZE; r > arena; ) {
+            r -= REGION_SIZE;
+            m_freeRegions.push_back(r);
+            m_regionTable.set(r, true);
+        }
+    }
+
+    uintptr_t region = m_freeRegions.back();
+    m_freeRegions.pop_back();
+    return region;
+}
+
+//Regions go back to the arena, only their physical pages are released
+void PageAllocator::osFree(uintptr_t region)
+{
+#if !defined(_WIN32) && defined(MADV_DONTNEED)
+    madvise((void*)region, getRegionSize(), MADV_DONTNEED);
+#endif
+    m_freeRegions.push_back(region);
+}
+
 uintptr_t PageAllocator::allocPage()
 {
     RegionMap::iterator it = m_regions.begin();
@@ -112,6 +209,10 @@ uintptr_t PageAllocator::allocPage()
 #endif
 
         m_regions[region] = ((uint64_t)-1) & ~1LL;
+
+        if (++m_usedPages > m_peakUsedPages) {
+            m_peakUsedPages = m_usedPages;
+        }
         return region;
     }
 
@@ -134,12 +235,17 @@ uintptr_t PageAllocator::allocPage()
 
     uintptr_t ret = reg + index * getPageSize();
     memset((void*)ret, 0xAA, getPageSize());
+
+    if (++m_usedPages > m_peakUsedPages) {
+        m_peakUsedPages = m_usedPages;
+    }
     return ret;
 }
 
 void PageAllocator::freePage(uintptr_t page)
 {
     memset((void*)page, 0xBB, getPageSize());
+    --m_usedPages;
 
     RegionMap::iterator it = m_regions.find(page);
     if (it == m_regions.end()) {
@@ -174,33 +280,6 @@ void PageAllocator::freePage(uintptr_t page)
     return;
 }
 
-//XXX: this needs to be seriously optimized
-bool PageAllocator::belongsToUs(uintptr_t addr) const
-{
-    RegionMap::const_iterator it;
-    RegionSet::const_iterator sit;
-    bool inreg = false;
-
-    for(it = m_regions.begin(); it != m_regions.end(); ++it) {
-        uintptr_t a = (*it).first;
-        if (addr >= a && addr < a + REGION_SIZE) {
-            inreg = true;
-            break;
-        }
-    }
-
-    for(sit = m_busyRegions.begin(); sit != m_busyRegions.end(); ++sit) {
-        uintptr_t a = (*sit);
-        if (addr >= a && addr < a + REGION_SIZE) {
-            inreg = true;
-            break;
-        }
-    }
-
-    return inreg;
-}
-
-
 BlockAllocator::BlockAllocator(PageAllocator *pa, unsigned blockSizePo2, uint8_t magic)
 {
     list_init_head(&m_totallyFreeList);
@@ -214,6 +293,8 @@ BlockAllocator::BlockAllocator(PageAllocator *pa, unsigned blockSizePo2, uint8_t
     m_freeBlocksCount = 0;
 
     m_allocatedBlocksCount = 0;
+    m_peakAllocatedBlocksCount = 0;
+    m_pagesCount = 0;
 
     m_pa = pa;
 
@@ -239,6 +320,7 @@ uintptr_t BlockAllocator::expand()
 
     list_insert_tail(&m_totallyFreeList, &hdr->link);
 
+    m_pagesCount++;
     m_freePagesCount++;
     m_freeBlocksCount += m_blocksPerPage;
     return newPage;
@@ -256,6 +338,7 @@ void BlockAllocator::shrink()
     entry = list_remove_tail(&m_totallyFreeList);
     page = containing_record(entry, BlockAllocatorHdr, link);
     m_pa->freePage((uintptr_t)page);
+    m_pagesCount--;
     m_freePagesCount--;
     m_freeBlocksCount -= m_blocksPerPage;
 }
@@ -302,6 +385,9 @@ uintptr_t BlockAllocator::alloc()
     }
 
     m_allocatedBlocksCount++;
+    if (m_allocatedBlocksCount > m_peakAllocatedBlocksCount) {
+        m_peakAllocatedBlocksCount = m_allocatedBlocksCount;
+    }
 
     uintptr_t ret = ((uintptr_t)page) + sizeof(BlockAllocatorHdr) + fb * m_blockSize;
     memset((void*)ret, 0xEB, m_blockSize);
@@ -340,30 +426,59 @@ void BlockAllocator::free(uintptr_t b)
 
 }
 
-SlabAllocator::SlabAllocator(unsigned minPo2, unsigned maxPo2)
+SlabAllocator::SlabAllocator(unsigned minPo2, unsigned maxPo2, bool hugePages)
 {
     assert(minPo2 <= maxPo2);
 
     m_minPo2 = minPo2;
     m_maxPo2 = maxPo2;
+    m_lock = 0;
+
+    m_pa = new PageAllocator(hugePages);
 
-    m_pa = new PageAllocator();
+    assert(maxPo2 <= MAX_BLOCK_PO2);
 
-    m_bas = new BlockAllocator*[m_maxPo2 - m_minPo2];
+    m_bas = new BlockAllocator*[m_maxPo2 - m_minPo2 + 1];
+    m_magazines = new Magazine[m_maxPo2 - m_minPo2 + 1];
 
     for (unsigned i=0; i<=(m_maxPo2 - m_minPo2); ++i) {
         m_bas[i] = new BlockAllocator(m_pa, i + m_minPo2, i + m_minPo2);
+        m_magazines[i].count = 0;
     }
 }
 
 SlabAllocator::~SlabAllocator()
 {
+    delete [] m_magazines;
     delete [] m_bas;
     delete m_pa;
 }
 
+void SlabAllocator::lock() const
+{
+    //Contention is rare, only helper threads compete with the main one
+    while (__sync_lock_test_and_set(&m_lock, 1)) {
+        while (m_lock) {
+#ifdef _WIN32
+            Sleep(0);
+#else
+            sched_yield();
+#endif
+        }
+    }
+}
+
+void SlabAllocator::unlock() const
+{
+    __sync_lock_release(&m_lock);
+}
+
 BlockAllocator *SlabAllocator::getSlab(uintptr_t addr) const
 {
+    if (!m_pa->belongsToUs(addr)) {
+        return NULL;
+    }
+
     //read the magic number
     uintptr_t bhdr = addr & ~(m_pa->getPageSize()-1);
     const BlockAllocatorHdr *hdr = (const BlockAllocatorHdr*)bhdr;
@@ -383,21 +498,15 @@ BlockAllocator *SlabAllocator::getSlab(uintptr_t addr) const
 
 unsigned SlabAllocator::log(size_t size) const
 {
-    if (size  >= 4 && size <= 8) {
-        return 3;
-    }else if (size  >= 9 && size <= 16) {
-        return 4;
-    }else if (size  >= 17 && size <= 32) {
-        return 5;
-    }else if (size  >= 33 && size <= 64) {
-        return 6;
-    }else if (size  >= 65 && size <= 128) {
-        return 7;
-    }else if (size  >= 129 && size <= 256) {
-        return 8;
+    if (size > (1u << MAX_BLOCK_PO2)) {
+        return 0;
     }
 
-    return 0;
+    unsigned po2 = 3;
+    while ((1u << po2) < size) {
+        ++po2;
+    }
+    return po2;
 }
 
 uintptr_t SlabAllocator::alloc(size_t size)
@@ -407,8 +516,21 @@ uintptr_t SlabAllocator::alloc(size_t size)
         return 0;
     }
 
+    lock();
+
+    Magazine &mag = m_magazines[i - m_minPo2];
+    if (mag.count > 0) {
+        uintptr_t ret = mag.blocks[--mag.count];
+        unlock();
+
+        //Poisoned like the blocks that come from the block allocator
+        memset((void*)ret, 0xEB, 1 << i);
+        return ret;
+    }
+
     uintptr_t ret = m_bas[i - m_minPo2]->alloc();
 
+    unlock();
     return ret;
 }
 
@@ -419,9 +541,22 @@ bool SlabAllocator::free(uintptr_t addr)
         //std::cerr << "Invalid addr " << std::hex << addr << std::dec << std::endl;
         return false;
     }
-    assert(m_pa->belongsToUs(addr));
 
-    b->free(addr);
+    //The block still belongs to the caller, poison it outside the lock
+    memset((void*)addr, 0xDB, b->getBlockSize());
+
+    unsigned i = log(b->getBlockSize());
+
+    lock();
+
+    Magazine &mag = m_magazines[i - m_minPo2];
+    if (mag.count < MAGAZINE_SIZE) {
+        mag.blocks[mag.count++] = addr;
+    } else {
+        b->free(addr);
+    }
+
+    unlock();
     return true;
 }
 
@@ -430,16 +565,175 @@ bool SlabAllocator::isValid(uintptr_t addr) const
     return getSlab(addr) != NULL;
 }
 
+//Checks that the blocks of the given size do not overlap
+static bool checkBlocks(std::vector<uintptr_t> blocks, uintptr_t size)
+{
+    std::sort(blocks.begin(), blocks.end());
+    for (unsigned i=0; i<blocks.size(); ++i) {
+        if (!blocks[i]) {
+            std::cerr << "SlabAllocator: allocation of size " << std::dec <<
+                    size << " failed" << std::endl;
+            return false;
+        }
+        if (i > 0 && blocks[i-1] + size > blocks[i]) {
+            std::cerr << "SlabAllocator: blocks " << std::hex << blocks[i-1] <<
+                    " and " << blocks[i] << " of size " << std::dec << size <<
+                    " overlap" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+//Allocates pages from three regions and checks that they are distinct
+//and keep what was written to them
+static bool testPageAllocator()
+{
+    PageAllocator pa;
+    std::vector<uintptr_t> pages;
+    unsigned count = 3 * REGION_SIZE / pa.getPageSize();
+
+    for (unsigned i=0; i<count; ++i) {
+        uintptr_t p = pa.allocPage();
+        if (p) {
+            *(uint64_t*) p = i;
+        }
+        pages.push_back(p);
+    }
+
+    bool ok = checkBlocks(pages, pa.getPageSize());
+    for (unsigned i=0; ok && i<count; ++i) {
+        if ((pages[i] & (pa.getPageSize() - 1)) || !pa.belongsToUs(pages[i]) ||
+            *(uint64_t*) pages[i] != i) {
+            std::cerr << "SlabAllocator: page " << std::hex << pages[i] <<
+                    std::dec << " is corrupted" << std::endl;
+            ok = false;
+        }
+    }
+
+    for (unsigned i=0; ok && i<count; ++i) {
+        pa.freePage(pages[i]);
+    }
+    return ok && pa.getUsedPages() == 0;
+}
+
+//Same for the blocks of one size class, over three pages
+static bool testBlockAllocator(unsigned blockSizePo2)
+{
+    PageAllocator pa;
+    BlockAllocator ba(&pa, blockSizePo2);
+    std::vector<uintptr_t> blocks;
+    unsigned count = 3 * ba.getBlocksPerPage();
+
+    for (unsigned i=0; i<count; ++i) {
+        uintptr_t b = ba.alloc();
+        if (b) {
+            memset((void*) b, i, ba.getBlockSize());
+        }
+        blocks.push_back(b);
+    }
+
+    bool ok = checkBlocks(blocks, ba.getBlockSize());
+    for (unsigned i=0; ok && i<count; ++i) {
+        const uint8_t *b = (const uint8_t*) blocks[i];
+        if (b[0] != (uint8_t) i || b[ba.getBlockSize() - 1] != (uint8_t) i) {
+            std::cerr << "SlabAllocator: block " << std::hex << blocks[i] <<
+                    std::dec << " is corrupted" << std::endl;
+            ok = false;
+        }
+    }
+
+    for (unsigned i=0; ok && i<count; ++i) {
+        ba.free(blocks[i]);
+    }
+    return ok && ba.getAllocatedBlocksCount() == 0;
+}
+
+bool SlabAllocator::selfTest()
+{
+    if (!testPageAllocator()) {
+        return false;
+    }
+
+    for (unsigned i=m_minPo2; i<=m_maxPo2; ++i) {
+        if (!testBlockAllocator(i)) {
+            return false;
+        }
+    }
+
+    //The second round gets its first blocks from the magazines
+    for (unsigned round=0; round<2; ++round) {
+        for (unsigned i=m_minPo2; i<=m_maxPo2; ++i) {
+            uintptr_t size = 1 << i;
+            unsigned count = 2 * m_bas[i - m_minPo2]->getBlocksPerPage() + 1;
+
+            std::vector<uintptr_t> blocks;
+            for (unsigned j=0; j<count; ++j) {
+                blocks.push_back(alloc(size));
+            }
+
+            //Aliased blocks cannot be freed twice, the allocator must be
+            //thrown away in that case anyway
+            if (!checkBlocks(blocks, size)) {
+                return false;
+            }
+
+            for (unsigned j=0; j<blocks.size(); ++j) {
+                free(blocks[j]);
+            }
+        }
+    }
+
+    return true;
+}
+
 void SlabAllocator::printStats(std::ostream &os) const
 {
     uint64_t totalSize = 0;
+    uint64_t peakSize = 0;
+    uint64_t slabSize = 0;
+
+    //Writing to os may allocate, take a snapshot under the lock first
+    struct {
+        uint64_t allocated, cached, peak, pages;
+    } classes[MAX_BLOCK_PO2 + 1];
+
+    lock();
+    for (unsigned i=m_minPo2; i<= m_maxPo2; ++i) {
+        const BlockAllocator *ba = m_bas[i-m_minPo2];
+        classes[i].cached = m_magazines[i-m_minPo2].count;
+        classes[i].allocated = ba->getAllocatedBlocksCount() - classes[i].cached;
+        classes[i].peak = ba->getPeakAllocatedBlocksCount();
+        classes[i].pages = ba->getPagesCount();
+    }
+    uint64_t usedPages = m_pa->getUsedPages();
+    uint64_t peakUsedPages = m_pa->getPeakUsedPages();
+    uint64_t mappedBytes = m_pa->getMappedBytes();
+    unlock();
 
     os << std::dec << "Allocator statistics" << std::endl;
     for (unsigned i=m_minPo2; i<= m_maxPo2; ++i) {
-        totalSize += (1<<i) * m_bas[i-m_minPo2]->getAllocatedBlocksCount();
-        os << "[" << (1<<i) <<  "] allocatedBlocks:" << m_bas[i-m_minPo2]->getAllocatedBlocksCount() << std::endl;
+        totalSize += (1<<i) * classes[i].allocated;
+        peakSize += (1<<i) * classes[i].peak;
+        slabSize += classes[i].pages * m_pa->getPageSize();
+
+        os << "[" << (1<<i) <<  "] allocatedBlocks:" << classes[i].allocated <<
+              " cachedBlocks:" << classes[i].cached <<
+              " peakBlocks:" << classes[i].peak <<
+              " pages:" << classes[i].pages << std::endl;
     }
     os << "Total size:" << totalSize << std::endl;
+    os << "Peak size:" << peakSize << std::endl;
+
+    //Bytes held in slab pages that are not allocated to anybody,
+    //including page headers and block rounding.
+    if (slabSize) {
+        os << "Fragmentation:" << (100 * (slabSize - totalSize) / slabSize) << "%" << std::endl;
+    }
+
+    os << "Used pages:" << usedPages <<
+          " peak:" << peakUsedPages <<
+          " mapped bytes:" << mappedBytes << std::endl;
 }
 
 static SlabAllocator *s_slab = NULL;
@@ -457,17 +751,28 @@ void slab_print_stats(std::ostream &os)
 }
 
 extern "C" {
-void slab_init()
+int slab_init(int use_huge_pages)
 {
     if (s2e::s_slab) {
-        return;
+        return 1;
     }
 
-    s2e::s_slab = new s2e::SlabAllocator(3, 8);
+    //Up to 1KB, which covers ObjectStates and the concrete
+    //stores of RAM objects.
+    s2e::SlabAllocator *slab = new s2e::SlabAllocator(3, s2e::SlabAllocator::MAX_BLOCK_PO2, use_huge_pages);
+    if (!slab->selfTest()) {
+        delete slab;
+        return 0;
+    }
+
+    s2e::s_slab = slab;
+    return 1;
 }
 }
 
-static bool s_inalloc = false;
+//Set while the slab allocator runs, its own allocations go to malloc.
+//Each thread has its own flag, the allocator is shared.
+static __thread bool s_inalloc = false;
 
 void* operator new (size_t size)
 {
@@ -513,107 +818,12 @@ void operator delete (void *p)
     s_inalloc = false;
 }
 
-
-
-
-#ifdef TESTSUITE_ALLOC
-using namespace s2e;
-
-void testPageAllocator()
+void* operator new[] (size_t size)
 {
-    std::set<uintptr_t> allocated;
-
-    PageAllocator a;
-
-    unsigned count=0;
-    uintptr_t p = 0;
-    do {
-        p = a.allocPage();
-        //std::cout << "Page 0x" << std::hex << p << std::dec << std::endl;
-        ++count;
-        if (p) {
-            allocated.insert(p);
-        }
-    }while(p);
-
-    std::cout << "Allocated " << std::dec << count << " pages" << std::endl;
-
-    while(allocated.size() > 0) {
-        a.freePage(*allocated.begin());
-        allocated.erase(*allocated.begin());
-    }
+    return operator new(size);
 }
 
-void testBlockAllocator(unsigned blockSizePo2)
+void operator delete[] (void *p)
 {
-    std::set<uintptr_t> allocated;
-
-    PageAllocator pa;
-    BlockAllocator ba(&pa, blockSizePo2);
-
-
-    unsigned count=0;
-    uintptr_t p = 0;
-
-    do {
-        p = ba.alloc();
-        //std::cout << "Block 0x" << std::hex << p << std::dec << std::endl;
-        ++count;
-
-
-        assert(allocated.find(p) == allocated.end());
-        if (p) {
-            try {
-            allocated.insert(p);
-        }catch(std::exception &e) {
-            break;
-        }
-        }
-    }while(p);
-
-    while(allocated.size() > 0) {
-        ba.free(*allocated.begin());
-        allocated.erase(*allocated.begin());
-    }
-
-    std::cout << "Allocated " << std::dec << count << " blocks" << std::endl;
-
-}
-
-void testRandom(unsigned blockSizePo2)
-{
-
-}
-
-void testMalloc(unsigned blockSizePo2)
-{
-    while(malloc(1<<blockSizePo2))
-        ;
-}
-
-void test()
-{
-    uint8_t *v1 = new uint8_t;
-    uint64_t *v2 = new uint64_t;
-
-    std::cout << "Allocated v1=" << std::hex << (uintptr_t)v1 << std::dec << std::endl;
-    std::cout << "Allocated v2=" << std::hex << (uintptr_t)v2 << std::dec << std::endl;
-}
-
-int main(int argc, char **argv)
-{
-
-    test();
-
-#if 0
-    //testPageAllocator();
-    for (unsigned i=3; i<11; ++i) {
-        if (argc > 2) {
-            testMalloc(i);
-        }else {
-            testBlockAllocator(i);
-        }
-    }
-#endif
+    operator delete(p);
 }
-#endif
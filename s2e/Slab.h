@@ -46,6 +46,7 @@
 #include <map>
 #include <vector>
 #include <set>
+#include <iostream>
 
 #include "machine.h"
 
@@ -117,7 +118,45 @@ static inline list_t* list_remove_tail(list_t* list_head)
 
 
 //Allocates chunks of 256KB from the system
-#define REGION_SIZE (256*1024)
+#define REGION_BITS 18
+#define REGION_SIZE (1 << REGION_BITS)
+
+//Regions are carved out of large arenas mapped at once
+#define ARENA_SIZE (64 * REGION_SIZE)
+
+/**
+ *  Records which regions belong to the allocator, so that checking
+ *  whether an arbitrary address comes from it takes constant time.
+ *  This is a two-level bitmap indexed by region number.
+ */
+class RegionTable
+{
+private:
+    enum {
+        ADDRESS_BITS = 48,
+        L2_BITS = 15,
+        L1_BITS = ADDRESS_BITS - REGION_BITS - L2_BITS
+    };
+
+    uint64_t *m_level1[1 << L1_BITS];
+
+public:
+    RegionTable();
+    ~RegionTable();
+
+    void set(uintptr_t region, bool present);
+
+    inline bool contains(uintptr_t addr) const {
+        uint64_t r = (uint64_t) addr >> REGION_BITS;
+        uint64_t l1 = r >> L2_BITS;
+        uint64_t l2 = r & ((1 << L2_BITS) - 1);
+        if (l1 >= (1 << L1_BITS) || !m_level1[l1]) {
+            return false;
+        }
+        return m_level1[l1][l2 / 64] & (1ULL << (l2 % 64));
+    }
+};
+
 class PageAllocator
 {
 private:
@@ -133,16 +172,27 @@ private:
     RegionMap m_regions;
     RegionSet m_busyRegions;
 
+    RegionTable m_regionTable;
+    std::vector<uintptr_t> m_arenas;
+    std::vector<uintptr_t> m_freeRegions;
+    bool m_hugePages;
+
+    uint64_t m_usedPages;
+    uint64_t m_peakUsedPages;
+
 private:
     inline uintptr_t getRegionSize() const {
         return REGION_SIZE;
     }
 
+    uintptr_t osAllocArena();
+    void osFreeArena(uintptr_t arena);
+
     uintptr_t osAlloc();
     void osFree(uintptr_t region);
 
 public:
-    PageAllocator();
+    PageAllocator(bool hugePages = false);
     ~PageAllocator();
 
     uintptr_t allocPage();
@@ -152,7 +202,21 @@ public:
         return 0x1000;
     }
 
-    bool belongsToUs(uintptr_t addr) const;
+    inline bool belongsToUs(uintptr_t addr) const {
+        return m_regionTable.contains(addr);
+    }
+
+    uint64_t getMappedBytes() const {
+        return m_arenas.size() * (uint64_t) ARENA_SIZE;
+    }
+
+    uint64_t getUsedPages() const {
+        return m_usedPages;
+    }
+
+    uint64_t getPeakUsedPages() const {
+        return m_peakUsedPages;
+    }
 };
 
 
@@ -241,6 +305,8 @@ private:
     uint64_t m_freeBlocksCount;
 
     uint64_t m_allocatedBlocksCount;
+    uint64_t m_peakAllocatedBlocksCount;
+    uint64_t m_pagesCount;
     uint8_t m_magic;
 
 public:
@@ -260,27 +326,69 @@ public:
     uint64_t getAllocatedBlocksCount() const {
         return m_allocatedBlocksCount;
     }
+
+    uint64_t getPeakAllocatedBlocksCount() const {
+        return m_peakAllocatedBlocksCount;
+    }
+
+    uint64_t getPagesCount() const {
+        return m_pagesCount;
+    }
+
+    uintptr_t getBlockSize() const {
+        return m_blockSize;
+    }
+
+    uintptr_t getBlocksPerPage() const {
+        return m_blocksPerPage;
+    }
 };
 
 
 class SlabAllocator
 {
 private:
+    //Recently freed blocks of one size class. They are handed out again
+    //without going through the bitmaps of the block allocator.
+    enum { MAGAZINE_SIZE = 64 };
+    struct Magazine {
+        unsigned count;
+        uintptr_t blocks[MAGAZINE_SIZE];
+    };
+
     PageAllocator *m_pa;
     BlockAllocator **m_bas;
+    Magazine *m_magazines;
 
     unsigned m_minPo2, m_maxPo2;
 
+    //Protects the magazines, the block and the page allocators.
+    //Helper threads (e.g., the execution trace writer) allocate
+    //concurrently with the main thread.
+    mutable volatile int m_lock;
+
+    void lock() const;
+    void unlock() const;
+
     BlockAllocator *getSlab(uintptr_t addr) const;
     unsigned log(size_t s) const;
 public:
-    SlabAllocator(unsigned minPo2, unsigned maxPo2);
+    //Blocks must fit at least twice in a page along with the page header
+    enum { MAX_BLOCK_PO2 = 10 };
+
+    SlabAllocator(unsigned minPo2, unsigned maxPo2, bool hugePages = false);
     ~SlabAllocator();
 
     uintptr_t alloc(size_t s);
     bool free(uintptr_t addr);
     bool isValid(uintptr_t addr) const;
 
+    /** Checks the page and block allocators, then allocates blocks
+        spanning several pages in each size class, twice to go through
+        the magazines, and checks that no two of them overlap.
+        Everything is freed again. */
+    bool selfTest();
+
     void printStats(std::ostream &os) const;
 
     const PageAllocator *getPageAllocator() const {
@@ -288,6 +396,14 @@ public:
     }
 };
 
+void slab_print_stats(std::ostream &os);
+
+}
+
+extern "C" {
+/** Routes operator new and delete to the slab allocator.
+    Returns 0 and leaves them alone if the allocator fails its self test. */
+int slab_init(int use_huge_pages);
 }
 
 
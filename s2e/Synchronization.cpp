@@ -92,6 +92,17 @@ void S2ESynchronizedObjectInternal::release()
 
 }
 
+S2ESharedMemoryInternal::S2ESharedMemoryInternal(unsigned size)
+{
+    m_size = size;
+    m_sharedBuffer = new uint8_t[size];
+}
+
+S2ESharedMemoryInternal::~S2ESharedMemoryInternal()
+{
+    delete [] m_sharedBuffer;
+}
+
 uint64_t AtomicFunctions::read(uint64_t *address)
 {
    return __sync_fetch_and_add(address, 0);
@@ -128,7 +139,8 @@ struct SyncHeader{
 
 S2ESynchronizedObjectInternal::S2ESynchronizedObjectInternal(unsigned size) {
     m_size = size;
-    m_headerSize = sizeof(SyncHeader);
+    //Keep the shared data cache-line aligned for padded structures
+    m_headerSize = (sizeof(SyncHeader) + S2E_CACHE_LINE_SIZE - 1) & ~(S2E_CACHE_LINE_SIZE - 1);
 
     unsigned totalSize = m_headerSize + size;
 
@@ -161,6 +173,21 @@ S2ESynchronizedObjectInternal::~S2ESynchronizedObjectInternal()
     munmap(m_sharedBuffer, totalSize);
 }
 
+S2ESharedMemoryInternal::S2ESharedMemoryInternal(unsigned size)
+{
+    m_size = size;
+    m_sharedBuffer = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (m_sharedBuffer == MAP_FAILED) {
+        perror("Could not allocate shared memory ");
+        exit(-1);
+    }
+}
+
+S2ESharedMemoryInternal::~S2ESharedMemoryInternal()
+{
+    munmap(m_sharedBuffer, m_size);
+}
+
 void *S2ESynchronizedObjectInternal::aquire() {
     SyncHeader *hdr = (SyncHeader*)m_sharedBuffer;
 #ifdef CONFIG_DARWIN
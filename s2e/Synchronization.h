@@ -38,10 +38,13 @@
 #define S2E_SYNCHRONIZATION_H
 
 #include <inttypes.h>
+#include <new>
 #include <string>
 
 namespace s2e {
 
+#define S2E_CACHE_LINE_SIZE 64
+
 class S2ESynchronizedObjectInternal {
 private:
     uint8_t *m_sharedBuffer;
@@ -107,6 +110,46 @@ public:
 
 };
 
+/**
+ *  Shared memory buffer without any lock, for data structures
+ *  that synchronize on their own (see below).
+ */
+class S2ESharedMemoryInternal {
+private:
+    uint8_t *m_sharedBuffer;
+    unsigned m_size;
+
+public:
+    S2ESharedMemoryInternal(unsigned size);
+    ~S2ESharedMemoryInternal();
+
+    void *get() const {
+        return m_sharedBuffer;
+    }
+};
+
+template <class T>
+class S2ESharedObject {
+private:
+    S2ESharedMemoryInternal mem;
+
+    S2ESharedObject(const S2ESharedObject &);
+
+public:
+    S2ESharedObject():mem(sizeof(T)) {
+        new (mem.get()) T();
+    }
+
+    ~S2ESharedObject() {
+        T* t = (T*)mem.get();
+        t->~T();
+    }
+
+    T* get() const {
+        return (T*)mem.get();
+    }
+};
+
 class AtomicFunctions {
 public:
     static uint64_t read(uint64_t *address);
@@ -133,6 +176,123 @@ public:
     }
 };
 
+/**
+ *  One counter per process, each in its own cache line.
+ *  Processes update their own slot without contending with the
+ *  others, readers sum up all the slots.
+ */
+template <unsigned Processes>
+class PerProcessCounter {
+private:
+    struct Slot {
+        volatile uint64_t value;
+        uint8_t padding[S2E_CACHE_LINE_SIZE - sizeof(uint64_t)];
+    } __attribute__((aligned(S2E_CACHE_LINE_SIZE)));
+
+    Slot m_slots[Processes];
+
+public:
+    PerProcessCounter() {
+        for (unsigned i = 0; i < Processes; ++i) {
+            m_slots[i].value = 0;
+        }
+    }
+
+    void add(unsigned process, uint64_t value) {
+        __sync_fetch_and_add(&m_slots[process].value, value);
+    }
+
+    void set(unsigned process, uint64_t value) {
+        m_slots[process].value = value;
+    }
+
+    uint64_t get(unsigned process) const {
+        return m_slots[process].value;
+    }
+
+    uint64_t sum() const {
+        uint64_t ret = 0;
+        for (unsigned i = 0; i < Processes; ++i) {
+            ret += m_slots[i].value;
+        }
+        return ret;
+    }
+};
+
+/**
+ *  Bounded lock-free multi-producer multi-consumer queue
+ *  (D. Vyukov's algorithm). T must be copyable with memcpy.
+ *  Capacity must be a power of two.
+ */
+template <class T, unsigned Capacity>
+class SharedQueue {
+private:
+    struct Cell {
+        volatile uint64_t sequence;
+        T data;
+    };
+
+    Cell m_cells[Capacity];
+    uint8_t m_padding1[S2E_CACHE_LINE_SIZE];
+    volatile uint64_t m_enqueuePos;
+    uint8_t m_padding2[S2E_CACHE_LINE_SIZE];
+    volatile uint64_t m_dequeuePos;
+
+public:
+    SharedQueue() {
+        for (unsigned i = 0; i < Capacity; ++i) {
+            m_cells[i].sequence = i;
+        }
+        m_enqueuePos = 0;
+        m_dequeuePos = 0;
+    }
+
+    //Returns false if the queue is full
+    bool push(const T &data) {
+        uint64_t pos = m_enqueuePos;
+        for (;;) {
+            Cell *cell = &m_cells[pos & (Capacity - 1)];
+            int64_t diff = (int64_t) cell->sequence - (int64_t) pos;
+            if (diff == 0) {
+                if (__sync_bool_compare_and_swap(&m_enqueuePos, pos, pos + 1)) {
+                    cell->data = data;
+                    __sync_synchronize();
+                    cell->sequence = pos + 1;
+                    return true;
+                }
+                pos = m_enqueuePos;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = m_enqueuePos;
+            }
+        }
+    }
+
+    //Returns false if the queue is empty
+    bool pop(T &data) {
+        uint64_t pos = m_dequeuePos;
+        for (;;) {
+            Cell *cell = &m_cells[pos & (Capacity - 1)];
+            int64_t diff = (int64_t) cell->sequence - (int64_t) (pos + 1);
+            if (diff == 0) {
+                if (__sync_bool_compare_and_swap(&m_dequeuePos, pos, pos + 1)) {
+                    __sync_synchronize();
+                    data = cell->data;
+                    __sync_synchronize();
+                    cell->sequence = pos + Capacity;
+                    return true;
+                }
+                pos = m_dequeuePos;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = m_dequeuePos;
+            }
+        }
+    }
+};
+
 }
 
 #endif
@@ -47,11 +47,17 @@
 extern "C" {
 #endif
 
-//XXX: ugly hack to support underscores
+//Stores the index of the lowest set bit of Mask in SetIndex.
+//Returns 0 only if Mask is 0, SetIndex is then left untouched.
 #ifndef _WIN32
-//#define bit_scan_forward_64 bit_scan_forward_64_posix
-inline 	int bit_scan_forward_64(uint64_t *SetIndex, uint64_t Mask){return 0;}
-int bit_scan_forward_64_posix(uint64_t *SetIndex, uint64_t Mask)  asm ("bit_scan_forward_64_posix");
+static inline int bit_scan_forward_64(uint64_t *SetIndex, uint64_t Mask)
+{
+    if (!Mask) {
+        return 0;
+    }
+    *SetIndex = __builtin_ctzll(Mask);
+    return 1;
+}
 
 #else
 
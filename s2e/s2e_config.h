@@ -65,6 +65,10 @@
 
 #define S2E_MEMCACHE_SUPERPAGE_BITS 20
 
+/** Number of virtual page translations cached by each state
+    for getPhysicalAddress/getHostAddress (log2) */
+#define S2E_TRANSLATION_CACHE_BITS 6
+
 /** Enables simple memory debugging support */
 //#define S2E_DEBUG_MEMORY
 
@@ -0,0 +1,228 @@
+/*
+ * S2E Selective Symbolic Execution Framework
+ *
+ * Copyright (c) 2010, Dependable Systems Laboratory, EPFL
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Dependable Systems Laboratory, EPFL nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE DEPENDABLE SYSTEMS LABORATORY, EPFL BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Currently maintained by:
+ *    Vitaly Chipounov <vitaly.chipounov@epfl.ch>
+ *    Volodymyr Kuznetsov <vova.kuznetsov@epfl.ch>
+ *
+ * All contributors are listed in S2E-AUTHORS file.
+ *
+ */
+
+/**
+ *  Command line front-end for ExecutionTraceReader.
+ *  Lists the states of a trace, prints the items of the path that led to
+ *  a state, or all the items of a given type. The index is built on the
+ *  first use and stored next to the trace.
+ */
+
+#include <s2e/Plugins/ExecutionTracers/ExecutionTraceReader.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace s2e::plugins;
+
+namespace {
+
+const char *s_typeNames[] = {
+    "mod_load", "mod_unload", "proc_unload", "call", "ret",
+    "tb_start", "tb_end", "module_desc", "fork", "cachesim",
+    "testcase", "branchcov", "memory", "pagefault", "tlbmiss",
+    "icount", "mem_checker"
+};
+
+int parseType(const char *s)
+{
+    for (unsigned i = 0; i < sizeof(s_typeNames) / sizeof(s_typeNames[0]); ++i) {
+        if (!strcmp(s, s_typeNames[i])) {
+            return i;
+        }
+    }
+
+    char *end;
+    long type = strtol(s, &end, 0);
+    if (*end || type < 0 || type >= EXECTRACE_INDEX_TYPES) {
+        return -1;
+    }
+    return type;
+}
+
+void printItem(ExecutionTraceReader &trace, uint64_t location, bool hex)
+{
+    const uint8_t *payload;
+    const ExecutionTraceItemHeader *hdr = trace.getItem(location, &payload);
+    if (!hdr) {
+        printf("%#llx: corrupted item\n", (unsigned long long) location);
+        return;
+    }
+
+    const char *typeName = hdr->type < TRACE_MAX ? s_typeNames[hdr->type] : "?";
+    printf("%llu pid=%#llx state=%u %s(%u) size=%u",
+           (unsigned long long) hdr->timeStamp,
+           (unsigned long long) hdr->pid, hdr->stateId, typeName,
+           hdr->type, hdr->size);
+
+    if (hex) {
+        printf(" ");
+        for (unsigned i = 0; i < hdr->size; ++i) {
+            printf("%02x", payload[i]);
+        }
+    }
+    printf("\n");
+}
+
+void usage(const char *prog)
+{
+    std::cerr << "Usage: " << prog << " [-i index] [-x] trace command\n"
+              << "Commands:\n"
+              << "  states            list the states and where they forked\n"
+              << "  path id [type]    items of the path that led to state id\n"
+              << "  type type         all items of the given type\n"
+              << "  index             rebuild the index\n"
+              << "-x prints the payload of the items in hexadecimal.\n"
+              << "The index defaults to trace.idx.\n";
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    std::string indexFile;
+    bool hex = false;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+            indexFile = argv[++i];
+        } else if (!strcmp(argv[i], "-x")) {
+            hex = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - i < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::string traceFile = argv[i++];
+    std::string command = argv[i++];
+    if (indexFile.empty()) {
+        indexFile = traceFile + ".idx";
+    }
+
+    std::string error;
+    ExecutionTraceReader trace;
+    if (!trace.open(traceFile, &error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    if (!error.empty()) {
+        std::cerr << "Warning: " << error << std::endl;
+        error.clear();
+    }
+
+    if (command == "index") {
+        if (!ExecutionTracePathIndex::build(&trace, indexFile, &error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    ExecutionTracePathIndex index;
+    if (!index.open(&trace, indexFile, &error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+
+    if (command == "states") {
+        printf("%llu items, %u states\n",
+               (unsigned long long) index.getItemCount(),
+               index.getStateCount());
+        for (unsigned s = 0; s < index.getStateCount(); ++s) {
+            const ExecutionTraceIndexState *state = index.getState(s);
+            printf("state %u: %llu items", state->stateId,
+                   (unsigned long long) state->locationCount);
+            if (state->forkItem != EXECTRACE_INDEX_NONE) {
+                printf(", forked from state %u at its item %llu",
+                       state->parentId,
+                       (unsigned long long) state->forkItem);
+            }
+            printf("\n");
+        }
+    } else if (command == "path" && argc - i >= 1) {
+        uint32_t stateId = strtoul(argv[i++], NULL, 0);
+        int type = -1;
+        if (argc - i >= 1 && (type = parseType(argv[i])) < 0) {
+            std::cerr << "Unknown item type " << argv[i] << std::endl;
+            return 1;
+        }
+
+        std::vector<uint64_t> locations;
+        if (!index.getPath(stateId, &locations)) {
+            std::cerr << "Unknown state " << stateId << std::endl;
+            return 1;
+        }
+
+        for (unsigned l = 0; l < locations.size(); ++l) {
+            const uint8_t *payload;
+            const ExecutionTraceItemHeader *hdr =
+                    trace.getItem(locations[l], &payload);
+            if (type < 0 || !hdr || hdr->type == type) {
+                printItem(trace, locations[l], hex);
+            }
+        }
+    } else if (command == "type" && argc - i >= 1) {
+        int type = parseType(argv[i]);
+        if (type < 0) {
+            std::cerr << "Unknown item type " << argv[i] << std::endl;
+            return 1;
+        }
+
+        const uint64_t *locations;
+        uint64_t count;
+        index.getItemsOfType(type, &locations, &count);
+        for (uint64_t l = 0; l < count; ++l) {
+            printItem(trace, locations[l], hex);
+        }
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+
+    return 0;
+}
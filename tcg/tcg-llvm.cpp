@@ -78,15 +78,27 @@ static void *qemu_st_helpers[5] = {
 #include <llvm/PassManager.h>
 #include <llvm/Intrinsics.h>
 #include <llvm/Analysis/Verifier.h>
+#include <llvm/Bitcode/ReaderWriter.h>
 #include <llvm/Target/TargetData.h>
 #include <llvm/Target/TargetSelect.h>
 #include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 #include <llvm/Support/IRBuilder.h>
 
 #include <llvm/System/DynamicLibrary.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#ifdef CONFIG_S2E
+#include <s2e/S2EExecutor.h>
+#endif
 
 #include <iostream>
 #include <sstream>
+#include <fstream>
+#include <list>
+#include <map>
+#include <vector>
+#include <cstdio>
 
 extern "C" {
     TCGLLVMContext* tcg_llvm_ctx = 0;
@@ -95,7 +107,7 @@ extern "C" {
     TCGLLVMRuntime tcg_llvm_runtime = {
         0, 0, {0,0,0}
 #ifdef CONFIG_S2E
-        , 0
+        , 0, 0
 #endif
 #ifndef CONFIG_S2E
         , 0, 0, 0
@@ -130,10 +142,52 @@ struct TCGLLVMContextPrivate {
     /* Function pass manager (used for optimizing the code) */
     FunctionPassManager *m_functionPassManager;
 
+    /* Passes run on every generated TB function (NULL if disabled) */
+    FunctionPassManager *m_tbPassManager;
+    unsigned m_tbOptimizationLevel;
+
+    /* LLVM instruction count of the last TB before and after
+       running m_tbPassManager */
+    unsigned m_lastTbInstructions;
+    unsigned m_lastTbOptimizedInstructions;
+
+    /* Cache of optimized TB functions, indexed by a hash of the TCG ops
+       of the TB. The cached functions live in their own module, so that
+       they survive tb_flush and can be written to a bitcode file.
+       Host pointers specific to one TB (the TB itself and its execution
+       signals) are replaced by placeholders in the cached copy.
+       The cache holds at most m_tbCacheMaxSize functions and evicts the
+       least recently used one first. */
+    typedef std::pair<uint64_t, uint64_t> TbCacheKey;
+    typedef std::list<TbCacheKey> TbCacheLru;
+    struct TbCacheEntry {
+        Function *function;
+        TbCacheLru::iterator lru;
+    };
+    typedef std::map<TbCacheKey, TbCacheEntry> TbCache;
+    bool m_tbCacheEnabled;
+    uint64_t m_tbCacheSeed;
+    unsigned m_tbCacheMaxSize;
+    Module *m_tbCacheModule;
+    TbCache m_tbCache;
+    TbCacheLru m_tbCacheLru;
+    bool m_lastTbFromCache;
+
+    /* Generated TB and trace functions that are still in use, with the
+       size of their JIT code (0 if they were never compiled). Released
+       functions wait in m_deadFunctions until compactModule() erases
+       them from m_module. */
+    typedef std::map<Function*, unsigned> LiveFunctions;
+    LiveFunctions m_liveFunctions;
+    std::vector<Function*> m_deadFunctions;
+    uint64_t m_liveJitBytes;
+    uint64_t m_freedJitBytes;
+
 #ifdef CONFIG_S2E
     /* Declaration of a wrapper function for helpers */
     Function *m_helperTraceMemoryAccess;
     Function *m_helperForkAndConcretize;
+    Function *m_helperTraceNext;
     Function* m_qemu_ld_helpers[5];
     Function* m_qemu_st_helpers[5];
 #endif
@@ -176,6 +230,22 @@ public:
         return m_functionPassManager;
     }
 
+    FunctionPassManager *getTbPassManager() const {
+        return m_tbPassManager;
+    }
+
+    void setTbOptimizationLevel(unsigned level);
+
+    void registerFunction(Function *f, unsigned jitBytes);
+    void releaseFunction(Function *f);
+    unsigned compactModule();
+
+    void enableTbCache(uint64_t fingerprint, unsigned maxSize);
+    Function* lookupTbCache(const TbCacheKey &key);
+    void insertTbCache(const TbCacheKey &key, Function *f);
+    bool loadTbCache(const std::string &fileName, std::string *error);
+    bool saveTbCache(const std::string &fileName, std::string *error);
+
     /* Shortcuts */
     const Type* intType(int w) { return IntegerType::get(m_context, w); }
     const Type* intPtrType(int w) { return PointerType::get(intType(w), 0); }
@@ -215,7 +285,22 @@ public:
 
     int generateOperation(int opc, const TCGArg *args);
 
+    void generateFunction(TCGContext *s, const std::string &name);
     void generateCode(TCGContext *s, TranslationBlock *tb);
+
+    /* TB cache */
+    void computeTbCacheKey(TranslationBlock *tb, TbCacheKey *key,
+                           std::vector<uint64_t> *relocations);
+    Function* cloneTbFunction(const Function *from, Module *to,
+                              const std::string &name,
+                              const std::vector<uint64_t> &fromValues,
+                              const std::vector<uint64_t> &toValues,
+                              bool declareMissing);
+
+#ifdef CONFIG_S2E
+    Function* generateTrace(TranslationBlock **tbs, const unsigned *exits,
+                            unsigned count);
+#endif
 };
 
 /* Custom JITMemoryManager in order to capture the size of
@@ -286,8 +371,13 @@ public:
 };
 
 TCGLLVMContextPrivate::TCGLLVMContextPrivate()
-    : m_context(getGlobalContext()), m_builder(m_context), m_tbCount(0),
-      m_tcgContext(NULL), m_tbFunction(NULL)
+    : m_context(getGlobalContext()), m_builder(m_context),
+      m_tbPassManager(NULL), m_tbOptimizationLevel(0),
+      m_lastTbInstructions(0), m_lastTbOptimizedInstructions(0),
+      m_tbCacheEnabled(false), m_tbCacheSeed(0), m_tbCacheMaxSize(0),
+      m_tbCacheModule(NULL),
+      m_lastTbFromCache(false), m_liveJitBytes(0), m_freedJitBytes(0),
+      m_tbCount(0), m_tcgContext(NULL), m_tbFunction(NULL)
 {
     std::memset(m_values, 0, sizeof(m_values));
     std::memset(m_memValuesPtr, 0, sizeof(m_memValuesPtr));
@@ -328,6 +418,8 @@ TCGLLVMContextPrivate::TCGLLVMContextPrivate()
 
 TCGLLVMContextPrivate::~TCGLLVMContextPrivate()
 {
+    delete m_tbCacheModule;
+    delete m_tbPassManager;
     delete m_functionPassManager;
 
     // the following line will also delete
@@ -337,6 +429,47 @@ TCGLLVMContextPrivate::~TCGLLVMContextPrivate()
     }
 }
 
+/* Level 0 leaves TB functions as generated.
+   Level 1 promotes local temps to registers and folds the resulting
+   expressions. Level 2 also removes redundant loads and dead stores to
+   the CPU state, most of which come from the TCG globals being synced
+   to memory around each helper call. */
+void TCGLLVMContextPrivate::setTbOptimizationLevel(unsigned level)
+{
+    delete m_tbPassManager;
+    m_tbPassManager = NULL;
+    m_tbOptimizationLevel = level;
+
+    if (level == 0) {
+        return;
+    }
+
+    m_tbPassManager = new FunctionPassManager(m_moduleProvider);
+    m_tbPassManager->add(
+            new TargetData(*m_executionEngine->getTargetData()));
+
+    m_tbPassManager->add(createPromoteMemoryToRegisterPass());
+    m_tbPassManager->add(createInstructionCombiningPass());
+
+    if (level >= 2) {
+        m_tbPassManager->add(createGVNPass());
+        m_tbPassManager->add(createDeadStoreEliminationPass());
+        m_tbPassManager->add(createInstructionCombiningPass());
+    }
+
+    m_tbPassManager->add(createCFGSimplificationPass());
+    m_tbPassManager->doInitialization();
+}
+
+static unsigned countInstructions(const Function &f)
+{
+    unsigned count = 0;
+    for (Function::const_iterator it = f.begin(); it != f.end(); ++it) {
+        count += it->size();
+    }
+    return count;
+}
+
 #ifdef CONFIG_S2E
 void TCGLLVMContextPrivate::initializeHelpers()
 {
@@ -346,6 +479,12 @@ void TCGLLVMContextPrivate::initializeHelpers()
     m_helperForkAndConcretize =
             m_module->getFunction("tcg_llvm_fork_and_concretize");
 
+    /* Special function called by traces between two tbs */
+    m_helperTraceNext = cast<Function>(m_module->getOrInsertFunction(
+            "tcg_llvm_trace_next",
+            FunctionType::get(intType(8),
+                    std::vector<const Type*>(3, intType(64)), false)));
+
     m_qemu_ld_helpers[0] = m_module->getFunction("__ldb_mmu");
     m_qemu_ld_helpers[1] = m_module->getFunction("__ldw_mmu");
     m_qemu_ld_helpers[2] = m_module->getFunction("__ldl_mmu");
@@ -1237,22 +1376,15 @@ int TCGLLVMContextPrivate::generateOperation(int opc, const TCGArg *args)
     return nb_args;
 }
 
-void TCGLLVMContextPrivate::generateCode(TCGContext *s, TranslationBlock *tb)
+/* Translates the TCG ops of the current TB into m_tbFunction */
+void TCGLLVMContextPrivate::generateFunction(TCGContext *s,
+                                             const std::string &name)
 {
-    /* Create new function for current translation block */
-    std::ostringstream fName;
-    fName << "tcg-llvm-tb-" << (m_tbCount++) << "-" << std::hex << tb->pc;
-
-    /*
-    if(m_tbFunction)
-        m_tbFunction->eraseFromParent();
-    */
-
     FunctionType *tbFunctionType = FunctionType::get(
             wordType(),
             std::vector<const Type*>(1, intPtrType(64)), false);
     m_tbFunction = Function::Create(tbFunctionType,
-            Function::PrivateLinkage, fName.str(), m_module);
+            Function::PrivateLinkage, name, m_module);
     BasicBlock *basicBlock = BasicBlock::Create(m_context,
             "entry", m_tbFunction);
     m_builder.SetInsertPoint(basicBlock);
@@ -1311,7 +1443,372 @@ void TCGLLVMContextPrivate::generateCode(TCGContext *s, TranslationBlock *tb)
     verifyFunction(*m_tbFunction);
 #endif
 
-    //m_functionPassManager->run(*m_tbFunction);
+    m_lastTbInstructions = countInstructions(*m_tbFunction);
+    if (m_tbPassManager) {
+        m_tbPassManager->run(*m_tbFunction);
+        m_lastTbOptimizedInstructions = countInstructions(*m_tbFunction);
+    } else {
+        m_lastTbOptimizedInstructions = m_lastTbInstructions;
+    }
+}
+
+/* Placeholders for TB-specific pointers in cached functions. The tag
+   makes them non-canonical addresses, so they never collide with real
+   pointers. Each placeholder covers 4 values, for exit_tb(tb + n). */
+#define TB_CACHE_PLACEHOLDER 0xfeed000000000000ULL
+#define TB_CACHE_RELOCATION  0xfeedfacecafebeefULL
+#define TB_CACHE_HELPER      0xfeedfacecafef00dULL
+
+static void tbCacheHash(uint64_t *h1, uint64_t *h2, uint64_t value)
+{
+    *h1 = (*h1 ^ value) * 1099511628211ULL;
+    *h2 ^= value + 0x9e3779b97f4a7c15ULL + (*h2 << 6) + (*h2 >> 2);
+}
+
+static std::string tbCacheName(const std::pair<uint64_t, uint64_t> &key)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "tcg-llvm-cache-%016llx-%016llx",
+             (unsigned long long) key.first, (unsigned long long) key.second);
+    return buf;
+}
+
+/* Hashes a reference to base + offset, base being one of the TB-specific
+   pointers listed in relocations (added if it is not there yet) */
+static void tbCacheHashRelocation(uint64_t *h1, uint64_t *h2,
+                                  std::vector<uint64_t> *relocations,
+                                  uint64_t base, uint64_t offset)
+{
+    unsigned r;
+    for(r = 0; r < relocations->size(); ++r) {
+        if((*relocations)[r] == base) {
+            break;
+        }
+    }
+    if(r == relocations->size()) {
+        relocations->push_back(base);
+    }
+
+    tbCacheHash(h1, h2, TB_CACHE_RELOCATION);
+    tbCacheHash(h1, h2, (r << 2) | offset);
+}
+
+/* The key covers everything that determines the generated code: the
+   guest instructions, the cpu flags used by the translator and the
+   instrumentation inserted by plugins all end up in the TCG ops.
+
+   Host pointers are normalized where the op says what they are:
+   exit_tb(tb + n) and constants that are exactly the TB or one of its
+   execution signals are hashed by order of appearance and returned in
+   relocations, constants that are helper addresses are hashed by helper
+   name, which is how the generated code references them. Any other host
+   address (e.g., a global passed to a helper) is hashed as is: such TBs
+   only hit the cache within a run, or across runs of an emulator that is
+   loaded at the same address (i.e., not built as PIE). */
+void TCGLLVMContextPrivate::computeTbCacheKey(TranslationBlock *tb,
+                                              TbCacheKey *key,
+                                              std::vector<uint64_t> *relocations)
+{
+    std::vector<uint64_t> candidates(1, (uint64_t) tb);
+#ifdef CONFIG_S2E
+    const std::vector<void*> &signals = tb->s2e_tb->executionSignals;
+    for(unsigned i = 0; i < signals.size(); ++i) {
+        candidates.push_back((uint64_t) signals[i]);
+    }
+#endif
+
+    uint64_t h1 = 14695981039346656037ULL ^ m_tbCacheSeed;
+    uint64_t h2 = m_tbCacheSeed;
+
+    relocations->clear();
+
+    const TCGArg *args = gen_opparam_buf;
+    for(int opc_index=0; ;++opc_index) {
+        int opc = gen_opc_buf[opc_index];
+        tbCacheHash(&h1, &h2, opc);
+
+        if(opc == INDEX_op_end)
+            break;
+
+        int nb_args = tcg_op_defs[opc].nb_args;
+        if(opc == INDEX_op_nopn) {
+            nb_args = args[0];
+        } else if(opc == INDEX_op_call) {
+            nb_args = (args[0] >> 16) + (args[0] & 0xffff) +
+                      tcg_op_defs[opc].nb_cargs + 1;
+        }
+
+        bool isMovi = opc == INDEX_op_movi_i32;
+#if TCG_TARGET_REG_BITS == 64
+        isMovi = isMovi || opc == INDEX_op_movi_i64;
+#endif
+
+        for(int i = 0; i < nb_args; ++i) {
+            uint64_t arg = args[i];
+
+            if(opc == INDEX_op_exit_tb && arg && arg - (uint64_t) tb < 4) {
+                tbCacheHashRelocation(&h1, &h2, relocations,
+                                      (uint64_t) tb, arg - (uint64_t) tb);
+                continue;
+            }
+
+            if(isMovi && i == 1) {
+                unsigned c;
+                for(c = 0; c < candidates.size(); ++c) {
+                    if(arg == candidates[c]) {
+                        break;
+                    }
+                }
+                if(c != candidates.size()) {
+                    tbCacheHashRelocation(&h1, &h2, relocations, arg, 0);
+                    continue;
+                }
+
+                const char *helperName = arg ?
+                    tcg_helper_get_name(m_tcgContext, (void*) arg) : NULL;
+                if(helperName) {
+                    tbCacheHash(&h1, &h2, TB_CACHE_HELPER);
+                    for(const char *c = helperName; *c; ++c) {
+                        tbCacheHash(&h1, &h2, *c);
+                    }
+                    continue;
+                }
+            }
+
+            tbCacheHash(&h1, &h2, arg);
+        }
+
+        args += nb_args;
+    }
+
+    *key = std::make_pair(h1, h2);
+}
+
+/* Maps the global values referenced by v to their counterparts in module to */
+static bool mapGlobalValues(const Value *v, Module *to,
+                            DenseMap<const Value*, Value*> &valueMap,
+                            bool declareMissing)
+{
+    if(const GlobalValue *gv = dyn_cast<GlobalValue>(v)) {
+        if(valueMap.count(gv)) {
+            return true;
+        }
+
+        GlobalValue *mapped = NULL;
+        if(const Function *f = dyn_cast<Function>(gv)) {
+            mapped = to->getFunction(f->getName());
+            if(!mapped && declareMissing) {
+                mapped = Function::Create(f->getFunctionType(),
+                        GlobalValue::ExternalLinkage, f->getName(), to);
+            }
+        } else if(const GlobalVariable *g = dyn_cast<GlobalVariable>(gv)) {
+            mapped = to->getGlobalVariable(g->getName(), true);
+            if(!mapped && declareMissing) {
+                mapped = new GlobalVariable(*to,
+                        g->getType()->getElementType(), g->isConstant(),
+                        GlobalValue::ExternalLinkage, NULL, g->getName());
+            }
+        }
+
+        if(!mapped || mapped->getType() != gv->getType()) {
+            return false;
+        }
+        valueMap[gv] = mapped;
+        return true;
+    }
+
+    if(const ConstantExpr *ce = dyn_cast<ConstantExpr>(v)) {
+        for(unsigned i = 0; i < ce->getNumOperands(); ++i) {
+            if(!mapGlobalValues(ce->getOperand(i), to, valueMap,
+                                declareMissing)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/* Copies a TB function to module to, replacing fromValues[i] + n by
+   toValues[i] + n. Returns NULL if to lacks a referenced global. */
+Function* TCGLLVMContextPrivate::cloneTbFunction(const Function *from,
+                                  Module *to, const std::string &name,
+                                  const std::vector<uint64_t> &fromValues,
+                                  const std::vector<uint64_t> &toValues,
+                                  bool declareMissing)
+{
+    assert(fromValues.size() == toValues.size());
+    DenseMap<const Value*, Value*> valueMap;
+
+    for(Function::const_iterator bb = from->begin(); bb != from->end(); ++bb) {
+        for(BasicBlock::const_iterator it = bb->begin(); it != bb->end(); ++it) {
+            for(unsigned i = 0; i < it->getNumOperands(); ++i) {
+                if(!mapGlobalValues(it->getOperand(i), to, valueMap,
+                                    declareMissing)) {
+                    return NULL;
+                }
+            }
+        }
+    }
+
+    for(unsigned i = 0; i < fromValues.size(); ++i) {
+        for(unsigned n = 0; n < 4; ++n) {
+            valueMap[ConstantInt::get(wordType(), fromValues[i] + n)] =
+                    ConstantInt::get(wordType(), toValues[i] + n);
+        }
+    }
+
+    Function *f = Function::Create(from->getFunctionType(),
+            Function::PrivateLinkage, name, to);
+    valueMap[from->arg_begin()] = f->arg_begin();
+
+    std::vector<ReturnInst*> returns;
+    CloneFunctionInto(f, from, valueMap, returns);
+    return f;
+}
+
+void TCGLLVMContextPrivate::enableTbCache(uint64_t fingerprint,
+                                          unsigned maxSize)
+{
+    /* Host addresses used by the generated code change between
+       builds, make sure that such caches miss */
+    uint64_t h1 = 14695981039346656037ULL, h2 = fingerprint;
+    const char *build = __DATE__ " " __TIME__;
+    for(const char *c = build; *c; ++c) {
+        tbCacheHash(&h1, &h2, *c);
+    }
+    tbCacheHash(&h1, &h2, (uint64_t) &tcg_llvm_runtime);
+    tbCacheHash(&h1, &h2, m_tbOptimizationLevel);
+
+    m_tbCacheSeed = h1 ^ h2;
+    m_tbCacheMaxSize = maxSize;
+    m_tbCacheEnabled = true;
+    if(!m_tbCacheModule) {
+        m_tbCacheModule = new Module("tcg-llvm-cache", m_context);
+    }
+}
+
+Function* TCGLLVMContextPrivate::lookupTbCache(const TbCacheKey &key)
+{
+    TbCache::iterator it = m_tbCache.find(key);
+    if(it == m_tbCache.end()) {
+        return NULL;
+    }
+
+    /* Most recently used entries are at the front */
+    m_tbCacheLru.splice(m_tbCacheLru.begin(), m_tbCacheLru, (*it).second.lru);
+    return (*it).second.function;
+}
+
+void TCGLLVMContextPrivate::insertTbCache(const TbCacheKey &key, Function *f)
+{
+    assert(m_tbCache.find(key) == m_tbCache.end());
+
+    m_tbCacheLru.push_front(key);
+    TbCacheEntry &entry = m_tbCache[key];
+    entry.function = f;
+    entry.lru = m_tbCacheLru.begin();
+
+    while(m_tbCache.size() > m_tbCacheMaxSize) {
+        TbCache::iterator victim = m_tbCache.find(m_tbCacheLru.back());
+        assert(victim != m_tbCache.end());
+        (*victim).second.function->eraseFromParent();
+        m_tbCache.erase(victim);
+        m_tbCacheLru.pop_back();
+    }
+}
+
+bool TCGLLVMContextPrivate::loadTbCache(const std::string &fileName,
+                                        std::string *error)
+{
+    assert(m_tbCacheEnabled && m_tbCache.empty());
+
+    MemoryBuffer *buffer = MemoryBuffer::getFile(fileName.c_str(), error);
+    if(!buffer) {
+        return false;
+    }
+
+    Module *module = ParseBitcodeFile(buffer, m_context, error);
+    delete buffer;
+    if(!module) {
+        return false;
+    }
+
+    delete m_tbCacheModule;
+    m_tbCacheModule = module;
+
+    /* Insertion may evict the function just inserted, advance first */
+    for(Module::iterator it = module->begin(); it != module->end(); ) {
+        Function *f = it++;
+        unsigned long long h1, h2;
+        if(sscanf(f->getNameStr().c_str(), "tcg-llvm-cache-%llx-%llx",
+                  &h1, &h2) == 2 && !f->isDeclaration()) {
+            TbCacheKey key = std::make_pair((uint64_t) h1, (uint64_t) h2);
+            if(m_tbCache.find(key) == m_tbCache.end()) {
+                insertTbCache(key, f);
+            }
+        }
+    }
+
+    return true;
+}
+
+bool TCGLLVMContextPrivate::saveTbCache(const std::string &fileName,
+                                        std::string *error)
+{
+    assert(m_tbCacheEnabled);
+
+    std::ofstream o(fileName.c_str(), std::ofstream::binary);
+    if(!o) {
+        *error = "could not open " + fileName;
+        return false;
+    }
+
+    WriteBitcodeToFile(m_tbCacheModule, o);
+    o.close();
+    return true;
+}
+
+void TCGLLVMContextPrivate::generateCode(TCGContext *s, TranslationBlock *tb)
+{
+    /* Create new function for current translation block */
+    std::ostringstream fName;
+    fName << "tcg-llvm-tb-" << (m_tbCount++) << "-" << std::hex << tb->pc;
+
+    m_tcgContext = s;
+    m_tbFunction = NULL;
+    m_lastTbFromCache = false;
+
+    TbCacheKey key;
+    std::vector<uint64_t> relocations, placeholders;
+    if(m_tbCacheEnabled) {
+        computeTbCacheKey(tb, &key, &relocations);
+        for(unsigned i = 0; i < relocations.size(); ++i) {
+            placeholders.push_back(TB_CACHE_PLACEHOLDER + (i << 2));
+        }
+
+        if(Function *cached = lookupTbCache(key)) {
+            m_tbFunction = cloneTbFunction(cached, m_module, fName.str(),
+                                           placeholders, relocations, false);
+            m_lastTbFromCache = m_tbFunction != NULL;
+        }
+    }
+
+    if(!m_tbFunction) {
+        generateFunction(s, fName.str());
+
+        if(m_tbCacheEnabled) {
+            Function *cached = cloneTbFunction(m_tbFunction, m_tbCacheModule,
+                                               tbCacheName(key),
+                                               relocations, placeholders,
+                                               true);
+            if(cached && !lookupTbCache(key)) {
+                insertTbCache(key, cached);
+            } else if(cached) {
+                cached->eraseFromParent();
+            }
+        }
+    }
 
     tb->llvm_function = m_tbFunction;
 
@@ -1329,6 +1826,8 @@ void TCGLLVMContextPrivate::generateCode(TCGContext *s, TranslationBlock *tb)
     }
 #endif
 
+    registerFunction(m_tbFunction, tb->llvm_tc_end - tb->llvm_tc_ptr);
+
 #ifdef DEBUG_DISAS
     if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP))) {
         qemu_log("OP:\n");
@@ -1347,6 +1846,141 @@ void TCGLLVMContextPrivate::generateCode(TCGContext *s, TranslationBlock *tb)
     }
 }
 
+void TCGLLVMContextPrivate::registerFunction(Function *f, unsigned jitBytes)
+{
+    assert(m_liveFunctions.find(f) == m_liveFunctions.end());
+    m_liveFunctions[f] = jitBytes;
+    m_liveJitBytes += jitBytes;
+}
+
+/* The machine code of a released function is freed right away, since
+   nothing can jump into it anymore. The function itself is only erased
+   by compactModule(): it may still be called by other released functions
+   (e.g., a trace whose tbs could not be inlined). */
+void TCGLLVMContextPrivate::releaseFunction(Function *f)
+{
+    LiveFunctions::iterator it = m_liveFunctions.find(f);
+    assert(it != m_liveFunctions.end() && "Releasing an unknown function");
+
+    if((*it).second) {
+        if(m_executionEngine) {
+            m_executionEngine->freeMachineCodeForFunction(f);
+        }
+        m_liveJitBytes -= (*it).second;
+        m_freedJitBytes += (*it).second;
+    }
+
+    m_liveFunctions.erase(it);
+    m_deadFunctions.push_back(f);
+}
+
+/* Erases every released function that is not referenced anymore.
+   Erasing a function may release the last use of another one,
+   hence the loop. */
+unsigned TCGLLVMContextPrivate::compactModule()
+{
+    unsigned erased = 0;
+    bool progress = true;
+
+    while(progress) {
+        progress = false;
+        std::vector<Function*>::iterator it = m_deadFunctions.begin();
+        while(it != m_deadFunctions.end()) {
+            if((*it)->use_empty()) {
+                (*it)->eraseFromParent();
+                it = m_deadFunctions.erase(it);
+                ++erased;
+                progress = true;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    return erased;
+}
+
+#ifdef CONFIG_S2E
+Function* TCGLLVMContextPrivate::generateTrace(TranslationBlock **tbs,
+                                               const unsigned *exits,
+                                               unsigned count)
+{
+    assert(count > 1);
+
+    std::ostringstream fName;
+    fName << "tcg-llvm-trace-" << (m_tbCount++) << "-" << std::hex
+          << tbs[0]->pc << "-" << std::dec << count;
+
+    FunctionType *tbFunctionType = FunctionType::get(
+            wordType(),
+            std::vector<const Type*>(1, intPtrType(64)), false);
+    Function *trace = Function::Create(tbFunctionType,
+            Function::PrivateLinkage, fName.str(), m_module);
+    Value *args = trace->arg_begin();
+
+    m_builder.SetInsertPoint(BasicBlock::Create(m_context, "entry", trace));
+
+    std::vector<CallInst*> calls;
+    for(unsigned i = 0; i < count; ++i) {
+        assert(tbs[i]->llvm_function);
+        CallInst *ret = m_builder.CreateCall(tbs[i]->llvm_function, args);
+        calls.push_back(ret);
+
+        if(i == count - 1) {
+            m_builder.CreateRet(ret);
+            break;
+        }
+
+        /* The executor checks that the tb left through the exit the
+           trace was built for and that the link still holds, and does
+           the per-tb bookkeeping of the next tb */
+        std::vector<Value*> nextArgs;
+        nextArgs.push_back(ConstantInt::get(intType(64), (uint64_t) tbs[i]));
+        nextArgs.push_back(ConstantInt::get(intType(64), exits[i]));
+        nextArgs.push_back(ConstantInt::get(intType(64), (uint64_t) tbs[i+1]));
+        Value *linked = m_builder.CreateCall(m_helperTraceNext,
+                                             nextArgs.begin(), nextArgs.end());
+
+        BasicBlock *next = BasicBlock::Create(m_context, "next", trace);
+        BasicBlock *exit = BasicBlock::Create(m_context, "exit", trace);
+        m_builder.CreateCondBr(m_builder.CreateICmpNE(linked,
+                    ConstantInt::get(intType(8), 0)), next, exit);
+
+        m_builder.SetInsertPoint(exit);
+        m_builder.CreateRet(ret);
+
+        m_builder.SetInsertPoint(next);
+    }
+
+    /* Inline the tbs so that the passes can optimize across them */
+    const TargetData *targetData = m_executionEngine->getTargetData();
+    for(unsigned i = 0; i < calls.size(); ++i) {
+        InlineFunction(calls[i], NULL, targetData);
+    }
+
+#ifndef NDEBUG
+    verifyFunction(*trace);
+#endif
+
+    if (m_tbPassManager) {
+        m_tbPassManager->run(*trace);
+    }
+
+    registerFunction(trace, 0);
+
+    if(qemu_loglevel_mask(CPU_LOG_LLVM_IR)) {
+        std::ostringstream s;
+        s << *trace;
+        qemu_log("OUT (LLVM IR, trace):\n");
+        qemu_log("%s", s.str().c_str());
+        qemu_log("\n");
+        qemu_log_flush();
+    }
+
+    return trace;
+}
+#endif
+
 /***********************************/
 /* External interface for C++ code */
 
@@ -1365,6 +1999,80 @@ llvm::FunctionPassManager* TCGLLVMContext::getFunctionPassManager() const
     return m_private->getFunctionPassManager();
 }
 
+llvm::FunctionPassManager* TCGLLVMContext::getTbPassManager() const
+{
+    return m_private->getTbPassManager();
+}
+
+void TCGLLVMContext::setTbOptimizationLevel(unsigned level)
+{
+    m_private->setTbOptimizationLevel(level);
+}
+
+void TCGLLVMContext::getLastTbInstructionCount(unsigned *generated,
+                                               unsigned *optimized) const
+{
+    *generated = m_private->m_lastTbInstructions;
+    *optimized = m_private->m_lastTbOptimizedInstructions;
+}
+
+void TCGLLVMContext::enableTbCache(uint64_t fingerprint, unsigned maxSize)
+{
+    m_private->enableTbCache(fingerprint, maxSize);
+}
+
+bool TCGLLVMContext::loadTbCache(const std::string &fileName,
+                                 std::string *error)
+{
+    return m_private->loadTbCache(fileName, error);
+}
+
+bool TCGLLVMContext::saveTbCache(const std::string &fileName,
+                                 std::string *error)
+{
+    return m_private->saveTbCache(fileName, error);
+}
+
+bool TCGLLVMContext::isLastTbFromCache() const
+{
+    return m_private->m_lastTbFromCache;
+}
+
+unsigned TCGLLVMContext::getTbCacheSize() const
+{
+    return m_private->m_tbCache.size();
+}
+
+void TCGLLVMContext::releaseFunction(Function *f)
+{
+    m_private->releaseFunction(f);
+}
+
+unsigned TCGLLVMContext::compactModule()
+{
+    return m_private->compactModule();
+}
+
+unsigned TCGLLVMContext::getLiveFunctionCount() const
+{
+    return m_private->m_liveFunctions.size();
+}
+
+unsigned TCGLLVMContext::getDeadFunctionCount() const
+{
+    return m_private->m_deadFunctions.size();
+}
+
+uint64_t TCGLLVMContext::getLiveJitBytes() const
+{
+    return m_private->m_liveJitBytes;
+}
+
+uint64_t TCGLLVMContext::getFreedJitBytes() const
+{
+    return m_private->m_freedJitBytes;
+}
+
 void TCGLLVMContext::deleteExecutionEngine()
 {
     m_private->deleteExecutionEngine();
@@ -1406,6 +2114,14 @@ void TCGLLVMContext::generateCode(TCGContext *s, TranslationBlock *tb)
     m_private->generateCode(s, tb);
 }
 
+#ifdef CONFIG_S2E
+Function* TCGLLVMContext::generateTrace(TranslationBlock **tbs,
+                                        const unsigned *exits, unsigned count)
+{
+    return m_private->generateTrace(tbs, exits, count);
+}
+#endif
+
 /*****************************/
 /* Functions for QEMU c code */
 
@@ -1433,7 +2149,8 @@ void tcg_llvm_tb_alloc(TranslationBlock *tb)
 void tcg_llvm_tb_free(TranslationBlock *tb)
 {
     if(tb->llvm_function) {
-        tb->llvm_function->eraseFromParent();
+        tb->tcg_llvm_context->releaseFunction(tb->llvm_function);
+        tb->tcg_llvm_context->compactModule();
     }
 }
 
@@ -61,6 +61,9 @@ struct TCGLLVMRuntime {
 #ifdef CONFIG_S2E
     /* run-time tb linking mechanism */
     uint8_t goto_tb;
+
+    /* incremented each time a tb is unlinked (see tb_reset_jump) */
+    uint32_t tb_unlink_count;
 #endif
 
 #ifndef CONFIG_S2E
@@ -98,6 +101,8 @@ int tcg_llvm_search_last_pc(struct TranslationBlock *tb, uintptr_t searched_pc);
 /***********************************/
 /* External interface for C++ code */
 
+#include <string>
+
 namespace llvm {
     class Function;
     class LLVMContext;
@@ -127,6 +132,49 @@ public:
     void deleteExecutionEngine();
     llvm::FunctionPassManager* getFunctionPassManager() const;
 
+    /** Passes run on each generated TB function, NULL if disabled */
+    llvm::FunctionPassManager* getTbPassManager() const;
+
+    /** Selects the optimization passes run on TB functions (0-2) */
+    void setTbOptimizationLevel(unsigned level);
+
+    /** LLVM instruction count of the last generated TB function,
+        before and after running the TB passes */
+    void getLastTbInstructionCount(unsigned *generated,
+                                   unsigned *optimized) const;
+
+    /** Reuses the LLVM code of TBs whose TCG ops were already translated,
+        even across tb_flush. The fingerprint must identify the settings
+        that affect the generated code (e.g., the passes). At most
+        maxSize TBs are kept, the least recently used ones are evicted. */
+    void enableTbCache(uint64_t fingerprint, unsigned maxSize);
+
+    /** Reads or writes the cached TB functions as a bitcode file */
+    bool loadTbCache(const std::string &fileName, std::string *error);
+    bool saveTbCache(const std::string &fileName, std::string *error);
+
+    /** True if the last TB function came from the cache */
+    bool isLastTbFromCache() const;
+    unsigned getTbCacheSize() const;
+
+    /** Hands back a function returned by generateCode or generateTrace
+        once nothing can execute it anymore. Its JIT code is freed right
+        away, the function itself by the next compactModule(). */
+    void releaseFunction(llvm::Function *f);
+
+    /** Erases the released functions from the module.
+        Returns the number of erased functions. */
+    unsigned compactModule();
+
+    /** Generated functions not yet released, and released functions
+        still waiting to be erased */
+    unsigned getLiveFunctionCount() const;
+    unsigned getDeadFunctionCount() const;
+
+    /** JIT code size of the live functions, and total freed so far */
+    uint64_t getLiveJitBytes() const;
+    uint64_t getFreedJitBytes() const;
+
 #ifdef CONFIG_S2E
     /** Called after linking all helper libraries */
     void initializeHelpers();
@@ -134,6 +182,15 @@ public:
 
     void generateCode(struct TCGContext *s,
                       struct TranslationBlock *tb);
+
+#ifdef CONFIG_S2E
+    /** Builds a function that executes count chained tbs in a row.
+        tbs[i + 1] must be linked to tbs[i] through its goto_tb exits[i].
+        Between two tbs, the trace calls tcg_llvm_trace_next(tbs[i],
+        exits[i], tbs[i + 1]) and returns to the caller if it yields 0. */
+    llvm::Function* generateTrace(struct TranslationBlock **tbs,
+                                  const unsigned *exits, unsigned count);
+#endif
 };
 
 #endif